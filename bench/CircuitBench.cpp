@@ -0,0 +1,362 @@
+// Circuit phase benchmark
+// Times Parse, MapNodes, Validate, CalculateMatrices, Restamp and SolveCircuit separately on
+// synthetic netlists and writes median/p99 per phase as JSON on stdout.
+// SolveCircuit is timed cold (solve), after a restamp (refactor) and with the cached
+// factorization (resolve) for every backend in --solver.
+// --batch K solves K random value sets of circuits up to 64 unknowns with BatchSolver
+// (batch) and one at a time through Restamp + SolveCircuit (batch_scalar).
+// Heap allocations per phase are counted by replacing every global operator new and
+// delete, aligned ones included, so containers, the arena and the solvers' own nodes
+// are counted. Eigen's matrix storage comes from std::malloc directly and is not.
+//
+// circuit_bench [--family ladder,grid2d,grid3d,random,rlc] [--sizes 10,100,1000]
+//               [--reps 5] [--warmup 1] [--solve-max 20000] [--threads 1,2,4] [--seed 1]
+//               [--solver sparselu,multifrontal,btf,dense] [--precision double,mixed]
+//               [--batch 0]
+// Assembly is timed once per entry of --threads for scaling numbers.
+
+#include "Batch.h"
+#include "Circuit.h"
+#include "NetlistGenerator.h"
+#include <bench/BenchTimer.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static atomic<size_t> allocation_count{ 0 };
+
+// every form of new ends in one of these two, every form of delete in the matching free
+static void* CountedAllocate(size_t bytes) noexcept {
+  allocation_count.fetch_add(1, memory_order_relaxed);
+  return malloc(bytes ? bytes : 1);
+}
+static void* CountedAllocate(size_t bytes, align_val_t alignment) noexcept {
+  allocation_count.fetch_add(1, memory_order_relaxed);
+  const size_t align = static_cast<size_t>(alignment);
+  // aligned_alloc wants a multiple of the alignment
+  bytes = (max<size_t>(bytes, 1) + align - 1) / align * align;
+#ifdef _MSC_VER
+  return _aligned_malloc(bytes, align);
+#else
+  return aligned_alloc(align, bytes);
+#endif
+}
+static void CountedFree(void* p, align_val_t) noexcept {
+#ifdef _MSC_VER
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+void* operator new(size_t bytes) {
+  if (void* p = CountedAllocate(bytes))
+    return p;
+  throw bad_alloc();
+}
+void* operator new[](size_t bytes) { return operator new(bytes); }
+void* operator new(size_t bytes, const nothrow_t&) noexcept { return CountedAllocate(bytes); }
+void* operator new[](size_t bytes, const nothrow_t&) noexcept { return CountedAllocate(bytes); }
+void* operator new(size_t bytes, align_val_t alignment) {
+  if (void* p = CountedAllocate(bytes, alignment))
+    return p;
+  throw bad_alloc();
+}
+void* operator new[](size_t bytes, align_val_t alignment) { return operator new(bytes, alignment); }
+void* operator new(size_t bytes, align_val_t alignment, const nothrow_t&) noexcept {
+  return CountedAllocate(bytes, alignment);
+}
+void* operator new[](size_t bytes, align_val_t alignment, const nothrow_t&) noexcept {
+  return CountedAllocate(bytes, alignment);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { free(p); }
+void operator delete(void* p, align_val_t alignment) noexcept { CountedFree(p, alignment); }
+void operator delete[](void* p, align_val_t alignment) noexcept { CountedFree(p, alignment); }
+void operator delete(void* p, size_t, align_val_t alignment) noexcept { CountedFree(p, alignment); }
+void operator delete[](void* p, size_t, align_val_t alignment) noexcept { CountedFree(p, alignment); }
+void operator delete(void* p, align_val_t alignment, const nothrow_t&) noexcept { CountedFree(p, alignment); }
+void operator delete[](void* p, align_val_t alignment, const nothrow_t&) noexcept { CountedFree(p, alignment); }
+
+struct BenchOptions {
+  vector<string> families{ "ladder", "grid2d", "grid3d", "random", "rlc" };
+  vector<size_t> sizes{ 10, 100, 1000, 10000, 100000, 1000000 };
+  int reps = 5;
+  int warmup = 1;
+  // larger circuits skip the sparse LU, fill-in on 2D/3D grids grows quickly
+  size_t solve_max = 20000;
+  vector<size_t> threads{ 1 };
+  uint64_t seed = 1;
+  vector<SolverKind> solvers{ SolverKind::kSparseLU };
+  vector<Precision> precisions{ Precision::kDouble };
+  size_t batch = 0;
+};
+
+// batched solves are meant for small cells
+const size_t kBatchMax = 64;
+
+// the dense LU is O(n^3), larger systems skip it
+const size_t kDenseMax = 5000;
+
+vector<string> SplitList(const string& list) {
+  vector<string> result;
+  istringstream in(list);
+  string item;
+  while (getline(in, item, ','))
+    if (!item.empty())
+      result.push_back(item);
+  return result;
+}
+
+bool ParseOptions(int argc, char** argv, BenchOptions& options) {
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (i + 1 >= argc) {
+      cerr << "missing value for " << arg << endl;
+      return false;
+    }
+    string value = argv[++i];
+    if (arg == "--family") {
+      options.families = SplitList(value);
+    } else if (arg == "--sizes") {
+      options.sizes.clear();
+      for (auto& s : SplitList(value))
+        options.sizes.push_back(static_cast<size_t>(stod(s)));
+    } else if (arg == "--reps") {
+      options.reps = max(1, stoi(value));
+    } else if (arg == "--warmup") {
+      options.warmup = max(0, stoi(value));
+    } else if (arg == "--solve-max") {
+      options.solve_max = static_cast<size_t>(stod(value));
+    } else if (arg == "--threads") {
+      options.threads.clear();
+      for (auto& s : SplitList(value))
+        options.threads.push_back(max<size_t>(1, stoul(s)));
+    } else if (arg == "--seed") {
+      options.seed = stoull(value);
+    } else if (arg == "--solver") {
+      options.solvers.clear();
+      try {
+        for (auto& s : SplitList(value))
+          options.solvers.push_back(ParseSolverKind(s));
+      } catch (const runtime_error& e) {
+        cerr << e.what() << endl;
+        return false;
+      }
+    } else if (arg == "--batch") {
+      options.batch = static_cast<size_t>(stod(value));
+    } else if (arg == "--precision") {
+      options.precisions.clear();
+      try {
+        for (auto& s : SplitList(value))
+          options.precisions.push_back(ParsePrecision(s));
+      } catch (const runtime_error& e) {
+        cerr << e.what() << endl;
+        return false;
+      }
+    } else {
+      cerr << "unknown option " << arg << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+struct PhaseResult {
+  string phase;
+  size_t threads = 1;
+  vector<double> seconds;
+  vector<size_t> allocations;
+  size_t bytes = 0; // memory traffic per rep, reported as bandwidth when set
+  string solver;     // factorization backend of the solve phases
+  string precision;
+  RefinementStats refinement; // of the last rep
+  size_t instances = 0;        // circuits solved per rep by the batch phases
+};
+
+// Runs setup (untimed) then body (timed) warmup + reps times
+PhaseResult TimePhase(const string& phase, const BenchOptions& options,
+                      const function<void()>& setup, const function<void()>& body,
+                      size_t threads = 1) {
+  PhaseResult result;
+  result.phase = phase;
+  result.threads = threads;
+  Eigen::BenchTimer timer;
+  for (int i = 0; i < options.warmup + options.reps; i++) {
+    setup();
+    size_t allocations = allocation_count.load();
+    timer.reset();
+    timer.start();
+    body();
+    timer.stop();
+    if (i >= options.warmup) {
+      result.seconds.push_back(timer.value(Eigen::REAL_TIMER));
+      result.allocations.push_back(allocation_count.load() - allocations);
+    }
+  }
+  sort(result.seconds.begin(), result.seconds.end());
+  sort(result.allocations.begin(), result.allocations.end());
+  return result;
+}
+
+// nearest rank percentile of sorted samples
+double Percentile(const vector<double>& sorted, double p) {
+  size_t rank = static_cast<size_t>(p * sorted.size() + 0.999999);
+  rank = min(max<size_t>(rank, 1), sorted.size());
+  return sorted[rank - 1];
+}
+
+void WriteResult(ostream& os, const string& family, size_t size, const Circuit& circuit,
+                 const PhaseResult& result, bool& first) {
+  double total = 0.0;
+  for (double s : result.seconds)
+    total += s;
+  os << (first ? "\n" : ",\n");
+  first = false;
+  os << "    { \"family\": \"" << family << "\", \"size\": " << size
+     << ", \"nodes\": " << circuit.nodes_count()
+     << ", \"components\": " << circuit.component_count()
+     << ", \"phase\": \"" << result.phase << "\""
+     << ", \"threads\": " << result.threads
+     << ", \"reps\": " << result.seconds.size()
+     << ", \"min_s\": " << result.seconds.front()
+     << ", \"median_s\": " << Percentile(result.seconds, 0.5)
+     << ", \"p99_s\": " << Percentile(result.seconds, 0.99)
+     << ", \"mean_s\": " << total / result.seconds.size();
+  if (!result.solver.empty()) {
+    os << ", \"solver\": \"" << result.solver << "\", \"precision\": \"" << result.precision << "\""
+       << ", \"refinement_steps\": " << result.refinement.steps
+       << ", \"residual\": " << result.refinement.residual
+       << ", \"fell_back\": " << (result.refinement.fell_back ? "true" : "false");
+  }
+  if (result.instances)
+    os << ", \"instances\": " << result.instances
+       << ", \"instances_per_s\": " << result.instances / Percentile(result.seconds, 0.5);
+  if (result.bytes)
+    os << ", \"gbytes_per_s\": " << result.bytes / Percentile(result.seconds, 0.5) / 1e9;
+  os << ", \"allocations\": " << result.allocations[result.allocations.size() / 2]
+     << ", \"arena_chunks\": " << circuit.arena().chunk_count() << " }";
+}
+
+int main(int argc, char** argv) {
+  BenchOptions options;
+  if (!ParseOptions(argc, argv, options))
+    return 1;
+
+  NetlistGenerator generator(options.seed);
+  bool first = true;
+  cout.precision(9);
+  cout << "{\n  \"benchmark\": \"circuit_phases\",\n  \"reps\": " << options.reps
+       << ",\n  \"warmup\": " << options.warmup << ",\n  \"results\": [";
+
+  for (auto& family : options.families) {
+    for (size_t size : options.sizes) {
+      string netlist = generator.Generate(family, size);
+      if (netlist.empty()) {
+        cerr << "unknown family " << family << endl;
+        return 1;
+      }
+      cerr << family << ' ' << size << "..." << endl;
+
+      vector<PhaseResult> results;
+      // the stream is built outside the timed region so its buffer copy is not counted
+      unique_ptr<Circuit> circuit_ptr;
+      unique_ptr<istringstream> in;
+      results.push_back(TimePhase("parse", options,
+        [&] { circuit_ptr.reset(new Circuit()); in.reset(new istringstream(netlist)); },
+        [&] { circuit_ptr->Parse(*in); }));
+      Circuit& circuit = *circuit_ptr;
+      results.push_back(TimePhase("map_nodes", options, [] {}, [&] { circuit.MapNodes(); }));
+      results.push_back(TimePhase("validate", options, [] {}, [&] { circuit.Validate(); }));
+      if (!circuit.valid()) {
+        cerr << "generated " << family << " circuit is invalid" << endl;
+        return 1;
+      }
+
+      for (size_t threads : options.threads) {
+        circuit.set_threads(threads);
+        results.push_back(TimePhase("assemble", options, [] {},
+          [&] { circuit.CalculateMatrices(); }, threads));
+      }
+      // value-only reassembly through the stamp map
+      circuit.BuildStampMap();
+      results.push_back(TimePhase("restamp", options, [] {}, [&] { circuit.Restamp(); }));
+      results.back().bytes = circuit.stamp_map().bytes_touched();
+
+      for (SolverKind solver : options.solvers) {
+        for (Precision precision : options.precisions) {
+          if (circuit.nodes_count() > options.solve_max ||
+              (solver == SolverKind::kDense && circuit.matrix_size() > kDenseMax))
+            continue;
+          try {
+            LinearSolver check(solver, precision);
+          } catch (const runtime_error& e) {
+            cerr << e.what() << ", skipped" << endl;
+            continue;
+          }
+          Eigen::MatrixXd x;
+          auto tag = [&] {
+            results.back().solver = SolverName(solver);
+            results.back().precision = PrecisionName(precision);
+            results.back().refinement = circuit.refinement();
+          };
+          // cold: ordering, factorization and solve
+          results.push_back(TimePhase("solve", options, [&] { circuit.set_solver(solver, precision); },
+            [&] { x = circuit.SolveCircuit(); }));
+          tag();
+          // same pattern, new values: numeric factorization and solve
+          results.push_back(TimePhase("refactor", options, [&] { circuit.Restamp(); },
+            [&] { x = circuit.SolveCircuit(); }));
+          tag();
+          // cached factorization: triangular solves only
+          results.push_back(TimePhase("resolve", options, [] {},
+            [&] { x = circuit.SolveCircuit(); }));
+          tag();
+        }
+      }
+
+      if (options.batch && circuit.matrix_size() <= kBatchMax) {
+        // every component scaled by a random factor in [0.5, 1.5] per instance
+        mt19937_64 rng(options.seed);
+        uniform_real_distribution<double> scale(0.5, 1.5);
+        Eigen::MatrixXd values(circuit.component_count(), options.batch);
+        for (size_t k = 0; k < options.batch; k++)
+          for (size_t i = 0; i < circuit.component_count(); i++)
+            values(i, k) = circuit.components()[i].value() * scale(rng);
+        Eigen::MatrixXd x;
+        circuit.set_solver(SolverKind::kSparseLU);
+        BatchSolver batch(circuit);
+        results.push_back(TimePhase("batch", options, [] {}, [&] { x = batch.Solve(values); }));
+        results.back().instances = options.batch;
+        results.push_back(TimePhase("batch_scalar", options, [] {}, [&] {
+          for (size_t k = 0; k < options.batch; k++) {
+            for (size_t i = 0; i < circuit.component_count(); i++)
+              circuit.set_value(i, values(i, k));
+            circuit.Restamp();
+            x.col(k) = circuit.SolveCircuit();
+          }
+        }));
+        results.back().instances = options.batch;
+      }
+
+      for (auto& i : results)
+        WriteResult(cout, family, size, circuit, i, first);
+    }
+  }
+  cout << "\n  ]\n}\n";
+  return 0;
+}
@@ -0,0 +1,143 @@
+// Synthetic netlists for benchmarking, in the circuit.txt format.
+// Every family is driven by V1 from node 1 to ground and passes the topology check.
+// NetlistGenerator.h
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <sstream>
+#include <string>
+
+#ifndef NetlistGenerator_h
+#define NetlistGenerator_h
+
+class NetlistGenerator {
+public:
+  explicit NetlistGenerator(std::uint64_t seed = 1) : rng_(seed) {}
+
+  // Builds a netlist of the named family with roughly `nodes` nodes.
+  // Families: ladder, grid2d, grid3d, random, rlc. Empty string for unknown names.
+  std::string Generate(const std::string& family, size_t nodes);
+
+  // series resistors 1..n with a shunt resistor from every node to ground
+  std::string Ladder(size_t nodes);
+  // side x side resistor mesh, corner tied to ground
+  std::string Grid2D(size_t nodes);
+  // side^3 resistor mesh, corner tied to ground
+  std::string Grid3D(size_t nodes);
+  // random spanning tree plus `extra_degree` random resistors per node
+  std::string RandomSparse(size_t nodes, double extra_degree = 2.0);
+  // repeating R-L series chain with a capacitor to ground at every node
+  std::string RlcChain(size_t nodes);
+
+private:
+  double Value(double low, double high) {
+    return std::uniform_real_distribution<double>(low, high)(rng_);
+  }
+  void Resistor(size_t a, size_t b) {
+    out_ << 'R' << ++count_ << ' ' << a << ' ' << b << ' ' << Value(1.0, 100.0) << '\n';
+  }
+  void Begin() {
+    out_.str("");
+    out_.clear();
+    count_ = 0;
+    out_ << "V1 1 0 1\n";
+  }
+
+  std::mt19937_64 rng_;
+  std::ostringstream out_;
+  size_t count_ = 0;
+};
+
+inline std::string NetlistGenerator::Generate(const std::string& family, size_t nodes) {
+  if (family == "ladder")
+    return Ladder(nodes);
+  if (family == "grid2d")
+    return Grid2D(nodes);
+  if (family == "grid3d")
+    return Grid3D(nodes);
+  if (family == "random")
+    return RandomSparse(nodes);
+  if (family == "rlc")
+    return RlcChain(nodes);
+  return std::string();
+}
+
+inline std::string NetlistGenerator::Ladder(size_t nodes) {
+  Begin();
+  for (size_t i = 1; i < nodes; i++) {
+    Resistor(i, i + 1);
+    Resistor(i + 1, 0);
+  }
+  return out_.str();
+}
+
+inline std::string NetlistGenerator::Grid2D(size_t nodes) {
+  Begin();
+  size_t side = std::max<size_t>(2, static_cast<size_t>(std::sqrt(double(nodes))));
+  auto id = [side](size_t x, size_t y) { return 1 + x + y * side; };
+  for (size_t y = 0; y < side; y++) {
+    for (size_t x = 0; x < side; x++) {
+      if (x + 1 < side)
+        Resistor(id(x, y), id(x + 1, y));
+      if (y + 1 < side)
+        Resistor(id(x, y), id(x, y + 1));
+    }
+  }
+  Resistor(id(side - 1, side - 1), 0);
+  return out_.str();
+}
+
+inline std::string NetlistGenerator::Grid3D(size_t nodes) {
+  Begin();
+  size_t side = std::max<size_t>(2, static_cast<size_t>(std::cbrt(double(nodes))));
+  auto id = [side](size_t x, size_t y, size_t z) { return 1 + x + (y + z * side) * side; };
+  for (size_t z = 0; z < side; z++) {
+    for (size_t y = 0; y < side; y++) {
+      for (size_t x = 0; x < side; x++) {
+        if (x + 1 < side)
+          Resistor(id(x, y, z), id(x + 1, y, z));
+        if (y + 1 < side)
+          Resistor(id(x, y, z), id(x, y + 1, z));
+        if (z + 1 < side)
+          Resistor(id(x, y, z), id(x, y, z + 1));
+      }
+    }
+  }
+  Resistor(id(side - 1, side - 1, side - 1), 0);
+  return out_.str();
+}
+
+inline std::string NetlistGenerator::RandomSparse(size_t nodes, double extra_degree) {
+  Begin();
+  nodes = std::max<size_t>(nodes, 2);
+  // spanning tree keeps every node reachable from node 1
+  for (size_t i = 2; i <= nodes; i++)
+    Resistor(i, 1 + rng_() % (i - 1));
+  size_t extra = static_cast<size_t>(extra_degree * nodes / 2);
+  for (size_t i = 0; i < extra; i++) {
+    size_t a = 1 + rng_() % nodes;
+    size_t b = 1 + rng_() % nodes;
+    if (a != b)
+      Resistor(a, b);
+  }
+  Resistor(nodes, 0);
+  return out_.str();
+}
+
+inline std::string NetlistGenerator::RlcChain(size_t nodes) {
+  Begin();
+  size_t r = 0, l = 0, c = 0;
+  for (size_t i = 1; i < nodes; i++) {
+    if (i % 2)
+      out_ << 'R' << ++r << ' ' << i << ' ' << i + 1 << ' ' << Value(1.0, 100.0) << '\n';
+    else
+      out_ << 'L' << ++l << ' ' << i << ' ' << i + 1 << ' ' << Value(1e-9, 1e-6) << '\n';
+    out_ << 'C' << ++c << ' ' << i + 1 << " 0 " << Value(1e-12, 1e-9) << '\n';
+  }
+  out_ << 'R' << ++r << ' ' << nodes << " 0 50\n";
+  return out_.str();
+}
+
+#endif // !NetlistGenerator_h
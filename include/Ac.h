@@ -0,0 +1,175 @@
+// Small-signal frequency domain analysis of the linear circuit.
+// The MNA matrix splits into a conductance part G, which is the DC matrix A
+// (resistors and the V and L branch incidences), and a reactive part C
+// (capacitors between their nodes, -L on each inductor branch diagonal, -M between
+// coupled inductor branches), so at angular frequency w the system is
+// (G + jwC) x = b. Both are stored on their union pattern, which makes assembling
+// Y(w) one pass over two value arrays and lets a per thread complex LU analyze the
+// pattern once for every frequency.
+// The DC source values act as the AC phasors, with zero phase.
+// Ac.h
+
+#include "Circuit.h"
+#include "Parallel.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Eigenvalues>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <atomic>
+#include <complex>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef Ac_h
+#define Ac_h
+
+class AcAnalysis {
+public:
+  using Complex = std::complex<double>;
+  using ComplexMatrix = Eigen::SparseMatrix<Complex>;
+  using ComplexLU = Eigen::SparseLU<ComplexMatrix, Eigen::COLAMDOrdering<int>>;
+
+  // circuit must be assembled
+  explicit AcAnalysis(const Circuit& circuit);
+
+  size_t size() const { return static_cast<size_t>(G_.rows()); }
+  // G and C on the shared pattern
+  const Eigen::SparseMatrix<double>& G() const { return G_; }
+  const Eigen::SparseMatrix<double>& C() const { return C_; }
+  // Y = G + j 2 pi f C, Y must have been copied from pattern() once
+  void Assemble(double frequency, ComplexMatrix& Y) const;
+  const ComplexMatrix& pattern() const { return pattern_; }
+
+  // x at every frequency (Hz), column k for frequencies[k]
+  Eigen::MatrixXcd Solve(const std::vector<double>& frequencies, size_t threads = 0) const;
+
+  // body(k, lu) for every frequency index k with lu holding the factorization of Y at
+  // frequencies[k]. threads workers (0 = one per core) each analyze the pattern once.
+  // body runs concurrently and must only write its own k. The first failure is
+  // rethrown after the running frequencies finish.
+  template <class Body>
+  void ForEachFrequency(const std::vector<double>& frequencies, size_t threads, Body&& body) const;
+
+private:
+  const Circuit& circuit_;
+  Eigen::SparseMatrix<double> G_, C_;
+  ComplexMatrix pattern_;
+};
+
+// Finite s with det(G + sC) = 0 for small dense G and C, by QZ. A beta of zero is an
+// infinite eigenvalue (a state without capacitance). Betas scale with C and alphas
+// with G, which differ by many orders in RC networks, so beta is compared against C alone.
+inline Eigen::VectorXcd FinitePoles(const Eigen::MatrixXd& G, const Eigen::MatrixXd& C) {
+  Eigen::GeneralizedEigenSolver<Eigen::MatrixXd> solver(G, C, false);
+  std::vector<std::complex<double>> poles;
+  const double zero = 1e-12 * C.norm();
+  for (Eigen::Index i = 0; i < G.rows(); i++) {
+    if (std::abs(solver.betas()(i)) > zero)
+      poles.push_back(-solver.alphas()(i) / solver.betas()(i));
+  }
+  return Eigen::Map<Eigen::VectorXcd>(poles.data(), static_cast<Eigen::Index>(poles.size()));
+}
+
+inline AcAnalysis::AcAnalysis(const Circuit& circuit) : circuit_(circuit) {
+  const Eigen::Index n = static_cast<Eigen::Index>(circuit.matrix_size());
+  const int ground_rows = static_cast<int>(circuit.nodes_count()) - 1;
+  std::vector<Eigen::Triplet<double>> triplets;
+  for (auto& i : circuit.components()) {
+    const int p = i.p_index() - 1, m = i.n_index() - 1;
+    if (i.type() == 'C') {
+      if (p >= 0)
+        triplets.emplace_back(p, p, i.value());
+      if (m >= 0)
+        triplets.emplace_back(m, m, i.value());
+      if (p >= 0 && m >= 0) {
+        triplets.emplace_back(p, m, -i.value());
+        triplets.emplace_back(m, p, -i.value());
+      }
+    } else if (i.type() == 'L') {
+      // branch row: v(p) - v(n) - jwL i = 0
+      const int row = ground_rows + i.branch();
+      triplets.emplace_back(row, row, -i.value());
+    }
+  }
+  // mutual inductances, one dense block per coupled group
+  for (auto& group : circuit.coupling_groups()) {
+    const Eigen::MatrixXd L = circuit.InductanceMatrix(group);
+    const int first = ground_rows + group.first_branch;
+    for (Eigen::Index j = 0; j < L.cols(); j++) {
+      for (Eigen::Index i = 0; i < L.rows(); i++) {
+        if (i != j && L(i, j) != 0.0)
+          triplets.emplace_back(first + static_cast<int>(i), first + static_cast<int>(j), -L(i, j));
+      }
+    }
+  }
+  Eigen::SparseMatrix<double> reactive(n, n);
+  reactive.setFromTriplets(triplets.begin(), triplets.end());
+
+  // the sum keeps explicit zeros, so both land on the union pattern in the same order
+  G_ = circuit.A() + 0.0 * reactive;
+  C_ = reactive + 0.0 * circuit.A();
+  G_.makeCompressed();
+  C_.makeCompressed();
+  if (G_.nonZeros() != C_.nonZeros())
+    throw std::logic_error("AcAnalysis: G and C patterns differ");
+  pattern_ = G_.cast<Complex>();
+}
+
+inline void AcAnalysis::Assemble(double frequency, ComplexMatrix& Y) const {
+  const double w = 2.0 * EIGEN_PI * frequency;
+  const double* g = G_.valuePtr();
+  const double* c = C_.valuePtr();
+  Complex* y = Y.valuePtr();
+  for (Eigen::Index k = 0; k < G_.nonZeros(); k++)
+    y[k] = Complex(g[k], w * c[k]);
+}
+
+template <class Body>
+void AcAnalysis::ForEachFrequency(const std::vector<double>& frequencies, size_t threads,
+                                  Body&& body) const {
+  if (!circuit_.valid())
+    throw std::runtime_error("circuit topology is invalid");
+  threads = std::min(threads ? threads : DefaultThreads(), frequencies.size());
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex mutex;
+  ParallelFor(threads, [&](size_t) {
+    ComplexMatrix Y = pattern_;
+    ComplexLU lu;
+    lu.analyzePattern(Y);
+    size_t k = 0;
+    try {
+      while (!failed && (k = next++) < frequencies.size()) {
+        Assemble(frequencies[k], Y);
+        lu.factorize(Y);
+        if (lu.info() != Eigen::Success)
+          throw std::runtime_error("matrix is singular: " + lu.lastErrorMessage());
+        body(k, lu);
+      }
+    } catch (const std::exception& e) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!failed.exchange(true)) {
+        error = std::make_exception_ptr(std::runtime_error(
+            "AC at " + std::to_string(frequencies[k]) + " Hz: " + e.what()));
+      }
+    }
+  });
+  if (error)
+    std::rethrow_exception(error);
+}
+
+inline Eigen::MatrixXcd AcAnalysis::Solve(const std::vector<double>& frequencies,
+                                          size_t threads) const {
+  Eigen::MatrixXcd x(size(), frequencies.size());
+  const Eigen::VectorXcd b = circuit_.b().cast<Complex>();
+  ForEachFrequency(frequencies, threads, [&](size_t k, ComplexLU& lu) {
+    x.col(k) = lu.solve(b);
+  });
+  return x;
+}
+
+#endif // !Ac_h
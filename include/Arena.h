@@ -0,0 +1,98 @@
+// Monotonic arena for parse-time data.
+// Allocation is a pointer bump inside the current chunk, chunks double in size
+// up to a cap and are only returned all at once by release() or the destructor.
+// Arena.h
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#ifndef Arena_h
+#define Arena_h
+
+class Arena {
+public:
+  explicit Arena(size_t first_chunk = 64 * 1024, size_t max_chunk = 64 * 1024 * 1024) :
+      first_chunk_(first_chunk), next_chunk_(first_chunk), max_chunk_(max_chunk) {}
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+    size_t offset = (align - reinterpret_cast<size_t>(cursor_) % align) % align;
+    if (cursor_ == nullptr || bytes + offset > static_cast<size_t>(end_ - cursor_)) {
+      NewChunk(bytes + align);
+      offset = (align - reinterpret_cast<size_t>(cursor_) % align) % align;
+    }
+    char* result = cursor_ + offset;
+    cursor_ = result + bytes;
+    used_ += bytes + offset;
+    return result;
+  }
+
+  // copies the bytes into the arena, the view lives as long as the arena
+  std::string_view copy(std::string_view s) {
+    if (s.empty())
+      return std::string_view();
+    char* bytes = static_cast<char*>(allocate(s.size(), 1));
+    std::memcpy(bytes, s.data(), s.size());
+    return std::string_view(bytes, s.size());
+  }
+
+  // frees every chunk at once
+  void release() {
+    chunks_.clear();
+    cursor_ = end_ = nullptr;
+    next_chunk_ = first_chunk_;
+    reserved_ = used_ = 0;
+  }
+
+  size_t chunk_count() const { return chunks_.size(); }
+  size_t bytes_reserved() const { return reserved_; }
+  size_t bytes_used() const { return used_; }
+
+private:
+  void NewChunk(size_t min_bytes) {
+    size_t size = std::max(next_chunk_, min_bytes);
+    chunks_.emplace_back(new char[size]);
+    cursor_ = chunks_.back().get();
+    end_ = cursor_ + size;
+    reserved_ += size;
+    next_chunk_ = std::min(next_chunk_ * 2, max_chunk_);
+  }
+
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  char* cursor_ = nullptr;
+  char* end_ = nullptr;
+  size_t first_chunk_, next_chunk_, max_chunk_;
+  size_t reserved_ = 0, used_ = 0;
+};
+
+// Standard allocator over an Arena so containers can live in it.
+// deallocate is a no-op, memory comes back when the arena is released.
+template <class T>
+class ArenaAllocator {
+public:
+  using value_type = T;
+
+  explicit ArenaAllocator(Arena* arena) : arena_(arena) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T))); }
+  void deallocate(T*, size_t) {}
+
+  Arena* arena() const { return arena_; }
+
+  template <class U>
+  bool operator==(const ArenaAllocator<U>& other) const { return arena_ == other.arena(); }
+  template <class U>
+  bool operator!=(const ArenaAllocator<U>& other) const { return arena_ != other.arena(); }
+
+private:
+  Arena* arena_;
+};
+
+#endif // !Arena_h
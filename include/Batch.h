@@ -0,0 +1,272 @@
+// Batched solver for many instances of one small circuit.
+// Instances share the topology of a nominal Circuit and differ only in
+// component values. Their MNA matrices come from the nominal stamp map and
+// are stored structure of arrays, one SIMD packet per matrix entry holding
+// that entry for kLanes instances, so every multiply-subtract of the LU works
+// on kLanes instances at once (2 with SSE2, 4 with AVX2, 8 with AVX-512).
+//
+// The elimination uses the row pivots of the nominal instance for every
+// instance and only touches entries of the nominal L/U pattern. An instance
+// whose static pivot turns out too small is solved again on its own with
+// partial pivoting.
+// Batch.h
+
+#include "Circuit.h"
+#include "Parallel.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/StdVector>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#ifndef Batch_h
+#define Batch_h
+
+class BatchSolver {
+public:
+  static constexpr int kLanes = Eigen::internal::packet_traits<double>::size;
+  using Lanes = Eigen::Array<double, kLanes, 1>;
+
+  // Records the nominal stamp map, pivot order and elimination pattern. The nominal
+  // circuit must outlive the solver and keep its matrices (no CalculateMatrices).
+  // Throws std::runtime_error if the nominal circuit cannot be solved.
+  explicit BatchSolver(Circuit& nominal);
+
+  // values(c, k) is the value of component c in instance k, returns x
+  // (matrix_size rows) for every instance as one column
+  Eigen::MatrixXd Solve(const Eigen::MatrixXd& values, size_t threads = 1);
+  // Only the listed components change, values(i, k) is the value of
+  // components[i] in instance k and every other component keeps its nominal value
+  Eigen::MatrixXd Solve(const std::vector<size_t>& components, const Eigen::MatrixXd& values,
+                        size_t threads = 1);
+
+  size_t matrix_size() const { return n_; }
+  size_t component_count() const { return nominal_.size(); }
+  // instances of the last Solve that needed partial pivoting
+  size_t fallback_count() const { return fallback_count_; }
+  // entries of the filled L/U pattern the elimination runs over
+  size_t pattern_size() const { return slot_count_; }
+
+private:
+  struct Update {
+    int target, source; // target -= l * source
+  };
+  struct RowStep {
+    int row, l;         // row index and slot of L(row, k)
+    int updates_begin, updates_end;
+  };
+  struct PivotStep {
+    int pivot;          // slot of U(k, k)
+    int rows_begin, rows_end;
+    int upper_begin, upper_end; // U(k, j > k) in upper_
+  };
+
+  // Solves instances [first, first + count) into x, parameters is one column per instance
+  void SolveLanes(const Eigen::MatrixXd& parameters, size_t first, size_t count,
+                  Eigen::MatrixXd& x, std::vector<Lanes, Eigen::aligned_allocator<Lanes>>& a,
+                  std::vector<Lanes, Eigen::aligned_allocator<Lanes>>& y,
+                  std::vector<double>& a_values, std::vector<double>& b);
+
+  const StampMap* stamp_map_;
+  size_t n_ = 0, nnz_ = 0, slot_count_ = 0;
+  std::vector<double> nominal_;      // nominal parameter of every component
+  std::vector<char> is_resistor_;    // values become parameters as 1 / R
+  std::vector<int> value_slot_;      // CSC value index -> slot
+  std::vector<int> pivot_row_;       // row k of P A is row pivot_row_[k] of A
+  std::vector<PivotStep> steps_;
+  std::vector<RowStep> rows_;
+  std::vector<Update> updates_;
+  std::vector<std::pair<int, int>> upper_; // (slot, column)
+  std::vector<int> a_rows_, a_cols_;         // CSC pattern copy for the scalar fallback
+  std::atomic<size_t> fallback_count_{ 0 };
+};
+
+inline BatchSolver::BatchSolver(Circuit& nominal) {
+  if (!nominal.valid())
+    throw std::runtime_error("batch nominal circuit has topology issues");
+  if (nominal.stamp_map().empty())
+    nominal.BuildStampMap();
+  stamp_map_ = &nominal.stamp_map();
+  const auto& A = nominal.A();
+  n_ = static_cast<size_t>(A.rows());
+  nnz_ = static_cast<size_t>(A.nonZeros());
+  const int n = static_cast<int>(n_);
+
+  for (auto& i : nominal.components()) {
+    nominal_.push_back(i.parameter());
+    is_resistor_.push_back(i.type() == 'R');
+  }
+
+  // static pivots from the nominal values
+  Eigen::PartialPivLU<Eigen::MatrixXd> lu(nominal.A_matrix());
+  if (n > 0 && lu.matrixLU().diagonal().cwiseAbs().minCoeff() == 0.0)
+    throw std::runtime_error("batch nominal circuit is singular");
+  pivot_row_.resize(n);
+  std::vector<int> permuted_row(n);
+  for (int i = 0; i < n; i++) {
+    permuted_row[i] = lu.permutationP().indices()[i];
+    pivot_row_[permuted_row[i]] = i;
+  }
+
+  // symbolic elimination of P A, n is small so a dense boolean pattern is fine
+  std::vector<char> pattern(n_ * n_, 0);
+  auto at = [n](int i, int j) { return static_cast<size_t>(i) * n + j; };
+  for (int j = 0; j < n; j++)
+    for (Eigen::SparseMatrix<double>::InnerIterator it(A, j); it; ++it)
+      pattern[at(permuted_row[it.row()], j)] = 1;
+  for (int k = 0; k < n; k++)
+    pattern[at(k, k)] = 1;
+  for (int k = 0; k < n; k++)
+    for (int i = k + 1; i < n; i++)
+      if (pattern[at(i, k)])
+        for (int j = k + 1; j < n; j++)
+          if (pattern[at(k, j)])
+            pattern[at(i, j)] = 1;
+  std::vector<int> slot(n_ * n_, -1);
+  for (size_t i = 0; i < pattern.size(); i++)
+    if (pattern[i])
+      slot[i] = static_cast<int>(slot_count_++);
+
+  // the elimination as a flat program over slots
+  for (int k = 0; k < n; k++) {
+    PivotStep step{ slot[at(k, k)], static_cast<int>(rows_.size()), 0,
+                    static_cast<int>(upper_.size()), 0 };
+    for (int j = k + 1; j < n; j++)
+      if (pattern[at(k, j)])
+        upper_.push_back({ slot[at(k, j)], j });
+    step.upper_end = static_cast<int>(upper_.size());
+    for (int i = k + 1; i < n; i++) {
+      if (!pattern[at(i, k)])
+        continue;
+      RowStep row{ i, slot[at(i, k)], static_cast<int>(updates_.size()), 0 };
+      for (int u = step.upper_begin; u < step.upper_end; u++)
+        updates_.push_back({ slot[at(i, upper_[u].second)], upper_[u].first });
+      row.updates_end = static_cast<int>(updates_.size());
+      rows_.push_back(row);
+    }
+    step.rows_end = static_cast<int>(rows_.size());
+    steps_.push_back(step);
+  }
+
+  value_slot_.resize(nnz_);
+  a_rows_.resize(nnz_);
+  a_cols_.resize(nnz_);
+  for (int j = 0; j < n; j++) {
+    for (int p = A.outerIndexPtr()[j]; p < A.outerIndexPtr()[j + 1]; p++) {
+      int i = A.innerIndexPtr()[p];
+      value_slot_[p] = slot[at(permuted_row[i], j)];
+      a_rows_[p] = i;
+      a_cols_[p] = j;
+    }
+  }
+}
+
+inline Eigen::MatrixXd BatchSolver::Solve(const Eigen::MatrixXd& values, size_t threads) {
+  if (static_cast<size_t>(values.rows()) != nominal_.size())
+    throw std::invalid_argument("batch values need one row per component");
+  std::vector<size_t> all(nominal_.size());
+  for (size_t i = 0; i < all.size(); i++)
+    all[i] = i;
+  return Solve(all, values, threads);
+}
+
+inline Eigen::MatrixXd BatchSolver::Solve(const std::vector<size_t>& components,
+                                          const Eigen::MatrixXd& values, size_t threads) {
+  if (static_cast<size_t>(values.rows()) != components.size())
+    throw std::invalid_argument("batch values need one row per listed component");
+  const size_t instances = static_cast<size_t>(values.cols());
+  Eigen::MatrixXd parameters(nominal_.size(), instances);
+  for (size_t k = 0; k < instances; k++) {
+    parameters.col(k) = Eigen::Map<const Eigen::VectorXd>(nominal_.data(), nominal_.size());
+    for (size_t i = 0; i < components.size(); i++) {
+      size_t c = components[i];
+      parameters(c, k) = is_resistor_[c] ? 1.0 / values(i, k) : values(i, k);
+    }
+  }
+
+  Eigen::MatrixXd x(n_, instances);
+  fallback_count_ = 0;
+  const size_t blocks = (instances + kLanes - 1) / kLanes;
+  threads = std::max<size_t>(1, std::min(threads ? threads : DefaultThreads(), blocks));
+  ParallelFor(threads, [&](size_t t) {
+    std::vector<Lanes, Eigen::aligned_allocator<Lanes>> a(slot_count_), y(n_);
+    std::vector<double> a_values(nnz_), b(n_);
+    auto range = ChunkRange(blocks, threads, t);
+    for (size_t block = range.first; block < range.second; block++) {
+      size_t first = block * kLanes;
+      SolveLanes(parameters, first, std::min<size_t>(kLanes, instances - first), x, a, y, a_values, b);
+    }
+  });
+  return x;
+}
+
+inline void BatchSolver::SolveLanes(const Eigen::MatrixXd& parameters, size_t first, size_t count,
+                                    Eigen::MatrixXd& x,
+                                    std::vector<Lanes, Eigen::aligned_allocator<Lanes>>& a,
+                                    std::vector<Lanes, Eigen::aligned_allocator<Lanes>>& y,
+                                    std::vector<double>& a_values, std::vector<double>& b) {
+  const int n = static_cast<int>(n_);
+  std::fill(a.begin(), a.end(), Lanes::Zero());
+  // unused lanes of a partial block repeat the first instance so they stay finite
+  for (int lane = 0; lane < kLanes; lane++) {
+    size_t instance = first + (static_cast<size_t>(lane) < count ? lane : 0);
+    stamp_map_->Scatter(parameters.col(instance).data(), a_values.data(), b.data());
+    for (size_t p = 0; p < nnz_; p++)
+      a[value_slot_[p]](lane) = a_values[p];
+    for (int k = 0; k < n; k++)
+      y[k](lane) = b[pivot_row_[k]];
+  }
+
+  // L U = P A in place, kLanes instances per operation
+  Lanes bad = Lanes::Zero();
+  for (auto& step : steps_) {
+    const Lanes pivot = a[step.pivot];
+    Lanes largest = pivot.abs();
+    for (int r = step.rows_begin; r < step.rows_end; r++)
+      largest = largest.max(a[rows_[r].l].abs());
+    // the nominal pivot must stay within 1e-10 of its column in every instance
+    bad = bad.max((pivot.abs() <= 1e-10 * largest).cast<double>());
+    const Lanes inverse = pivot.inverse();
+    for (int r = step.rows_begin; r < step.rows_end; r++) {
+      Lanes& l = a[rows_[r].l];
+      l *= inverse;
+      for (int u = rows_[r].updates_begin; u < rows_[r].updates_end; u++)
+        a[updates_[u].target] -= l * a[updates_[u].source];
+    }
+  }
+
+  // forward with unit L, backward with U
+  for (int k = 0; k < n; k++) {
+    auto& step = steps_[k];
+    for (int r = step.rows_begin; r < step.rows_end; r++)
+      y[rows_[r].row] -= a[rows_[r].l] * y[k];
+  }
+  for (int k = n - 1; k >= 0; k--) {
+    auto& step = steps_[k];
+    for (int u = step.upper_begin; u < step.upper_end; u++)
+      y[k] -= a[upper_[u].first] * y[upper_[u].second];
+    y[k] /= a[step.pivot];
+  }
+
+  for (size_t lane = 0; lane < count; lane++) {
+    bool finite = bad(lane) == 0.0;
+    for (int k = 0; k < n && finite; k++)
+      finite = std::isfinite(y[k](lane));
+    if (finite) {
+      for (int k = 0; k < n; k++)
+        x(k, first + lane) = y[k](lane);
+      continue;
+    }
+    // static pivot failed for this instance, solve it alone with partial pivoting
+    fallback_count_++;
+    stamp_map_->Scatter(parameters.col(first + lane).data(), a_values.data(), b.data());
+    Eigen::MatrixXd dense = Eigen::MatrixXd::Zero(n, n);
+    for (size_t p = 0; p < nnz_; p++)
+      dense(a_rows_[p], a_cols_[p]) += a_values[p];
+    x.col(first + lane) = dense.partialPivLu().solve(Eigen::Map<Eigen::VectorXd>(b.data(), n));
+  }
+}
+
+#endif // !Batch_h
@@ -0,0 +1,555 @@
+// KLU style sparse LU for circuit matrices.
+// A maximum transversal puts nonzeros on the diagonal, Tarjan's algorithm then
+// permutes the matrix to block upper triangular form (BTF) so only the
+// diagonal blocks are factorized, each with AMD ordering and a left-looking
+// Gilbert-Peierls LU. Source driven nodes and disconnected subcircuits end up
+// in their own small blocks.
+//
+// refactorize keeps the pivot sequence and the L/U pattern of the last
+// factorize and only recomputes values, which is what transient and Newton
+// loops need when a restamp changes values but not the pattern.
+// Btf.h
+
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/OrderingMethods>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#ifndef Btf_h
+#define Btf_h
+
+class BtfLU {
+public:
+  // factorize takes the diagonal pivot while it is at least pivot_tolerance * the column
+  // maximum, refactorize keeps the old pivots down to refactor_tolerance * the column maximum
+  explicit BtfLU(double pivot_tolerance = 1e-3, double refactor_tolerance = 1e-8) :
+      pivot_tolerance_(pivot_tolerance), refactor_tolerance_(refactor_tolerance) {}
+
+  void analyzePattern(const Eigen::SparseMatrix<double>& A);
+  void factorize(const Eigen::SparseMatrix<double>& A);
+  // Same pivots and pattern as the last factorize, new values. Falls back to
+  // factorize when a kept pivot is no longer acceptable.
+  void refactorize(const Eigen::SparseMatrix<double>& A);
+  void compute(const Eigen::SparseMatrix<double>& A) {
+    analyzePattern(A);
+    if (info_ == Eigen::Success)
+      factorize(A);
+  }
+
+  Eigen::ComputationInfo info() const { return info_; }
+  const std::string& lastErrorMessage() const { return error_; }
+  Eigen::MatrixXd solve(const Eigen::MatrixXd& b) const;
+  // A^T x = b with the same factors
+  Eigen::MatrixXd solveTransposed(const Eigen::MatrixXd& b) const;
+
+  size_t block_count() const { return blocks_.size(); }
+  size_t largest_block() const { return largest_block_; }
+  // entries of L and U over all blocks plus the off diagonal blocks
+  size_t nnz() const;
+  size_t refactor_count() const { return refactor_count_; }
+  // refactorizations that had to pivot again
+  size_t fallback_count() const { return fallback_count_; }
+
+private:
+  struct Block {
+    int begin, end;                  // permuted rows and columns [begin, end)
+    std::vector<int> pinv;           // local row -> pivot position
+    std::vector<int> Lp, Li, Up, Ui; // unit lower L and upper U (diagonal last), pivot ordered
+    std::vector<double> Lx, Ux;
+  };
+
+  void Fail(Eigen::ComputationInfo info, const std::string& message) {
+    info_ = info;
+    error_ = message;
+  }
+  void Gather(const Eigen::SparseMatrix<double>& A);
+  bool FactorBlock(Block& block);
+  bool RefactorBlock(Block& block);
+
+  double pivot_tolerance_, refactor_tolerance_;
+  Eigen::ComputationInfo info_ = Eigen::InvalidInput;
+  std::string error_;
+  bool analyzed_ = false;
+  int n_ = 0;
+  std::vector<int> row_order_, col_order_;   // permuted index -> original row / column
+  // entries of permuted column c are [column_start_[c], column_start_[c + 1]),
+  // the off diagonal block ones (row above the block) first up to block_start_[c]
+  std::vector<int> column_start_, block_start_;
+  std::vector<int> entry_row_, entry_value_; // permuted row and index into A's values
+  std::vector<double> values_;               // A's values in entry order
+  std::vector<Block> blocks_;
+  size_t largest_block_ = 0;
+  size_t refactor_count_ = 0, fallback_count_ = 0;
+  // factorization workspace, sized to the largest block
+  std::vector<double> x_;
+  std::vector<int> stack_, next_, reach_;
+  std::vector<char> marked_;
+};
+
+inline void BtfLU::analyzePattern(const Eigen::SparseMatrix<double>& A) {
+  info_ = Eigen::Success;
+  error_.clear();
+  blocks_.clear();
+  analyzed_ = false;
+  n_ = static_cast<int>(A.rows());
+  const int n = n_;
+  const int* outer = A.outerIndexPtr();
+  const int* inner = A.innerIndexPtr();
+
+  // maximum transversal: column j is matched to row match[j], the diagonal first
+  std::vector<int> match(n, -1), row_match(n, -1);
+  for (int j = 0; j < n; j++) {
+    for (int p = outer[j]; p < outer[j + 1]; p++) {
+      if (inner[p] == j) {
+        match[j] = j;
+        row_match[j] = j;
+      }
+    }
+  }
+  std::vector<int> visited(n, -1);
+  std::vector<std::pair<int, int>> path; // (column, next entry to try)
+  for (int j = 0; j < n; j++) {
+    if (match[j] >= 0)
+      continue;
+    path.assign(1, { j, outer[j] });
+    int free_row = -1;
+    while (!path.empty() && free_row < 0) {
+      auto& top = path.back();
+      // look ahead for a free row before going deeper, branch rows are usually one step away
+      if (top.second == outer[top.first]) {
+        for (int p = outer[top.first]; p < outer[top.first + 1] && free_row < 0; p++)
+          if (row_match[inner[p]] < 0)
+            free_row = inner[p];
+        if (free_row >= 0)
+          break;
+      }
+      if (top.second >= outer[top.first + 1]) {
+        path.pop_back();
+        continue;
+      }
+      int i = inner[top.second++];
+      if (visited[i] == j)
+        continue;
+      visited[i] = j;
+      if (row_match[i] < 0)
+        free_row = i;
+      else
+        path.push_back({ row_match[i], outer[row_match[i]] });
+    }
+    if (free_row < 0) {
+      Fail(Eigen::NumericalIssue, "structurally singular: column " + std::to_string(j) +
+                                      " cannot be matched to a row");
+      return;
+    }
+    // every column on the path takes the row it reached, the last one the free row
+    int i = free_row;
+    for (size_t k = path.size(); k-- > 0;) {
+      int column = path[k].first;
+      int previous = match[column];
+      match[column] = i;
+      row_match[i] = column;
+      i = previous;
+    }
+  }
+
+  // Tarjan's strongly connected components on the matched matrix, edge j -> c for
+  // every entry (row matched to c) of column j. Components come out in block upper
+  // triangular order because a column only reaches columns in earlier blocks.
+  std::vector<int> index(n, -1), low(n, 0), component(n, -1);
+  std::vector<int> scc_stack, components;
+  std::vector<std::pair<int, int>> dfs;
+  int counter = 0, component_count = 0;
+  for (int root = 0; root < n; root++) {
+    if (index[root] >= 0)
+      continue;
+    dfs.push_back({ root, outer[root] });
+    index[root] = low[root] = counter++;
+    scc_stack.push_back(root);
+    while (!dfs.empty()) {
+      int v = dfs.back().first;
+      int& p = dfs.back().second;
+      if (p < outer[v + 1]) {
+        int w = row_match[inner[p++]];
+        if (index[w] < 0) {
+          index[w] = low[w] = counter++;
+          scc_stack.push_back(w);
+          dfs.push_back({ w, outer[w] });
+        } else if (component[w] < 0) {
+          low[v] = std::min(low[v], index[w]);
+        }
+        continue;
+      }
+      dfs.pop_back();
+      if (!dfs.empty())
+        low[dfs.back().first] = std::min(low[dfs.back().first], low[v]);
+      if (low[v] == index[v]) {
+        int w;
+        do {
+          w = scc_stack.back();
+          scc_stack.pop_back();
+          component[w] = component_count;
+          components.push_back(w);
+        } while (w != v);
+        blocks_.push_back(Block());
+        blocks_.back().end = static_cast<int>(components.size());
+        component_count++;
+      }
+    }
+  }
+
+  // fill reducing order inside each block, AMD on the block's symmetrized pattern
+  std::vector<int> position(n, -1);
+  col_order_.resize(n);
+  row_order_.resize(n);
+  largest_block_ = 0;
+  int begin = 0;
+  for (auto& block : blocks_) {
+    block.begin = begin;
+    const int size = block.end - begin;
+    largest_block_ = std::max(largest_block_, static_cast<size_t>(size));
+    if (size > 2) {
+      for (int k = begin; k < block.end; k++)
+        position[components[k]] = k - begin;
+      std::vector<Eigen::Triplet<double>> pattern;
+      for (int k = begin; k < block.end; k++) {
+        int j = components[k];
+        pattern.emplace_back(k - begin, k - begin, 1.0);
+        for (int p = outer[j]; p < outer[j + 1]; p++) {
+          int c = row_match[inner[p]];
+          if (component[c] == component[j])
+            pattern.emplace_back(position[c], k - begin, 1.0);
+        }
+      }
+      Eigen::SparseMatrix<double> B(size, size);
+      B.setFromTriplets(pattern.begin(), pattern.end());
+      Eigen::AMDOrdering<int>::PermutationType amd;
+      Eigen::AMDOrdering<int>()(B, amd);
+      for (int k = 0; k < size; k++)
+        col_order_[begin + k] = components[begin + amd.indices()[k]];
+    } else {
+      for (int k = begin; k < block.end; k++)
+        col_order_[k] = components[k];
+    }
+    begin = block.end;
+  }
+  for (int k = 0; k < n; k++) {
+    position[col_order_[k]] = k;
+    row_order_[k] = match[col_order_[k]];
+  }
+
+  // entries by permuted column, off diagonal block rows first
+  column_start_.assign(n + 1, 0);
+  block_start_.assign(n, 0);
+  entry_row_.resize(A.nonZeros());
+  entry_value_.resize(A.nonZeros());
+  int count = 0;
+  for (auto& block : blocks_) {
+    for (int c = block.begin; c < block.end; c++) {
+      int j = col_order_[c];
+      column_start_[c] = count;
+      for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1)
+          block_start_[c] = count;
+        for (int p = outer[j]; p < outer[j + 1]; p++) {
+          int r = position[row_match[inner[p]]];
+          if ((r < block.begin) == (pass == 0)) {
+            entry_row_[count] = r;
+            entry_value_[count++] = p;
+          }
+        }
+      }
+    }
+  }
+  column_start_[n] = count;
+
+  x_.assign(largest_block_, 0.0);
+  stack_.resize(largest_block_);
+  next_.resize(largest_block_);
+  reach_.resize(largest_block_);
+  marked_.assign(largest_block_, 0);
+  refactor_count_ = fallback_count_ = 0;
+  analyzed_ = true;
+}
+
+inline void BtfLU::Gather(const Eigen::SparseMatrix<double>& A) {
+  const double* values = A.valuePtr();
+  values_.resize(entry_value_.size());
+  for (size_t p = 0; p < entry_value_.size(); p++)
+    values_[p] = values[entry_value_[p]];
+}
+
+inline void BtfLU::factorize(const Eigen::SparseMatrix<double>& A) {
+  if (!analyzed_) {
+    // keep the structural singularity analyzePattern reported
+    if (error_.empty())
+      Fail(Eigen::InvalidInput, "analyzePattern must be called first");
+    return;
+  }
+  if (A.rows() != n_ || A.nonZeros() != static_cast<Eigen::Index>(entry_value_.size())) {
+    Fail(Eigen::InvalidInput, "pattern changed since analyzePattern");
+    return;
+  }
+  info_ = Eigen::Success;
+  error_.clear();
+  Gather(A);
+  for (auto& block : blocks_)
+    if (!FactorBlock(block))
+      return;
+}
+
+inline void BtfLU::refactorize(const Eigen::SparseMatrix<double>& A) {
+  if (!analyzed_ || info_ != Eigen::Success || blocks_.empty() || blocks_.back().Lp.empty() ||
+      A.nonZeros() != static_cast<Eigen::Index>(entry_value_.size())) {
+    factorize(A);
+    return;
+  }
+  Gather(A);
+  refactor_count_++;
+  for (auto& block : blocks_) {
+    if (!RefactorBlock(block)) {
+      fallback_count_++;
+      for (auto& i : blocks_)
+        if (!FactorBlock(i))
+          return;
+      return;
+    }
+  }
+}
+
+// Left-looking LU of one diagonal block with threshold partial pivoting.
+// Column k: x = L \ A(:, k) over the rows reachable from A(:, k) through L,
+// the pivoted part of x is U(:, k), the rest scaled by the pivot is L(:, k).
+inline bool BtfLU::FactorBlock(Block& block) {
+  const int n = block.end - block.begin;
+  block.pinv.assign(n, -1);
+  block.Lp.assign(n + 1, 0);
+  block.Up.assign(n + 1, 0);
+  block.Li.clear(), block.Lx.clear(), block.Ui.clear(), block.Ux.clear();
+  auto& pinv = block.pinv;
+  auto& Lp = block.Lp;
+  auto& Li = block.Li;
+
+  for (int k = 0; k < n; k++) {
+    const int c = block.begin + k;
+    Lp[k] = static_cast<int>(Li.size());
+    block.Up[k] = static_cast<int>(block.Ui.size());
+
+    // rows reachable from A(:, k) through L, in topological order in reach_[top, n)
+    int top = n;
+    for (int p = block_start_[c]; p < column_start_[c + 1]; p++) {
+      int start = entry_row_[p] - block.begin;
+      if (marked_[start])
+        continue;
+      int head = 0;
+      stack_[0] = start;
+      while (head >= 0) {
+        int i = stack_[head];
+        int J = pinv[i];
+        if (!marked_[i]) {
+          marked_[i] = 1;
+          next_[head] = J < 0 ? 0 : Lp[J] + 1;
+        }
+        bool done = true;
+        int last = J < 0 ? 0 : Lp[J + 1];
+        for (int q = next_[head]; q < last; q++) {
+          if (!marked_[Li[q]]) {
+            next_[head] = q + 1;
+            stack_[++head] = Li[q];
+            done = false;
+            break;
+          }
+        }
+        if (done) {
+          head--;
+          reach_[--top] = i;
+        }
+      }
+    }
+
+    for (int p = block_start_[c]; p < column_start_[c + 1]; p++)
+      x_[entry_row_[p] - block.begin] += values_[p];
+    for (int p = top; p < n; p++) {
+      int j = reach_[p];
+      int J = pinv[j];
+      if (J < 0)
+        continue;
+      double xj = x_[j];
+      for (int q = Lp[J] + 1; q < Lp[J + 1]; q++)
+        x_[Li[q]] -= block.Lx[q] * xj;
+    }
+
+    int pivot_row = -1;
+    double largest = -1.0;
+    for (int p = top; p < n; p++) {
+      int i = reach_[p];
+      if (pinv[i] < 0) {
+        if (std::abs(x_[i]) > largest) {
+          largest = std::abs(x_[i]);
+          pivot_row = i;
+        }
+      } else {
+        block.Ui.push_back(pinv[i]);
+        block.Ux.push_back(x_[i]);
+      }
+    }
+    // the diagonal (the matched row) when it is large enough, it keeps fill low
+    if (pinv[k] < 0 && marked_[k] && std::abs(x_[k]) >= pivot_tolerance_ * largest)
+      pivot_row = k;
+    if (pivot_row < 0 || largest <= 0.0) {
+      for (int p = top; p < n; p++) {
+        x_[reach_[p]] = 0.0;
+        marked_[reach_[p]] = 0;
+      }
+      Fail(Eigen::NumericalIssue, "zero pivot in column " + std::to_string(col_order_[c]));
+      return false;
+    }
+    double pivot = x_[pivot_row];
+    block.Ui.push_back(k);
+    block.Ux.push_back(pivot);
+    pinv[pivot_row] = k;
+    Li.push_back(pivot_row);
+    block.Lx.push_back(1.0);
+    for (int p = top; p < n; p++) {
+      int i = reach_[p];
+      if (pinv[i] < 0) {
+        Li.push_back(i);
+        block.Lx.push_back(x_[i] / pivot);
+      }
+      x_[i] = 0.0;
+      marked_[i] = 0;
+    }
+  }
+  Lp[n] = static_cast<int>(Li.size());
+  block.Up[n] = static_cast<int>(block.Ui.size());
+  // rows of L in pivot order from now on
+  for (auto& i : Li)
+    i = pinv[i];
+  return true;
+}
+
+// Numeric only pass over the stored pattern. U(:, k) rows are kept in the
+// topological order of the original reach, so the triangular solve can walk them directly.
+inline bool BtfLU::RefactorBlock(Block& block) {
+  const int n = block.end - block.begin;
+  const auto& pinv = block.pinv;
+  const auto& Lp = block.Lp;
+  const auto& Li = block.Li;
+  const auto& Up = block.Up;
+  const auto& Ui = block.Ui;
+  auto& Lx = block.Lx;
+  auto& Ux = block.Ux;
+
+  for (int k = 0; k < n; k++) {
+    const int c = block.begin + k;
+    for (int p = block_start_[c]; p < column_start_[c + 1]; p++)
+      x_[pinv[entry_row_[p] - block.begin]] += values_[p];
+    for (int p = Up[k]; p < Up[k + 1] - 1; p++) {
+      int j = Ui[p];
+      double xj = x_[j];
+      Ux[p] = xj;
+      x_[j] = 0.0;
+      for (int q = Lp[j] + 1; q < Lp[j + 1]; q++)
+        x_[Li[q]] -= Lx[q] * xj;
+    }
+    double pivot = x_[k];
+    x_[k] = 0.0;
+    double largest = 0.0;
+    for (int q = Lp[k] + 1; q < Lp[k + 1]; q++)
+      largest = std::max(largest, std::abs(x_[Li[q]]));
+    bool acceptable = pivot != 0.0 && std::abs(pivot) >= refactor_tolerance_ * largest;
+    Ux[Up[k + 1] - 1] = pivot;
+    for (int q = Lp[k] + 1; q < Lp[k + 1]; q++) {
+      Lx[q] = x_[Li[q]] / pivot;
+      x_[Li[q]] = 0.0;
+    }
+    if (!acceptable) {
+      // clear what later columns would have consumed
+      std::fill(x_.begin(), x_.begin() + n, 0.0);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Block back substitution, last block first
+inline Eigen::MatrixXd BtfLU::solve(const Eigen::MatrixXd& b) const {
+  Eigen::MatrixXd x(n_, b.cols());
+  std::vector<double> y(n_), z(n_), w(largest_block_);
+  for (Eigen::Index rhs = 0; rhs < b.cols(); rhs++) {
+    for (int r = 0; r < n_; r++)
+      y[r] = b(row_order_[r], rhs);
+    for (auto block = blocks_.rbegin(); block != blocks_.rend(); ++block) {
+      const int n = block->end - block->begin;
+      for (int i = 0; i < n; i++)
+        w[block->pinv[i]] = y[block->begin + i];
+      for (int j = 0; j < n; j++)
+        for (int q = block->Lp[j] + 1; q < block->Lp[j + 1]; q++)
+          w[block->Li[q]] -= block->Lx[q] * w[j];
+      for (int j = n - 1; j >= 0; j--) {
+        w[j] /= block->Ux[block->Up[j + 1] - 1];
+        for (int p = block->Up[j]; p < block->Up[j + 1] - 1; p++)
+          w[block->Ui[p]] -= block->Ux[p] * w[j];
+      }
+      for (int k = 0; k < n; k++) {
+        const int c = block->begin + k;
+        z[c] = w[k];
+        for (int p = column_start_[c]; p < block_start_[c]; p++)
+          y[entry_row_[p]] -= values_[p] * w[k];
+      }
+    }
+    for (int c = 0; c < n_; c++)
+      x(col_order_[c], rhs) = z[c];
+  }
+  return x;
+}
+
+// The transposed permuted matrix is block lower triangular: blocks run forward,
+// the off diagonal entries of a column become a dot product with the rows solved
+// in earlier blocks, and each block solves U^T L^T P.
+inline Eigen::MatrixXd BtfLU::solveTransposed(const Eigen::MatrixXd& b) const {
+  Eigen::MatrixXd x(n_, b.cols());
+  std::vector<double> y(n_), w(largest_block_);
+  for (Eigen::Index rhs = 0; rhs < b.cols(); rhs++) {
+    for (auto& block : blocks_) {
+      const int n = block.end - block.begin;
+      for (int k = 0; k < n; k++) {
+        const int c = block.begin + k;
+        double sum = b(col_order_[c], rhs);
+        for (int p = column_start_[c]; p < block_start_[c]; p++)
+          sum -= values_[p] * y[entry_row_[p]];
+        w[k] = sum;
+      }
+      for (int j = 0; j < n; j++) {
+        double sum = w[j];
+        for (int p = block.Up[j]; p < block.Up[j + 1] - 1; p++)
+          sum -= block.Ux[p] * w[block.Ui[p]];
+        w[j] = sum / block.Ux[block.Up[j + 1] - 1];
+      }
+      for (int j = n - 1; j >= 0; j--) {
+        double sum = w[j];
+        for (int q = block.Lp[j] + 1; q < block.Lp[j + 1]; q++)
+          sum -= block.Lx[q] * w[block.Li[q]];
+        w[j] = sum;
+      }
+      for (int i = 0; i < n; i++)
+        y[block.begin + i] = w[block.pinv[i]];
+    }
+    for (int r = 0; r < n_; r++)
+      x(row_order_[r], rhs) = y[r];
+  }
+  return x;
+}
+
+inline size_t BtfLU::nnz() const {
+  size_t count = 0;
+  for (auto& block : blocks_)
+    count += block.Li.size() + block.Ui.size();
+  for (int c = 0; c < n_; c++)
+    count += block_start_[c] - column_start_[c];
+  return count;
+}
+
+#endif // !Btf_h
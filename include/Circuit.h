@@ -3,9 +3,29 @@
 // Modified Nodal Analysis (MNA) based on Kirchhoff's voltage and current laws
 // Circuit.h
 
+#include "Arena.h"
 #include "Components.h"
+#include "Expression.h"
+#include "Parallel.h"
+#include "Solver.h"
+#include "StampMap.h"
+#include "Stats.h"
+#include "Topology.h"
+#include "Waveform.h"
 #include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 #include <fstream>
 #include <sstream>
@@ -15,10 +35,27 @@
 
 class Circuit {
 public:
-  Circuit(std::ifstream& fin);
+  Circuit(std::istream& fin);
   ~Circuit() {}
+  // components and node names point into arenas owned by this circuit
+  Circuit(const Circuit&) = delete;
+  Circuit& operator=(const Circuit&) = delete;
+  Circuit(Circuit&&) = default;
 
+  // Staged construction. Circuit(fin) runs all of these in order,
+  // calling them separately lets each phase be timed on its own.
+  Circuit();
+  void Parse(std::istream& fin);
+  void MapNodes();
+  bool Validate();
+  void CalculateMatrices();
+
+  // Factorizes A on first use and keeps the factorization, later calls only
+  // solve until CalculateMatrices (new pattern) or Restamp (new values)
   Eigen::MatrixXd SolveCircuit() const;
+  // A^T y = c against the same cached factorization, one column per right hand side
+  // (adjoint analyses, see Sensitivity.h)
+  Eigen::MatrixXd SolveAdjoint(const Eigen::MatrixXd& c) const;
   std::string string() const;
   friend std::ostream& operator<< (std::ostream&, const Circuit&);
 
@@ -28,188 +65,1263 @@ public:
   size_t resistor_count() const { return resistor_count_; }
   size_t conductor_count() const { return conductor_count_; }
   size_t inductor_count() const { return inductor_count_; }
-  size_t nodes_count() const { return nodes_.size(); }
-  Eigen::MatrixXd A_matrix() const { return A_; }
+  // diodes are only seen by the nonlinear analyses, see Diode.h
+  size_t diode_count() const { return diode_count_; }
+  // E, F, G and H
+  size_t controlled_count() const { return controlled_count_; }
+  // T, see TransmissionLine.h
+  size_t transmission_line_count() const { return transmission_line_count_; }
+  size_t nodes_count() const { return nodes_->size(); }
+  // node rows (ground excluded) followed by one row per V, L, E, H and T branch
+  size_t matrix_size() const { return nodes_->size() - 1 + branch_count_; }
+  size_t branch_count() const { return branch_count_; }
+  Eigen::MatrixXd A_matrix() const { return Eigen::MatrixXd(A_); }
   Eigen::MatrixXd b_matrix() const { return b_; }
+  const Eigen::SparseMatrix<double>& A() const { return A_; }
+  const Eigen::VectorXd& b() const { return b_; }
+
+  // threads used by CalculateMatrices, 0 = one per core
+  size_t threads() const { return threads_; }
+  void set_threads(size_t threads) { threads_ = threads ? threads : DefaultThreads(); }
+
+  // Value-only reassembly. set_value changes one component, Restamp refills A and b
+  // through the stamp map recorded on its first call without touching the pattern.
+  void set_value(size_t component, double value) { components_[component].set_value(value); }
+  void BuildStampMap();
+  void Restamp();
+  const StampMap& stamp_map() const { return stamp_map_; }
+
+  // `.param` values, and the component values written as expressions of them
+  struct ValueExpression {
+    size_t component;
+    size_t line;
+    Expression expression;
+  };
+  const ParameterTable& params() const { return params_; }
+  const std::vector<ValueExpression>& value_expressions() const { return value_expressions_; }
+  // `.step` lines in netlist order, the first is the outermost loop of a Sweep (Sweep.h)
+  struct Step {
+    int parameter;
+    std::vector<double> values;
+    size_t line;
+  };
+  const std::vector<Step>& steps() const { return steps_; }
+  // outputs named on `.sens` lines, v(node), node or i(<V or L name>)
+  const std::vector<std::string_view>& sensitivity_outputs() const { return sensitivity_outputs_; }
+  // node pairs named on `.thevenin` lines (see Thevenin.h)
+  const std::vector<std::pair<std::string_view, std::string_view>>& thevenin_ports() const {
+    return thevenin_ports_;
+  }
+  // node pairs named on `.reff` lines (see EffectiveResistance.h)
+  const std::vector<std::pair<std::string_view, std::string_view>>& resistance_pairs() const {
+    return resistance_pairs_;
+  }
+  // `.noise` lines, the output as in .sens and the frequencies in Hz (see Noise.h)
+  struct NoiseRequest {
+    std::string_view output;
+    std::vector<double> frequencies;
+    size_t line;
+  };
+  const std::vector<NoiseRequest>& noise_requests() const { return noise_; }
+  // `.reduce` lines, moments per port and the port nodes (see Reduction.h)
+  struct ReduceRequest {
+    size_t moments;
+    std::vector<std::string_view> ports;
+    size_t line;
+  };
+  const std::vector<ReduceRequest>& reduce_requests() const { return reduce_; }
+  // V and I sources given a PULSE, SIN, PWL or EXP waveform, their value is the
+  // waveform at t = 0 (see Sources.h)
+  struct SourceWaveform {
+    size_t component;
+    Waveform waveform;
+  };
+  const std::vector<SourceWaveform>& waveforms() const { return waveforms_; }
+  // sensing sides of the controlled sources and far ports of the T lines, see Component::control()
+  const std::vector<Control>& controls() const { return controls_; }
+  // `K<name> <L> <L> ... <k>` lines: every pair of the named inductors is coupled
+  // by M = k sqrt(L1 L2). Only the dynamic analyses see it, through C (Ac.h).
+  struct Coupling {
+    std::string_view name;
+    std::vector<std::string_view> inductors;
+    double coefficient;
+    size_t line;
+    std::vector<size_t> components; // of the inductors, empty when one is missing
+  };
+  const std::vector<Coupling>& couplings() const { return couplings_; }
+  // inductors joined through K lines, with consecutive branch rows from first_branch
+  // in netlist order, so their dense inductance matrix is one diagonal block of C
+  struct CouplingGroup {
+    int first_branch;
+    std::vector<size_t> inductors;
+  };
+  const std::vector<CouplingGroup>& coupling_groups() const { return coupling_groups_; }
+  // self inductances on the diagonal, mutual ones off it
+  Eigen::MatrixXd InductanceMatrix(const CouplingGroup& group) const;
+  // `.tran` lines, the step and stop time in seconds (see Transient.h)
+  struct TranRequest {
+    double step;
+    double stop;
+    size_t line;
+  };
+  const std::vector<TranRequest>& tran_requests() const { return tran_; }
+  // `.pss` lines, the period in seconds and the trapezoidal steps per period (see Pss.h)
+  struct PssRequest {
+    double period;
+    size_t steps;
+    size_t line;
+  };
+  const std::vector<PssRequest>& pss_requests() const { return pss_; }
+  // `.hb` lines, the fundamental in Hz and the harmonics kept (see HarmonicBalance.h)
+  struct HbRequest {
+    double frequency;
+    size_t harmonics;
+    size_t line;
+  };
+  const std::vector<HbRequest>& hb_requests() const { return hb_; }
+  // modes asked for by `.modes [count]`, 0 without one (see Modes.h)
+  size_t mode_count() const { return mode_count_; }
+
+  // factorization backend used by SolveCircuit, changing it drops the cached factorization.
+  // Precision::kMixed factors in float and refines, see Solver.h.
+  SolverKind solver() const { return solver_.kind(); }
+  Precision precision() const { return solver_.precision(); }
+  void set_solver(SolverKind kind, Precision precision = Precision::kDouble) {
+    solver_ = LinearSolver(kind, precision);
+  }
+  const LinearSolver& linear_solver() const { return solver_; }
+  // refinement steps and residual of the last SolveCircuit
+  const RefinementStats& refinement() const { return solver_.refinement(); }
 
-  const std::unordered_map<std::string, int>& nodes() const { return nodes_; }
+  // Calls add_a(row, col, value) and add_b(row, value) for each MNA entry of one component
+  template <class AddA, class AddB>
+  void StampComponent(const Component& component, AddA&& add_a, AddB&& add_b) const;
+
+  const ComponentList& components() const { return components_; }
+  const NodeMap& nodes() const { return *nodes_; }
+  // arena holding the parsed names and component records
+  const Arena& arena() const { return *arena_; }
+  const std::vector<TopologyIssue>& issues() const { return issues_; }
+  bool valid() const { return issues_.empty(); }
+  // phase timings and counters, only recorded when built with CIRCUIT_STATS
+  const CircuitStats& stats() const { return stats_; }
+  CircuitStats& stats() { return stats_; }
 
 private:
-  void CalculateMatrices();
+  void ParseLine(std::string_view line, size_t line_number);
+  void ParseParam(std::string_view line, size_t line_number);
+  void ParseStep(std::string_view line, size_t line_number);
+  void ParseNoise(std::string_view line, size_t line_number);
+  void ParseReduce(std::string_view line, size_t line_number);
+  void ParseTran(std::string_view line, size_t line_number);
+  void ParsePss(std::string_view line, size_t line_number);
+  void ParseHb(std::string_view line, size_t line_number);
+  bool ParseWaveform(std::string_view line, size_t& i, size_t line_number);
+  void ParseControl(char type, std::string_view line, size_t& i, size_t line_number);
+  std::string_view ParseTransmissionLine(std::string_view line, size_t& i, size_t line_number);
+  void ParseCoupling(std::string_view name, std::string_view line, size_t i, size_t line_number);
+  void MapCouplings();
+  double ParseConstant(std::string_view text, size_t line_number);
+  void Factor() const;
+  double ParseValue(std::string_view text, size_t line_number);
 
-  std::vector<Component> components_;
-  std::unordered_map<std::string, int> nodes_;
+  // arenas are declared first so they outlive the containers allocating from them
+  std::unique_ptr<Arena> arena_, node_arena_;
+  ComponentList components_;
+  std::optional<NodeMap> nodes_;
+  std::vector<TopologyIssue> issues_;
+  ParameterTable params_;
+  std::vector<ValueExpression> value_expressions_;
+  std::vector<Step> steps_;
+  std::vector<std::string_view> sensitivity_outputs_;
+  std::vector<std::pair<std::string_view, std::string_view>> thevenin_ports_, resistance_pairs_;
+  std::vector<NoiseRequest> noise_;
+  std::vector<ReduceRequest> reduce_;
+  std::vector<SourceWaveform> waveforms_;
+  std::vector<Control> controls_;
+  std::vector<Coupling> couplings_;
+  std::vector<CouplingGroup> coupling_groups_;
+  std::vector<TranRequest> tran_;
+  std::vector<PssRequest> pss_;
+  std::vector<HbRequest> hb_;
+  size_t mode_count_ = 0;
+  mutable CircuitStats stats_;
   size_t voltage_count_, current_count_, resistor_count_,
-         conductor_count_, inductor_count_;
+         conductor_count_, inductor_count_, diode_count_, controlled_count_,
+         transmission_line_count_;
+  size_t branch_count_;
+  size_t threads_;
   // matrices for MNA
-  Eigen::MatrixXd A_, b_;
-
+  Eigen::SparseMatrix<double> A_;
+  Eigen::VectorXd b_;
+  StampMap stamp_map_;
+  std::vector<double> parameters_;
+  // cached factorization of A_, SolveCircuit is logically const
+  mutable LinearSolver solver_;
 };
 
+inline Circuit::Circuit() :
+    arena_(new Arena()), node_arena_(new Arena()),
+    components_(ComponentList::allocator_type(arena_.get())),
+    nodes_(std::in_place, 0, NodeMap::hasher(), NodeMap::key_equal(),
+           NodeMap::allocator_type(node_arena_.get())),
+    voltage_count_(0), current_count_(0), resistor_count_(0),
+    conductor_count_(0), inductor_count_(0), diode_count_(0), controlled_count_(0),
+    transmission_line_count_(0), branch_count_(0), threads_(DefaultThreads()) {}
+
 // Parses circuit file and creates component vector.
 // Maps node names to ints and calculates MNA matrices.
-Circuit::Circuit(std::ifstream& fin) :
-    voltage_count_(0), current_count_(0), resistor_count_(0),
-    conductor_count_(0), inductor_count_(0) {
+inline Circuit::Circuit(std::istream& fin) : Circuit() {
+  Parse(fin);
+  MapNodes();
+  // Fail fast on circuits whose MNA system is singular by construction,
+  // otherwise calculate A, b matrices for MNA linear system
+  if (Validate())
+    CalculateMatrices();
+}
+
+// Parses circuit text and appends to the components vector.
+// The stream is read in large chunks and split into lines in place, names are
+// copied once into the arena and plain values go through from_chars, so the only
+// allocations are the chunk buffer and arena chunks.
+inline void Circuit::Parse(std::istream& fin) {
+  CIRCUIT_PHASE(stats_, Phase::kParse);
+  const size_t chunk_size = 1 << 20;
+
+  if (!fin)
+    return;
+
+  // about one component per 16 bytes of netlist, saves regrowing the vector in the arena
+  auto begin = fin.tellg();
+  if (begin != std::streampos(-1) && fin.seekg(0, std::ios::end)) {
+    auto bytes = static_cast<size_t>(fin.tellg() - begin);
+    fin.seekg(begin);
+    components_.reserve(components_.size() + bytes / 16 + 1);
+  }
+  fin.clear();
+
+  std::vector<char> chunk(chunk_size);
+  size_t carry = 0, line_number = 0;
+  while (true) {
+    fin.read(chunk.data() + carry, chunk.size() - carry);
+    size_t end = carry + static_cast<size_t>(fin.gcount());
+    size_t start = 0;
+    while (const char* newline = static_cast<const char*>(
+               std::memchr(chunk.data() + start, '\n', end - start))) {
+      size_t length = newline - (chunk.data() + start);
+      ParseLine(std::string_view(chunk.data() + start, length), ++line_number);
+      start += length + 1;
+    }
+    if (!fin) {
+      // last line without a trailing newline
+      if (start < end)
+        ParseLine(std::string_view(chunk.data() + start, end - start), ++line_number);
+      break;
+    }
+    // keep the partial line for the next read, grow if one line fills the whole chunk
+    carry = end - start;
+    std::memmove(chunk.data(), chunk.data() + start, carry);
+    if (carry == chunk.size())
+      chunk.resize(chunk.size() * 2);
+  }
 
-  char type = 0;
-  std::string p_node, n_node;
+  // parameters may be used before their .param line, so values are resolved at the end
+  if (!value_expressions_.empty() || params_.size() > 0) {
+    params_.Evaluate();
+    for (auto& v : value_expressions_)
+      components_[v.component].set_value(v.expression.Evaluate(params_.values()));
+  }
+  CIRCUIT_COUNT(stats_.bytes_allocated += chunk.capacity());
+  CIRCUIT_COUNT(stats_.arena_bytes = arena_->bytes_reserved() + node_arena_->bytes_reserved());
+  CIRCUIT_COUNT(stats_.arena_chunks = arena_->chunk_count() + node_arena_->chunk_count());
+}
+
+// Case insensitive comparison with a lower case word
+inline bool EqualsLower(std::string_view text, std::string_view lower) {
+  if (text.size() != lower.size())
+    return false;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (std::tolower(static_cast<unsigned char>(text[i])) != lower[i])
+      return false;
+  }
+  return true;
+}
+
+// Value token: one word, or an expression in {braces} or 'quotes' that may contain spaces
+inline std::string_view ValueToken(std::string_view line, size_t& i) {
+  while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i])))
+    i++;
+  size_t start = i;
+  if (i < line.size() && (line[i] == '{' || line[i] == '\'')) {
+    char close = line[i] == '{' ? '}' : '\'';
+    size_t end = line.find(close, i + 1);
+    i = end == std::string_view::npos ? line.size() : end + 1;
+  } else {
+    while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i])))
+      i++;
+  }
+  return line.substr(start, i - start);
+}
+
+// Plain numbers and numbers with a suffix are read directly, anything else is compiled
+// as an expression. Constant expressions are folded to their value here, the others
+// are kept and evaluated once all .param lines are read.
+inline double Circuit::ParseValue(std::string_view text, size_t line_number) {
   double value = 0.0;
-  std::string buffer;
-  std::istringstream istream;
-
-  // parse file to create components vector
-  if (fin) {
-    while (std::getline(fin, buffer, ' ')) {
-      type = buffer.front();
-      std::getline(fin, buffer, ' ');
-      istream.clear();
-      istream.str(buffer);
-      istream >> p_node;
-
-      std::getline(fin, buffer, ' ');
-      istream.clear();
-      istream.str(buffer);
-      istream >> n_node;
-
-      std::getline(fin, buffer, '\n');
-      istream.clear();
-      istream.str(buffer);
-      istream >> value;
-
-      switch (type) {
-        case 'C':
-          conductor_count_++;
-          break;
-        case 'I':
-          current_count_++;
-          break;
-        case 'L':
-          inductor_count_++;
-          break;
-        case 'R':
-          resistor_count_++;
-          break;
-        case 'V':
-          voltage_count_++;
-          break;
-        default:
-          break;
-      }
+  if (ParseNumber(text, value))
+    return value;
 
-      components_.push_back(Component(type, p_node, n_node, value));
+  std::string_view body = text;
+  if (body.front() == '{' || body.front() == '\'') {
+    char close = body.front() == '{' ? '}' : '\'';
+    if (body.size() < 2 || body.back() != close) {
+      throw std::runtime_error("line " + std::to_string(line_number) + ": missing '" + close +
+                               "' in \"" + std::string(text) + '"');
     }
+    body = body.substr(1, body.size() - 2);
+  } else if (!std::isalpha(static_cast<unsigned char>(body.front())) && body.front() != '_' &&
+             body.front() != '(' && body.front() != '-') {
+    throw std::runtime_error("line " + std::to_string(line_number) + ": bad value \"" +
+                             std::string(text) + '"');
+  }
+  Expression expression;
+  try {
+    expression = ExpressionCompiler(params_).Compile(body);
+  } catch (const std::runtime_error& e) {
+    throw std::runtime_error("line " + std::to_string(line_number) + ": " + e.what());
   }
-  fin.close();
+  if (expression.constant())
+    return expression.Evaluate(nullptr);
+  value_expressions_.push_back({ components_.size(), line_number, std::move(expression) });
+  return 0.0;
+}
 
-  // default node 0
-  nodes_.insert({ "0", 0 });
-  // map node names to integers
-  for (auto& i : components_) {
-    nodes_.insert({ i.p_node() , nodes_.size() });
-    nodes_.insert({ i.n_node() , nodes_.size() });
+// .param <name>=<value> [<name>=<value> ...]
+inline void Circuit::ParseParam(std::string_view line, size_t line_number) {
+  size_t i = 0;
+  while (true) {
+    while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i])))
+      i++;
+    if (i == line.size())
+      return;
+    size_t start = i;
+    while (i < line.size() &&
+           (std::isalnum(static_cast<unsigned char>(line[i])) || line[i] == '_'))
+      i++;
+    std::string_view name = line.substr(start, i - start);
+    while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i])))
+      i++;
+    if (name.empty() || !std::isalpha(static_cast<unsigned char>(name.front())) ||
+        i == line.size() || line[i] != '=') {
+      throw std::runtime_error("line " + std::to_string(line_number) +
+                               ": expected .param <name>=<value>");
+    }
+    i++;
+    std::string_view text = ValueToken(line, i);
+    if (text.empty()) {
+      throw std::runtime_error("line " + std::to_string(line_number) + ": missing value for \"" +
+                               std::string(name) + '"');
+    }
+    if (text.front() == '{' || text.front() == '\'')
+      text = text.substr(1, text.size() - 1 - (text.back() == '}' || text.back() == '\''));
+    int index = params_.Declare(name);
+    double value = 0.0;
+    try {
+      params_.Define(index, ParseNumber(text, value) ? Expression(value)
+                                                     : ExpressionCompiler(params_).Compile(text),
+                     line_number);
+    } catch (const std::runtime_error& e) {
+      throw std::runtime_error("line " + std::to_string(line_number) + ": " + e.what());
+    }
   }
+}
 
-  // Calculate A, b matrices for MNA linear system
-  CalculateMatrices();
+// Number, or expression without parameters, for directive arguments
+inline double Circuit::ParseConstant(std::string_view text, size_t line_number) {
+  std::string_view body = text;
+  if (body.front() == '{' || body.front() == '\'')
+    body = body.substr(1, body.size() - 1 - (body.back() == '}' || body.back() == '\''));
+  double value = 0.0;
+  if (ParseNumber(body, value))
+    return value;
+  Expression expression;
+  try {
+    ParameterTable scratch;
+    expression = ExpressionCompiler(scratch).Compile(body);
+  } catch (const std::runtime_error& e) {
+    throw std::runtime_error("line " + std::to_string(line_number) + ": " + e.what());
+  }
+  if (!expression.constant()) {
+    throw std::runtime_error("line " + std::to_string(line_number) + ": \"" + std::string(text) +
+                             "\" must be a constant");
+  }
+  return expression.Evaluate(nullptr);
 }
 
-// A matrix { G B }
-//          { C D }
-// b matrix { v } v = independent voltage sources
-//          { j } j = independent current sources
-void Circuit::CalculateMatrices() {
-  std::ptrdiff_t g2_count = 0, g2_index = 0, matrix_size = 0;
+// start * base^(k / points) for k = 0, 1, ... up to stop, points per decade (base 10) or octave (2)
+inline std::vector<double> LogSweep(double start, double stop, double points, double base) {
+  double ratio = std::pow(base, 1.0 / points);
+  // small slack so the stop value is included despite rounding
+  size_t count = static_cast<size_t>(std::floor(std::log(stop / start) / std::log(ratio) + 1e-9)) + 1;
+  std::vector<double> values(count);
+  for (size_t k = 0; k < count; k++)
+    values[k] = start * std::pow(ratio, static_cast<double>(k));
+  return values;
+}
 
-  // g2 refers to components with voltage values
-  g2_count = voltage_count_ + inductor_count_; // voltage sources
-  matrix_size = nodes_.size() + g2_count - 1;
-  g2_index = matrix_size - g2_count;
+// .noise <output> dec|oct <points per decade or octave> <fstart> <fstop>
+// .noise <output> lin <points> <fstart> <fstop>
+inline void Circuit::ParseNoise(std::string_view line, size_t line_number) {
+  std::vector<std::string_view> words;
+  for (size_t i = 0; true;) {
+    std::string_view word = ValueToken(line, i);
+    if (word.empty())
+      break;
+    words.push_back(word);
+  }
+  if (words.size() != 5 || !(EqualsLower(words[1], "dec") || EqualsLower(words[1], "oct") ||
+                             EqualsLower(words[1], "lin"))) {
+    throw std::runtime_error("line " + std::to_string(line_number) +
+                             ": expected .noise <output> dec|oct|lin <points> <fstart> <fstop>");
+  }
+  double points = ParseConstant(words[2], line_number);
+  double start = ParseConstant(words[3], line_number);
+  double stop = ParseConstant(words[4], line_number);
+  NoiseRequest request{ arena_->copy(words[0]), {}, line_number };
+  if (EqualsLower(words[1], "lin")) {
+    if (!(points >= 1.0) || !(stop >= start) || !(start >= 0.0))
+      throw std::runtime_error("line " + std::to_string(line_number) + ": bad .noise range");
+    size_t count = static_cast<size_t>(points);
+    for (size_t k = 0; k < count; k++)
+      request.frequencies.push_back(count == 1 ? start : start + (stop - start) * k / (count - 1));
+  } else {
+    if (!(start > 0.0) || !(stop >= start) || !(points >= 1.0))
+      throw std::runtime_error("line " + std::to_string(line_number) + ": bad .noise range");
+    request.frequencies = LogSweep(start, stop, points, EqualsLower(words[1], "dec") ? 10.0 : 2.0);
+  }
+  noise_.push_back(std::move(request));
+}
 
-  A_.resize(matrix_size, matrix_size);
-  A_.fill(0.0);
-  b_.resize(matrix_size, 1);
-  b_.fill(0.0);
+// .reduce <moments per port> <port node> ...
+inline void Circuit::ParseReduce(std::string_view line, size_t line_number) {
+  size_t i = 0;
+  std::string_view moments = ValueToken(line, i);
+  double count = moments.empty() ? 0.0 : ParseConstant(moments, line_number);
+  ReduceRequest request{ static_cast<size_t>(count), {}, line_number };
+  for (std::string_view port; !(port = ValueToken(line, i)).empty();)
+    request.ports.push_back(arena_->copy(port));
+  if (!(count >= 1.0) || request.ports.empty()) {
+    throw std::runtime_error("line " + std::to_string(line_number) +
+                             ": expected .reduce <moments> <port node> ...");
+  }
+  reduce_.push_back(std::move(request));
+}
 
-  for (auto& i : components_) {
-    std::ptrdiff_t p_node = 0, n_node = 0;
+// .tran <step> <stop>
+inline void Circuit::ParseTran(std::string_view line, size_t line_number) {
+  size_t i = 0;
+  std::string_view step = ValueToken(line, i), stop = ValueToken(line, i);
+  TranRequest request{ 0.0, 0.0, line_number };
+  if (!stop.empty()) {
+    request.step = ParseConstant(step, line_number);
+    request.stop = ParseConstant(stop, line_number);
+  }
+  if (!(request.step > 0.0) || !(request.stop >= request.step) || !ValueToken(line, i).empty()) {
+    throw std::runtime_error("line " + std::to_string(line_number) + ": expected .tran <step> <stop>");
+  }
+  tran_.push_back(request);
+}
 
-    // retrieve mapped node ints
-    auto search = nodes_.find(i.p_node());
-    p_node = search->second;
-    search = nodes_.find(i.n_node());
-    n_node = search->second;
+// .pss <period> <steps per period>
+inline void Circuit::ParsePss(std::string_view line, size_t line_number) {
+  size_t i = 0;
+  std::string_view period = ValueToken(line, i), steps = ValueToken(line, i);
+  PssRequest request{ 0.0, 0, line_number };
+  double count = 0.0;
+  if (!steps.empty()) {
+    request.period = ParseConstant(period, line_number);
+    count = ParseConstant(steps, line_number);
+  }
+  if (!(request.period > 0.0) || !(count >= 2.0) || !ValueToken(line, i).empty()) {
+    throw std::runtime_error("line " + std::to_string(line_number) +
+                             ": expected .pss <period> <steps per period>");
+  }
+  request.steps = static_cast<size_t>(count);
+  pss_.push_back(request);
+}
 
-    double value = i.value();
+// A waveform at i, <kind>(<argument> ...) with the arguments separated by spaces or
+// commas. False, with i unchanged, when there is none.
+inline bool Circuit::ParseWaveform(std::string_view line, size_t& i, size_t line_number) {
+  size_t start = i;
+  while (start < line.size() && std::isspace(static_cast<unsigned char>(line[start])))
+    start++;
+  size_t open = start;
+  while (open < line.size() && std::isalpha(static_cast<unsigned char>(line[open])))
+    open++;
+  WaveformKind kind;
+  if (!ParseWaveformKind(line.substr(start, open - start), kind))
+    return false;
+  while (open < line.size() && std::isspace(static_cast<unsigned char>(line[open])))
+    open++;
+  if (open == line.size() || line[open] != '(')
+    return false;
+  size_t close = line.find(')', open);
+  if (close == std::string_view::npos)
+    throw std::runtime_error("line " + std::to_string(line_number) + ": missing ')' after waveform");
 
-    // Modify matrix values for all components with respect to type
-    switch (i.type()) {
-      case 'C':
-        // Capacitor acts as open circuit in static calculation
-        break;
-      case 'I':
-        // signed currents in b matrix, positive entering node, negative leaving node.
-        if (p_node != 0)
-          b_(p_node - 1) = b_(p_node - 1) - value;
-        if (n_node != 0)
-          b_(n_node - 1) = b_(n_node - 1) + value;
-        break;
-      case 'L':
-        // Inductor counts as wire in static calculation
-        if (p_node != 0) {
-          A_(p_node - 1, g2_index)++;
-          A_(g2_index, p_node - 1)++;
-        }
-        if (n_node != 0) {
-          A_(n_node - 1, g2_index)--;
-          A_(g2_index, n_node - 1)--;
+  std::vector<double> arguments;
+  auto separator = [](char c) { return std::isspace(static_cast<unsigned char>(c)) || c == ','; };
+  for (size_t k = open + 1; k < close;) {
+    while (k < close && separator(line[k]))
+      k++;
+    size_t begin = k;
+    while (k < close && !separator(line[k]))
+      k++;
+    if (k > begin)
+      arguments.push_back(ParseConstant(line.substr(begin, k - begin), line_number));
+  }
+  try {
+    waveforms_.push_back({ components_.size(), Waveform(kind, std::move(arguments)) });
+  } catch (const std::invalid_argument& e) {
+    throw std::runtime_error("line " + std::to_string(line_number) + ": " + e.what());
+  }
+  i = close + 1;
+  return true;
+}
+
+// The sensing side of an E, F, G or H line at i: <+control> <-control> for E and G,
+// the name of the branch element whose current is sensed for F and H
+inline void Circuit::ParseControl(char type, std::string_view line, size_t& i, size_t line_number) {
+  Control control;
+  if (type == 'E' || type == 'G') {
+    std::string_view p = ValueToken(line, i), n = ValueToken(line, i);
+    if (n.empty()) {
+      throw std::runtime_error("line " + std::to_string(line_number) +
+                               ": expected <name> <+node> <-node> <+control> <-control> <gain>");
+    }
+    control.p_node = arena_->copy(p);
+    control.n_node = arena_->copy(n);
+  } else {
+    std::string_view source = ValueToken(line, i);
+    if (source.empty()) {
+      throw std::runtime_error("line " + std::to_string(line_number) +
+                               ": expected <name> <+node> <-node> <source> <gain>");
+    }
+    control.source = arena_->copy(source);
+  }
+  controls_.push_back(control);
+}
+
+// The rest of a T line at i: <+far> <-far> Z0=<impedance> TD=<delay> [R=<resistance>],
+// keywords in any order and case. Returns the Z0 text, which is the component's value.
+inline std::string_view Circuit::ParseTransmissionLine(std::string_view line, size_t& i, size_t line_number) {
+  auto error = [line_number]() {
+    return std::runtime_error("line " + std::to_string(line_number) +
+                              ": expected <name> <+node> <-node> <+far> <-far> Z0=<impedance> TD=<delay>"
+                              " [R=<resistance>]");
+  };
+  Control far;
+  std::string_view p = ValueToken(line, i), n = ValueToken(line, i);
+  if (n.empty())
+    throw error();
+  far.p_node = arena_->copy(p);
+  far.n_node = arena_->copy(n);
+  std::string_view impedance;
+  for (std::string_view word; !(word = ValueToken(line, i)).empty();) {
+    size_t equals = word.find('=');
+    if (equals == std::string_view::npos || equals + 1 == word.size())
+      throw error();
+    std::string_view key = word.substr(0, equals), value = word.substr(equals + 1);
+    if (EqualsLower(key, "z0"))
+      impedance = value;
+    else if (EqualsLower(key, "td"))
+      far.delay = ParseConstant(value, line_number);
+    else if (EqualsLower(key, "r"))
+      far.resistance = ParseConstant(value, line_number);
+    else
+      throw error();
+  }
+  if (impedance.empty() || !(far.delay > 0.0) || !(far.resistance >= 0.0))
+    throw error();
+  controls_.push_back(far);
+  return impedance;
+}
+
+// K<name> <inductor> <inductor> ... <coefficient>, the first two inductors are at i
+inline void Circuit::ParseCoupling(std::string_view name, std::string_view line, size_t i, size_t line_number) {
+  Coupling coupling{ arena_->copy(name), {}, 0.0, line_number, {} };
+  for (std::string_view word; !(word = ValueToken(line, i)).empty();)
+    coupling.inductors.push_back(arena_->copy(word));
+  if (coupling.inductors.size() < 3) {
+    throw std::runtime_error("line " + std::to_string(line_number) +
+                             ": expected K<name> <inductor> <inductor> ... <coefficient>");
+  }
+  coupling.coefficient = ParseConstant(coupling.inductors.back(), line_number);
+  coupling.inductors.pop_back();
+  if (!(std::abs(coupling.coefficient) > 0.0 && std::abs(coupling.coefficient) <= 1.0))
+    throw std::runtime_error("line " + std::to_string(line_number) + ": coupling must be in [-1, 0) or (0, 1]");
+  couplings_.push_back(std::move(coupling));
+}
+
+// .hb <frequency> <harmonics>
+inline void Circuit::ParseHb(std::string_view line, size_t line_number) {
+  size_t i = 0;
+  std::string_view frequency = ValueToken(line, i), harmonics = ValueToken(line, i);
+  HbRequest request{ 0.0, 0, line_number };
+  double count = -1.0;
+  if (!harmonics.empty()) {
+    request.frequency = ParseConstant(frequency, line_number);
+    count = ParseConstant(harmonics, line_number);
+  }
+  if (!(request.frequency > 0.0) || !(count >= 0.0) || !ValueToken(line, i).empty()) {
+    throw std::runtime_error("line " + std::to_string(line_number) +
+                             ": expected .hb <frequency> <harmonics>");
+  }
+  request.harmonics = static_cast<size_t>(count);
+  hb_.push_back(request);
+}
+
+// .step [param] <name> <start> <stop> <increment>
+// .step [param] <name> list <value> ...
+// .step dec|oct [param] <name> <start> <stop> <points per decade or octave>
+inline void Circuit::ParseStep(std::string_view line, size_t line_number) {
+  auto error = [line_number](const std::string& message) {
+    return std::runtime_error("line " + std::to_string(line_number) + ": " + message);
+  };
+  std::vector<std::string_view> words;
+  for (size_t i = 0; true;) {
+    std::string_view word = ValueToken(line, i);
+    if (word.empty())
+      break;
+    words.push_back(word);
+  }
+  size_t w = 0;
+  enum { kLinear, kList, kDecade, kOctave } mode = kLinear;
+  if (w < words.size() && (EqualsLower(words[w], "dec") || EqualsLower(words[w], "oct")))
+    mode = EqualsLower(words[w++], "dec") ? kDecade : kOctave;
+  if (w < words.size() && EqualsLower(words[w], "param"))
+    w++;
+  if (w == words.size() || !std::isalpha(static_cast<unsigned char>(words[w].front())))
+    throw error("expected .step [param] <name> <start> <stop> <increment>");
+  std::string_view name = words[w++];
+  if (mode == kLinear && w < words.size() && EqualsLower(words[w], "list")) {
+    mode = kList;
+    w++;
+  }
+
+  // sweep values must not depend on parameters, they are fixed before any step runs
+  std::vector<double> numbers;
+  for (; w < words.size(); w++)
+    numbers.push_back(ParseConstant(words[w], line_number));
+
+  Step step{ params_.Declare(name), {}, line_number };
+  if (mode == kList) {
+    if (numbers.empty())
+      throw error("empty .step list");
+    step.values = std::move(numbers);
+  } else {
+    if (numbers.size() != 3)
+      throw error("expected <start> <stop> <increment> after .step " + std::string(name));
+    double start = numbers[0], stop = numbers[1], increment = numbers[2];
+    if (mode == kLinear) {
+      if (increment == 0.0 || (stop - start) / increment < 0.0)
+        throw error("increment does not reach stop");
+      // small slack so 0 1 0.1 includes 1 despite rounding
+      size_t count = static_cast<size_t>(std::floor((stop - start) / increment + 1e-9)) + 1;
+      for (size_t k = 0; k < count; k++)
+        step.values.push_back(start + increment * k);
+    } else {
+      if (!(start > 0.0) || !(stop >= start) || !(increment >= 1.0))
+        throw error("logarithmic .step needs 0 < start <= stop and at least one point");
+      step.values = LogSweep(start, stop, increment, mode == kDecade ? 10.0 : 2.0);
+    }
+  }
+  // a swept name needs no .param line, its first value stands in for the nominal one
+  if (params_.line(step.parameter) == 0)
+    params_.Define(step.parameter, Expression(step.values.front()), line_number);
+  for (auto& i : steps_) {
+    if (i.parameter == step.parameter)
+      throw error("parameter \"" + std::string(name) + "\" is already stepped on line " +
+                  std::to_string(i.line));
+  }
+  steps_.push_back(std::move(step));
+}
+
+// <name> <+node> <-node> <value>, E and G lines add <+control> <-control> and F and H
+// lines <source> before the value, T lines are as in ParseTransmissionLine.
+// Blank lines and '*' comments are skipped, so are '.' directives other than .param,
+// .step, .noise, .reduce, .tran, .pss, .hb, .modes, .sens, .thevenin and .reff
+inline void Circuit::ParseLine(std::string_view line, size_t line_number) {
+  std::string_view tokens[4];
+  size_t count = 0, i = 0;
+  while (i < line.size() && count < 3) {
+    while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i])))
+      i++;
+    size_t start = i;
+    while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i])))
+      i++;
+    if (i > start)
+      tokens[count++] = line.substr(start, i - start);
+    if (count == 1 && (tokens[0].front() == '*' || tokens[0].front() == '.'))
+      break;
+  }
+  if (count == 0 || tokens[0].front() == '*')
+    return;
+  if (tokens[0].front() == 'K') {
+    // the inductor names start after the K name
+    ParseCoupling(tokens[0], line, count > 1 ? tokens[1].data() - line.data() : line.size(), line_number);
+    return;
+  }
+  if (tokens[0].front() == '.') {
+    if (EqualsLower(tokens[0], ".param"))
+      ParseParam(line.substr(i), line_number);
+    else if (EqualsLower(tokens[0], ".step"))
+      ParseStep(line.substr(i), line_number);
+    else if (EqualsLower(tokens[0], ".noise"))
+      ParseNoise(line.substr(i), line_number);
+    else if (EqualsLower(tokens[0], ".reduce"))
+      ParseReduce(line.substr(i), line_number);
+    else if (EqualsLower(tokens[0], ".tran"))
+      ParseTran(line.substr(i), line_number);
+    else if (EqualsLower(tokens[0], ".pss"))
+      ParsePss(line.substr(i), line_number);
+    else if (EqualsLower(tokens[0], ".hb"))
+      ParseHb(line.substr(i), line_number);
+    else if (EqualsLower(tokens[0], ".modes")) {
+      std::string_view count = ValueToken(line, i);
+      double modes = count.empty() ? 6.0 : ParseConstant(count, line_number);
+      if (!(modes >= 1.0))
+        throw std::runtime_error("line " + std::to_string(line_number) + ": expected .modes [count]");
+      mode_count_ = static_cast<size_t>(modes);
+    } else if (EqualsLower(tokens[0], ".sens")) {
+      for (std::string_view output; !(output = ValueToken(line, i)).empty();)
+        sensitivity_outputs_.push_back(arena_->copy(output));
+    } else if (EqualsLower(tokens[0], ".thevenin") || EqualsLower(tokens[0], ".reff")) {
+      auto& pairs = EqualsLower(tokens[0], ".reff") ? resistance_pairs_ : thevenin_ports_;
+      for (std::string_view p; !(p = ValueToken(line, i)).empty();) {
+        std::string_view n = ValueToken(line, i);
+        if (n.empty()) {
+          throw std::runtime_error("line " + std::to_string(line_number) + ": expected " +
+                                   std::string(tokens[0]) + " <node> <node> ...");
         }
+        pairs.emplace_back(arena_->copy(p), arena_->copy(n));
+      }
+    }
+    return;
+  }
+  // controlled sources name what they sense before the value
+  const char type = tokens[0].front();
+  const bool controlled = type == 'E' || type == 'F' || type == 'G' || type == 'H';
+  if (count == 3 && controlled)
+    ParseControl(type, line, i, line_number);
+  if (count == 3 && type == 'T') {
+    tokens[3] = ParseTransmissionLine(line, i, line_number);
+    count++;
+  }
+  // sources may give a waveform in place of the value
+  bool waveform = count == 3 && (tokens[0].front() == 'V' || tokens[0].front() == 'I') &&
+                  ParseWaveform(line, i, line_number);
+  if (count == 3 && !waveform) {
+    tokens[3] = ValueToken(line, i);
+    if (!tokens[3].empty())
+      count++;
+  }
+  if (count < 4 && !waveform) {
+    throw std::runtime_error("line " + std::to_string(line_number) +
+                             ": expected <name> <+node> <-node> <value>");
+  }
+
+  double value = waveform ? waveforms_.back().waveform.Value(0.0) : ParseValue(tokens[3], line_number);
+
+  switch (tokens[0].front()) {
+    case 'C':
+      conductor_count_++;
+      break;
+    case 'D':
+      diode_count_++;
+      break;
+    case 'E':
+    case 'F':
+    case 'G':
+    case 'H':
+      controlled_count_++;
+      break;
+    case 'I':
+      current_count_++;
+      break;
+    case 'L':
+      inductor_count_++;
+      break;
+    case 'R':
+      resistor_count_++;
+      break;
+    case 'T':
+      transmission_line_count_++;
+      break;
+    case 'V':
+      voltage_count_++;
+      break;
+    default:
+      break;
+  }
+
+  components_.push_back(Component(arena_->copy(tokens[0]), arena_->copy(tokens[1]),
+                                  arena_->copy(tokens[2]), value));
+  if (controlled || type == 'T')
+    components_.back().set_control(static_cast<int>(controls_.size()) - 1);
+}
+
+// Map node names to ints. Keys are views of the names parsed into the arena,
+// the map itself lives in a second arena that is dropped on every rebuild.
+inline void Circuit::MapNodes() {
+  CIRCUIT_PHASE(stats_, Phase::kIntern);
+  nodes_.reset();
+  node_arena_->release();
+  nodes_.emplace(components_.size() + 1, NodeMap::hasher(), NodeMap::key_equal(),
+                 NodeMap::allocator_type(node_arena_.get()));
+  auto& nodes = *nodes_;
+  // default node 0
+  nodes.insert({ "0", 0 });
+  // map node names to integers, V, L, E, H and T get consecutive branch rows
+  branch_count_ = 0;
+  bool current_controlled = false;
+  for (auto& i : components_) {
+    int p_index = nodes.insert({ i.p_node(), static_cast<int>(nodes.size()) }).first->second;
+    int n_index = nodes.insert({ i.n_node(), static_cast<int>(nodes.size()) }).first->second;
+    int branch = -1;
+    const char type = i.type();
+    if (type == 'V' || type == 'L' || type == 'E' || type == 'H' || type == 'T')
+      branch = static_cast<int>(branch_count_++);
+    i.set_indices(p_index, n_index, branch);
+    if (type == 'E' || type == 'G' || type == 'T') {
+      Control& control = controls_[i.control()];
+      control.p_index = nodes.insert({ control.p_node, static_cast<int>(nodes.size()) }).first->second;
+      control.n_index = nodes.insert({ control.n_node, static_cast<int>(nodes.size()) }).first->second;
+    }
+    current_controlled |= type == 'F' || type == 'H';
+  }
+  // F and H sense a branch current, by name
+  if (current_controlled) {
+    std::unordered_map<std::string_view, int> branches;
+    for (auto& i : components_) {
+      if (i.branch() >= 0)
+        branches.emplace(i.name(), i.branch());
+    }
+    for (auto& i : components_) {
+      if (i.type() == 'F' || i.type() == 'H') {
+        Control& control = controls_[i.control()];
+        auto found = branches.find(control.source);
+        control.branch = found == branches.end() ? -1 : found->second;
+      }
+    }
+  }
+  if (!couplings_.empty())
+    MapCouplings();
+  CIRCUIT_COUNT(stats_.arena_bytes = arena_->bytes_reserved() + node_arena_->bytes_reserved());
+  CIRCUIT_COUNT(stats_.arena_chunks = arena_->chunk_count() + node_arena_->chunk_count());
+}
 
-        // 0 voltage
-        b_(g2_index) = 0.0;
-        g2_index++;
+// Finds the inductors of every K line, then renumbers the branches so each coupled
+// group's rows are consecutive. A group takes its rows where its first inductor is.
+inline void Circuit::MapCouplings() {
+  std::unordered_map<std::string_view, size_t> inductors;
+  for (size_t c = 0; c < components_.size(); c++) {
+    if (components_[c].type() == 'L')
+      inductors.emplace(components_[c].name(), c);
+  }
+  NodeSets joined(components_.size());
+  std::vector<bool> coupled(components_.size(), false);
+  for (auto& k : couplings_) {
+    k.components.clear();
+    for (std::string_view name : k.inductors) {
+      auto found = inductors.find(name);
+      if (found == inductors.end()) {
+        k.components.clear();
         break;
-      case 'R':
-        // G-Matrix A
-        if (p_node != 0)
-          A_(p_node - 1, p_node - 1) = A_(p_node - 1, p_node - 1) + 1.0 / value;
-        if (n_node != 0)
-          A_(n_node - 1, n_node - 1) = A_(n_node - 1, n_node - 1) + 1.0 / value;
-        // Mutual conductance
-        if (p_node != 0 && n_node != 0) {
-          A_(p_node - 1, n_node - 1) = A_(p_node - 1, n_node - 1) - 1.0 / value;
-          A_(n_node - 1, p_node - 1) = A_(n_node - 1, p_node - 1) - 1.0 / value;
-        }
+      }
+      k.components.push_back(found->second);
+    }
+    for (size_t c : k.components) {
+      coupled[c] = true;
+      joined.join(static_cast<int>(k.components.front()), static_cast<int>(c));
+    }
+  }
+
+  coupling_groups_.clear();
+  std::vector<int> group_of(components_.size(), -1);
+  for (size_t c = 0; c < components_.size(); c++) {
+    if (!coupled[c])
+      continue;
+    int& group = group_of[joined.find(static_cast<int>(c))];
+    if (group < 0) {
+      group = static_cast<int>(coupling_groups_.size());
+      coupling_groups_.push_back({ -1, {} });
+    }
+    coupling_groups_[group].inductors.push_back(c);
+  }
+  int branch = 0;
+  for (size_t c = 0; c < components_.size(); c++) {
+    Component& i = components_[c];
+    if (i.branch() < 0)
+      continue;
+    if (!coupled[c]) {
+      i.set_indices(i.p_index(), i.n_index(), branch++);
+      continue;
+    }
+    CouplingGroup& group = coupling_groups_[group_of[joined.find(static_cast<int>(c))]];
+    if (group.first_branch >= 0)
+      continue;
+    group.first_branch = branch;
+    for (size_t member : group.inductors) {
+      Component& inductor = components_[member];
+      inductor.set_indices(inductor.p_index(), inductor.n_index(), branch++);
+    }
+  }
+}
+
+inline Eigen::MatrixXd Circuit::InductanceMatrix(const CouplingGroup& group) const {
+  const Eigen::Index m = static_cast<Eigen::Index>(group.inductors.size());
+  Eigen::MatrixXd L = Eigen::MatrixXd::Zero(m, m);
+  for (Eigen::Index i = 0; i < m; i++)
+    L(i, i) = components_[group.inductors[i]].value();
+  for (auto& k : couplings_) {
+    for (size_t a = 0; a < k.components.size(); a++) {
+      const Component& first = components_[k.components[a]];
+      if (first.branch() < group.first_branch || first.branch() >= group.first_branch + m)
         break;
-      case 'V':
-        if (p_node != 0) {
-          A_(p_node - 1, g2_index)++;
-          A_(g2_index, p_node - 1)++;
+      for (size_t b = a + 1; b < k.components.size(); b++) {
+        const Component& second = components_[k.components[b]];
+        const Eigen::Index i = first.branch() - group.first_branch, j = second.branch() - group.first_branch;
+        const double mutual = k.coefficient * std::sqrt(first.value() * second.value());
+        L(i, j) += mutual;
+        L(j, i) += mutual;
+      }
+    }
+  }
+  return L;
+}
+
+// Runs the topology check, false if the circuit cannot be solved.
+// Coupled inductances must also be physical, a positive semidefinite matrix.
+inline bool Circuit::Validate() {
+  issues_ = CheckTopology(components_, *nodes_, controls_);
+  for (auto& k : couplings_) {
+    if (k.components.size() != k.inductors.size())
+      issues_.push_back({ TopologyIssue::Kind::kMissingInductor, { std::string(k.name) } });
+  }
+  for (auto& group : coupling_groups_) {
+    if (!InductanceMatrix(group).ldlt().isPositive()) {
+      TopologyIssue issue{ TopologyIssue::Kind::kIndefiniteCoupling, {} };
+      for (size_t c : group.inductors)
+        issue.names.push_back(std::string(components_[c].name()));
+      issues_.push_back(std::move(issue));
+    }
+  }
+  return issues_.empty();
+}
+
+// A matrix { G B }
+//          { C D }
+// b matrix { v } v = independent voltage sources
+//          { j } j = independent current sources
+template <class AddA, class AddB>
+void Circuit::StampComponent(const Component& component, AddA&& add_a, AddB&& add_b) const {
+  // node 0 is ground and has no row, node k is row k - 1
+  const int p_node = component.p_index() - 1;
+  const int n_node = component.n_index() - 1;
+  // g2 refers to components with voltage values, their rows follow the node rows
+  const int g2_index = static_cast<int>(nodes_->size()) - 1 + component.branch();
+  const double value = component.value();
+
+  // Modify matrix values for all components with respect to type
+  switch (component.type()) {
+    case 'C':
+      // Capacitor acts as open circuit in static calculation
+      break;
+    case 'I':
+      // signed currents in b matrix, positive entering node, negative leaving node.
+      if (p_node >= 0)
+        add_b(p_node, -value);
+      if (n_node >= 0)
+        add_b(n_node, value);
+      break;
+    case 'L':
+    case 'V':
+      // Inductor counts as a 0V source (wire) in static calculation
+      if (p_node >= 0) {
+        add_a(p_node, g2_index, 1.0);
+        add_a(g2_index, p_node, 1.0);
+      }
+      if (n_node >= 0) {
+        add_a(n_node, g2_index, -1.0);
+        add_a(g2_index, n_node, -1.0);
+      }
+      if (component.type() == 'V')
+        add_b(g2_index, value);
+      break;
+    case 'E':
+    case 'H': {
+      // a V source whose branch row is v(p) - v(n) - gain v(control) = 0 for E
+      // and v(p) - v(n) - gain i(source) = 0 for H
+      if (p_node >= 0) {
+        add_a(p_node, g2_index, 1.0);
+        add_a(g2_index, p_node, 1.0);
+      }
+      if (n_node >= 0) {
+        add_a(n_node, g2_index, -1.0);
+        add_a(g2_index, n_node, -1.0);
+      }
+      const Control& control = controls_[component.control()];
+      if (component.type() == 'E') {
+        if (control.p_index > 0)
+          add_a(g2_index, control.p_index - 1, -value);
+        if (control.n_index > 0)
+          add_a(g2_index, control.n_index - 1, value);
+      } else if (control.branch >= 0) {
+        add_a(g2_index, static_cast<int>(nodes_->size()) - 1 + control.branch, -value);
+      }
+      break;
+    }
+    case 'T': {
+      // at DC the line connects its ports 1:1 through its resistance,
+      // v(p) - v(n) - v(+far) + v(-far) - R i = 0 with i into p and out of +far.
+      // TransientAnalysis replaces this row by the line's characteristics.
+      const Control& far = controls_[component.control()];
+      auto add_port = [&](int p, int n, double sign) {
+        if (p >= 0) {
+          add_a(p, g2_index, sign);
+          add_a(g2_index, p, sign);
         }
-        if (n_node != 0) {
-          A_(n_node - 1, g2_index)--;
-          A_(g2_index, n_node - 1)--;
+        if (n >= 0) {
+          add_a(n, g2_index, -sign);
+          add_a(g2_index, n, -sign);
         }
-
-        b_(g2_index) = value;
-        g2_index++;
-        break;
-      default:
-        break;
+      };
+      add_port(p_node, n_node, 1.0);
+      add_port(far.p_index - 1, far.n_index - 1, -1.0);
+      add_a(g2_index, g2_index, -far.resistance);
+      break;
+    }
+    case 'F':
+    case 'G': {
+      // a current source of gain times i(source) (F) or v(control) (G) from p to n,
+      // straight into the node rows with no row of its own
+      const Control& control = controls_[component.control()];
+      auto add_current = [&](int column, double gain) {
+        if (p_node >= 0)
+          add_a(p_node, column, gain);
+        if (n_node >= 0)
+          add_a(n_node, column, -gain);
+      };
+      if (component.type() == 'G') {
+        if (control.p_index > 0)
+          add_current(control.p_index - 1, value);
+        if (control.n_index > 0)
+          add_current(control.n_index - 1, -value);
+      } else if (control.branch >= 0) {
+        add_current(static_cast<int>(nodes_->size()) - 1 + control.branch, value);
+      }
+      break;
     }
+    case 'R':
+      // G-Matrix A
+      if (p_node >= 0)
+        add_a(p_node, p_node, 1.0 / value);
+      if (n_node >= 0)
+        add_a(n_node, n_node, 1.0 / value);
+      // Mutual conductance
+      if (p_node >= 0 && n_node >= 0) {
+        add_a(p_node, n_node, -1.0 / value);
+        add_a(n_node, p_node, -1.0 / value);
+      }
+      break;
+    default:
+      break;
   }
 }
 
+// Parallel assembly into compressed column storage.
+// Each thread stamps a contiguous chunk of components into its own (column, row)
+// keyed triplets, sorts and sums duplicates locally. Columns are then split into
+// one range per thread and each range is k-way merged from every thread's sorted
+// run, so no two threads ever write the same entry.
+inline void Circuit::CalculateMatrices() {
+  CIRCUIT_PHASE(stats_, Phase::kAssemble);
+  stamp_map_.clear();
+  solver_.Reset();
+  struct Entry {
+    std::uint64_t key; // column << 32 | row, sorts column major
+    double value;
+    bool operator<(const Entry& other) const { return key < other.key; }
+  };
+  auto reduce = [](std::vector<Entry>& entries) {
+    size_t out = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (out > 0 && entries[out - 1].key == entries[i].key)
+        entries[out - 1].value += entries[i].value;
+      else
+        entries[out++] = entries[i];
+    }
+    entries.resize(out);
+  };
+
+  const auto size = static_cast<std::ptrdiff_t>(matrix_size());
+  // below a few thousand components per thread the spawn costs more than it saves
+  const size_t threads = std::max<size_t>(1, std::min(threads_, components_.size() / 4096));
+
+  std::vector<std::vector<Entry>> local(threads);
+  std::vector<std::vector<std::pair<int, double>>> local_b(threads);
+  ParallelFor(threads, [&](size_t t) {
+    auto range = ChunkRange(components_.size(), threads, t);
+    auto& entries = local[t];
+    entries.reserve((range.second - range.first) * 4);
+    for (size_t i = range.first; i < range.second; i++) {
+      StampComponent(components_[i],
+        [&entries](int row, int col, double value) {
+          entries.push_back({ std::uint64_t(col) << 32 | std::uint32_t(row), value });
+        },
+        [&local_b, t](int row, double value) { local_b[t].push_back({ row, value }); });
+    }
+    std::sort(entries.begin(), entries.end());
+    reduce(entries);
+  });
+
+  // merge column range r from every thread's sorted run
+  std::vector<std::vector<Entry>> merged(threads);
+  ParallelFor(threads, [&](size_t r) {
+    auto columns = ChunkRange(static_cast<size_t>(size), threads, r);
+    std::vector<std::pair<const Entry*, const Entry*>> runs;
+    size_t total = 0;
+    for (auto& entries : local) {
+      auto first = std::lower_bound(entries.begin(), entries.end(),
+                                    Entry{ std::uint64_t(columns.first) << 32, 0.0 });
+      auto last = std::lower_bound(first, entries.end(),
+                                   Entry{ std::uint64_t(columns.second) << 32, 0.0 });
+      if (first != last)
+        runs.push_back({ &*first, &*first + (last - first) });
+      total += last - first;
+    }
+    auto& out = merged[r];
+    out.reserve(total);
+    while (!runs.empty()) {
+      size_t next = 0;
+      for (size_t i = 1; i < runs.size(); i++)
+        if (runs[i].first->key < runs[next].first->key)
+          next = i;
+      out.push_back(*runs[next].first++);
+      if (runs[next].first == runs[next].second)
+        runs.erase(runs.begin() + next);
+    }
+    reduce(out);
+  });
+
+  std::vector<size_t> offsets(threads + 1, 0);
+  for (size_t r = 0; r < threads; r++)
+    offsets[r + 1] = offsets[r] + merged[r].size();
+
+  A_.resize(size, size);
+  A_.resizeNonZeros(static_cast<std::ptrdiff_t>(offsets[threads]));
+  int* outer = A_.outerIndexPtr();
+  int* inner = A_.innerIndexPtr();
+  double* values = A_.valuePtr();
+  ParallelFor(threads, [&](size_t r) {
+    auto columns = ChunkRange(static_cast<size_t>(size), threads, r);
+    size_t position = offsets[r], column = columns.first;
+    for (auto& i : merged[r]) {
+      size_t entry_column = i.key >> 32;
+      while (column <= entry_column)
+        outer[column++] = static_cast<int>(position);
+      inner[position] = static_cast<int>(i.key & 0xffffffffu);
+      values[position++] = i.value;
+    }
+    while (column < columns.second)
+      outer[column++] = static_cast<int>(position);
+  });
+  outer[size] = static_cast<int>(offsets[threads]);
+
+  b_ = Eigen::VectorXd::Zero(size);
+  for (auto& entries : local_b)
+    for (auto& i : entries)
+      b_(i.first) += i.second;
+
+  CIRCUIT_COUNT(stats_.bytes_allocated += A_.nonZeros() * (sizeof(double) + sizeof(int)) +
+                                          (size + 1) * sizeof(int) + b_.size() * sizeof(double));
+  CIRCUIT_COUNT(stats_.matrix_nnz = A_.nonZeros());
+}
+
+// Records where each component's stamps land in A's value array and b
+inline void Circuit::BuildStampMap() {
+  stamp_map_.Build(components_, A_, threads_,
+    [this](const Component& component, auto&& add_a, auto&& add_b) {
+      StampComponent(component, add_a, add_b);
+    });
+  parameters_.resize(components_.size());
+}
+
+inline void Circuit::Restamp() {
+  CIRCUIT_PHASE(stats_, Phase::kAssemble);
+  if (stamp_map_.empty())
+    BuildStampMap();
+  stamp_map_.Parameters(components_, parameters_.data());
+  stamp_map_.Scatter(parameters_.data(), A_.valuePtr(), b_.data());
+  solver_.Invalidate();
+}
+
 // Linear system Ax = b
 // x = { v } unknown voltages of each node
 //     {...} unknown voltages of each node
 //     { i } unknown current through all V and L
-Eigen::MatrixXd Circuit::SolveCircuit() const {
-  Eigen::MatrixXd x = A_.colPivHouseholderQr().solve(b_);
+// Throws std::runtime_error if the topology check failed or A is singular
+// Analyzes and factorizes A_ unless the cached factorization is still current
+inline void Circuit::Factor() const {
+  if (!issues_.empty()) {
+    std::string message = "circuit topology is invalid:";
+    for (auto& i : issues_)
+      message += "\n  " + i.string();
+    throw std::runtime_error(message);
+  }
+
+  if (!solver_.analyzed()) {
+    CIRCUIT_PHASE(stats_, Phase::kOrder);
+    solver_.Analyze(A_);
+  }
+  if (!solver_.factored()) {
+    CIRCUIT_PHASE(stats_, Phase::kFactor);
+    // throws on structurally or exactly zero pivots
+    solver_.Factorize(A_);
+    CIRCUIT_COUNT(stats_.factor_nnz = solver_.factor_nnz());
+    CIRCUIT_COUNT(stats_.fill_in = stats_.factor_nnz > stats_.matrix_nnz ?
+                                   stats_.factor_nnz - stats_.matrix_nnz : 0);
+    CIRCUIT_COUNT(stats_.bytes_allocated += stats_.factor_nnz * (sizeof(double) + sizeof(int)));
+  }
+}
+
+inline Eigen::MatrixXd Circuit::SolveCircuit() const {
+  Factor();
+  Eigen::VectorXd x;
+  {
+    CIRCUIT_PHASE(stats_, Phase::kSolve);
+    x = solver_.SolveRefined(A_, b_);
+  }
+  CIRCUIT_COUNT(stats_.iterations += solver_.refinement().steps);
+  // numerically singular systems the graph check cannot see show up as a
+  // large backward error, the refinement residual costs no extra SpMV
+  auto& refinement = solver_.refinement();
+  if (!(refinement.backward_error <= 1e-9))
+    throw std::runtime_error("MNA matrix is numerically singular: residual " +
+                             std::to_string(refinement.residual));
   return x;
 }
 
-std::string Circuit::string() const {
+inline Eigen::MatrixXd Circuit::SolveAdjoint(const Eigen::MatrixXd& c) const {
+  Factor();
+  CIRCUIT_PHASE(stats_, Phase::kSolve);
+  return solver_.SolveTransposedRefined(A_, c);
+}
+
+inline std::string Circuit::string() const {
+  CIRCUIT_PHASE(stats_, Phase::kOutput);
   std::ostringstream result;
   result << "| Type | +node | -node | value |\n";
   for (size_t i = 0; i < components_.size(); i++) {
@@ -218,7 +1330,7 @@ std::string Circuit::string() const {
   return result.str();
 }
 
-std::ostream& operator<< (std::ostream& os, const Circuit& c) {
+inline std::ostream& operator<< (std::ostream& os, const Circuit& c) {
   os << c.string();
   return os;
 }
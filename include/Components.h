@@ -1,34 +1,80 @@
 // Jeremy Renati 2022
 // Components of an electronic circuit supporting
-// volatages, resistors, currents, inductors, capacitors
+// volatages, resistors, currents, inductors, capacitors,
+// the four controlled sources and transmission lines
 
+#include "Arena.h"
+#include <functional>
 #include <sstream>
 #include <iomanip>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #ifndef Components_h
 #define Components_h
 
-// type, high node, low node, value
+// The second side of a four terminal element, kept out of Component so the common
+// two terminal record does not grow. E (VCVS) and G (VCCS) sense the voltage between
+// two nodes, F (CCCS) and H (CCVS) the current of a branch element named by source.
+// For a T line the nodes are the far port, with the line's delay and resistance.
+struct Control {
+  std::string_view p_node, n_node; // E, G and T
+  std::string_view source;         // F and H, a V, L, E or H
+  double delay = 0.0, resistance = 0.0; // T
+  // filled in by Circuit::MapNodes, branch is -1 when source names no branch element
+  int p_index = 0, n_index = 0, branch = -1;
+};
+
+// name, high node, low node, value. Type is the first letter of the name.
+// Names are views into the owning Circuit's arena, so the record is trivially copyable.
 class Component {
 public:
-  Component(char type, std::string p_node, std::string n_node, double value) :
-      type_(type), positive_node_(p_node), negative_node_(n_node), value_(value) {}
-  ~Component() {}
+  Component(std::string_view name, std::string_view p_node, std::string_view n_node,
+            double value) :
+      type_(name.front()), name_(name), positive_node_(p_node), negative_node_(n_node),
+      value_(value), p_index_(0), n_index_(0), branch_(-1), control_(-1) {}
 
   std::string string() const;
   char type() const { return type_; }
-  std::string p_node() const { return positive_node_; }
-  std::string n_node() const { return negative_node_; }
+  std::string_view name() const { return name_; }
+  std::string_view p_node() const { return positive_node_; }
+  std::string_view n_node() const { return negative_node_; }
   double value() const { return value_; }
+  void set_value(double value) { value_ = value; }
+  // what the MNA stamps are linear in: conductance for resistors, the value otherwise
+  double parameter() const { return type_ == 'R' ? 1.0 / value_ : value_; }
+  void set_parameter(double parameter) { value_ = type_ == 'R' ? 1.0 / parameter : parameter; }
+
+  // node ints and branch (extra MNA row) number, filled in by Circuit::MapNodes
+  int p_index() const { return p_index_; }
+  int n_index() const { return n_index_; }
+  int branch() const { return branch_; }
+  void set_indices(int p_index, int n_index, int branch) {
+    p_index_ = p_index;
+    n_index_ = n_index;
+    branch_ = branch;
+  }
+  // E, F, G, H and T: index of their Control in Circuit::controls(), -1 otherwise
+  int control() const { return control_; }
+  void set_control(int control) { control_ = control; }
 
 private:
   char type_;
-  std::string positive_node_;
-  std::string negative_node_;
+  std::string_view name_;
+  std::string_view positive_node_;
+  std::string_view negative_node_;
   double value_;
+  int p_index_, n_index_, branch_, control_;
 };
 
-std::string Component::string() const {
+// Component records and the node name map both live in arenas owned by Circuit
+using ComponentList = std::vector<Component, ArenaAllocator<Component>>;
+using NodeMap = std::unordered_map<std::string_view, int, std::hash<std::string_view>,
+                                   std::equal_to<std::string_view>,
+                                   ArenaAllocator<std::pair<const std::string_view, int>>>;
+
+inline std::string Component::string() const {
   std::ostringstream oss;
   oss << '|' << std::setw(6) << type_ << '|' << std::setw(7)
       << positive_node_ << '|' << std::setw(7) << negative_node_
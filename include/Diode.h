@@ -0,0 +1,52 @@
+// Junction diode, the nonlinear device of the large signal analyses.
+// D<name> <anode> <cathode> <Is>, i = Is (exp(v / Vt) - 1) from anode to cathode.
+// The linear analyses (DC, AC, transient) leave it out, as an open circuit. Above
+// kLimit thermal voltages the exponential continues as its tangent line, so a Newton
+// iterate far into forward bias gives a large finite current instead of an overflow.
+// Diode.h
+
+#include "Circuit.h"
+#include <cmath>
+#include <vector>
+
+#ifndef Diode_h
+#define Diode_h
+
+struct Diode {
+  static constexpr double kLimit = 40.0;
+  // kT/q at 27 C
+  static constexpr double kThermalVoltage = 0.025864186;
+
+  size_t component;
+  int p_row, n_row; // MNA rows of anode and cathode, -1 for ground
+  double saturation;
+  double thermal_voltage = kThermalVoltage;
+
+  // current and conductance di/dv at v = v(anode) - v(cathode)
+  void Evaluate(double v, double& current, double& conductance) const {
+    double u = v / thermal_voltage;
+    if (u > kLimit) {
+      double e = std::exp(kLimit);
+      current = saturation * (e * (1.0 + u - kLimit) - 1.0);
+      conductance = saturation * e / thermal_voltage;
+    } else {
+      double e = std::exp(u);
+      current = saturation * (e - 1.0);
+      conductance = saturation * e / thermal_voltage;
+    }
+  }
+};
+
+// the circuit's diodes in netlist order, circuit must have its nodes mapped
+inline std::vector<Diode> CircuitDiodes(const Circuit& circuit) {
+  std::vector<Diode> diodes;
+  const auto& components = circuit.components();
+  for (size_t c = 0; c < components.size(); c++) {
+    auto& i = components[c];
+    if (i.type() == 'D')
+      diodes.push_back({ c, i.p_index() - 1, i.n_index() - 1, i.value() });
+  }
+  return diodes;
+}
+
+#endif // !Diode_h
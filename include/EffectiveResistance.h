@@ -0,0 +1,236 @@
+// Effective resistance between node pairs of the circuit's resistor network.
+// R(a, b) = (e_a - e_b)^T L^+ (e_a - e_b) for the weighted Laplacian L of the
+// resistors. Grounding one node of every connected part (node 0 for the part with
+// ground) leaves a symmetric positive definite matrix, so L^+ is replaced by one sparse
+// Cholesky factorization of the grounded Laplacian, and an exact query is one solve
+// with the grounded rows left out. Queries are batched like Thevenin.h ports.
+// For many queries on a large network, Project builds the embedding of Spielman and
+// Srivastava: Z = Q W^1/2 B L^+ with B the edge incidence, W the conductances and Q a
+// random +-1/sqrt(k) matrix of k rows, so that by Johnson-Lindenstrauss
+// R(a, b) ~ ||Z e_a - Z e_b||^2 within 1 +- epsilon for k = Dimension(n, epsilon).
+// Building Z costs k solves, after which Estimate reads two contiguous columns of k,
+// O(log n) per query. Only resistors take part, other components are ignored.
+// EffectiveResistance.h
+
+#include "Circuit.h"
+#include "Parallel.h"
+#include "Topology.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef EffectiveResistance_h
+#define EffectiveResistance_h
+
+class EffectiveResistance {
+public:
+  // circuit needs its nodes mapped, throws std::runtime_error for resistors <= 0
+  explicit EffectiveResistance(const Circuit& circuit);
+
+  // nodes, ground included
+  size_t size() const { return row_.size(); }
+  // resistors in the network, parallel ones are one edge
+  size_t edges() const { return edges_.size(); }
+  // infinite between nodes no resistor path joins
+  double Query(int a, int b) const;
+  // one per (a, b) node index pair, threads 0 = the circuit's
+  std::vector<double> Query(const std::vector<std::pair<int, int>>& pairs, size_t threads = 0) const;
+
+  // rows of Q for a relative error of epsilon with high probability
+  static size_t Dimension(size_t nodes, double epsilon) {
+    return static_cast<size_t>(std::ceil(24.0 * std::log(static_cast<double>(std::max<size_t>(nodes, 2))) /
+                                         (epsilon * epsilon)));
+  }
+  // Builds Z with dimension rows. The same seed gives the same Z for any thread count.
+  void Project(size_t dimension, std::uint64_t seed = 1, size_t threads = 0);
+  size_t dimension() const { return static_cast<size_t>(embedding_.rows()); }
+  // ||Z e_a - Z e_b||^2, Project first
+  double Estimate(int a, int b) const;
+
+private:
+  struct Edge {
+    int a, b;
+    double conductance;
+  };
+  // columns at a time in multiple right hand side solves
+  static constexpr Eigen::Index kBlock = 32;
+
+  void Check(int a, int b) const;
+  // solves the grounded Laplacian for every column of rhs given by node, in place
+  void Solve(Eigen::MatrixXd& rhs) const;
+
+  std::vector<int> row_;  // grounded Laplacian row of every node, -1 for grounded ones
+  std::vector<int> part_; // connected part of every node
+  std::vector<Edge> edges_;
+  Eigen::SimplicialLLT<Eigen::SparseMatrix<double>, Eigen::Lower, Eigen::AMDOrdering<int>> cholesky_;
+  Eigen::Index rows_ = 0;     // of the grounded Laplacian
+  Eigen::MatrixXd embedding_; // Z, column a is node a
+  size_t threads_;
+};
+
+inline EffectiveResistance::EffectiveResistance(const Circuit& circuit) :
+    row_(circuit.nodes_count(), -1), part_(circuit.nodes_count()), threads_(circuit.threads()) {
+  const int nodes = static_cast<int>(row_.size());
+  NodeSets parts(row_.size());
+  // parallel resistors sum into one edge
+  std::vector<Eigen::Triplet<double, int>> conductances;
+  for (auto& i : circuit.components()) {
+    if (i.type() != 'R' || i.p_index() == i.n_index())
+      continue;
+    if (!(i.value() > 0.0))
+      throw std::runtime_error("resistor " + std::string(i.name()) + " is not positive");
+    const int a = std::min(i.p_index(), i.n_index()), b = std::max(i.p_index(), i.n_index());
+    conductances.emplace_back(b, a, 1.0 / i.value());
+    parts.join(a, b);
+  }
+  Eigen::SparseMatrix<double> graph(nodes, nodes);
+  graph.setFromTriplets(conductances.begin(), conductances.end());
+  for (int j = 0; j < graph.outerSize(); j++) {
+    for (Eigen::SparseMatrix<double>::InnerIterator it(graph, j); it; ++it)
+      edges_.push_back({ j, static_cast<int>(it.row()), it.value() });
+  }
+
+  // the first node of each part is grounded, node 0 for ground's part
+  std::vector<char> grounded(row_.size(), 0);
+  int rows = 0;
+  for (int node = 0; node < nodes; node++) {
+    part_[node] = parts.find(node);
+    if (!grounded[part_[node]])
+      grounded[part_[node]] = 1;
+    else
+      row_[node] = rows++;
+  }
+  std::vector<Eigen::Triplet<double, int>> laplacian;
+  laplacian.reserve(3 * edges_.size());
+  for (auto& e : edges_) {
+    const int a = row_[e.a], b = row_[e.b];
+    if (a >= 0)
+      laplacian.emplace_back(a, a, e.conductance);
+    if (b >= 0)
+      laplacian.emplace_back(b, b, e.conductance);
+    // lower triangle only
+    if (a >= 0 && b >= 0)
+      laplacian.emplace_back(std::max(a, b), std::min(a, b), -e.conductance);
+  }
+  rows_ = rows;
+  if (rows == 0)
+    return;
+  Eigen::SparseMatrix<double> L(rows, rows);
+  L.setFromTriplets(laplacian.begin(), laplacian.end());
+  cholesky_.compute(L);
+  if (cholesky_.info() != Eigen::Success)
+    throw std::runtime_error("grounded Laplacian is not positive definite");
+}
+
+inline void EffectiveResistance::Check(int a, int b) const {
+  const int nodes = static_cast<int>(row_.size());
+  if (a < 0 || a >= nodes || b < 0 || b >= nodes)
+    throw std::runtime_error("node index out of range");
+}
+
+inline void EffectiveResistance::Solve(Eigen::MatrixXd& rhs) const {
+  if (rows_ == 0) {
+    rhs.setZero();
+    return;
+  }
+  Eigen::MatrixXd grounded(rows_, rhs.cols());
+  for (int node = 0; node < static_cast<int>(row_.size()); node++) {
+    if (row_[node] >= 0)
+      grounded.row(row_[node]) = rhs.row(node);
+  }
+  grounded = cholesky_.solve(grounded);
+  for (int node = 0; node < static_cast<int>(row_.size()); node++) {
+    if (row_[node] >= 0)
+      rhs.row(node) = grounded.row(row_[node]);
+    else
+      rhs.row(node).setZero();
+  }
+}
+
+inline double EffectiveResistance::Query(int a, int b) const {
+  return Query(std::vector<std::pair<int, int>>{ { a, b } }, 1).front();
+}
+
+inline std::vector<double> EffectiveResistance::Query(const std::vector<std::pair<int, int>>& pairs,
+                                                      size_t threads) const {
+  for (auto& pair : pairs)
+    Check(pair.first, pair.second);
+  std::vector<double> result(pairs.size());
+  const size_t blocks = (pairs.size() + kBlock - 1) / kBlock;
+  threads = std::min(threads ? threads : threads_, blocks);
+  std::atomic<size_t> next(0);
+  ParallelFor(threads, [&](size_t) {
+    Eigen::MatrixXd potentials(static_cast<Eigen::Index>(row_.size()), kBlock);
+    for (size_t block; (block = next++) < blocks;) {
+      const size_t first = block * kBlock, count = std::min<size_t>(kBlock, pairs.size() - first);
+      potentials.setZero();
+      for (size_t k = 0; k < count; k++) {
+        const Eigen::Index column = static_cast<Eigen::Index>(k);
+        potentials(pairs[first + k].first, column) += 1.0;
+        potentials(pairs[first + k].second, column) -= 1.0;
+      }
+      Solve(potentials);
+      for (size_t k = 0; k < count; k++) {
+        const auto& pair = pairs[first + k];
+        const Eigen::Index column = static_cast<Eigen::Index>(k);
+        result[first + k] = pair.first == pair.second ? 0.0
+                          : part_[pair.first] != part_[pair.second] ? std::numeric_limits<double>::infinity()
+                          : potentials(pair.first, column) - potentials(pair.second, column);
+      }
+    }
+  });
+  return result;
+}
+
+inline void EffectiveResistance::Project(size_t dimension, std::uint64_t seed, size_t threads) {
+  if (dimension == 0)
+    throw std::invalid_argument("projection dimension must be positive");
+  const Eigen::Index n = static_cast<Eigen::Index>(row_.size());
+  const Eigen::Index k = static_cast<Eigen::Index>(dimension);
+  // Z^T = L^+ B^T W^1/2 Q^T, one column per row of Q, built and solved kBlock at a time
+  Eigen::MatrixXd transposed(n, k);
+  const size_t blocks = (dimension + kBlock - 1) / kBlock;
+  threads = std::min(threads ? threads : threads_, blocks);
+  const double scale = 1.0 / std::sqrt(static_cast<double>(dimension));
+  std::atomic<size_t> next(0);
+  ParallelFor(threads, [&](size_t) {
+    Eigen::MatrixXd columns;
+    for (size_t block; (block = next++) < blocks;) {
+      const Eigen::Index first = static_cast<Eigen::Index>(block) * kBlock;
+      const Eigen::Index count = std::min(kBlock, k - first);
+      columns.setZero(n, count);
+      for (Eigen::Index c = 0; c < count; c++) {
+        // every row of Q has its own generator, so Z does not depend on the threads
+        std::mt19937_64 random(seed + static_cast<std::uint64_t>(first + c) * 0x9e3779b97f4a7c15ull);
+        for (auto& e : edges_) {
+          const double q = (random() & 1 ? scale : -scale) * std::sqrt(e.conductance);
+          columns(e.a, c) += q;
+          columns(e.b, c) -= q;
+        }
+      }
+      Solve(columns);
+      transposed.middleCols(first, count) = columns;
+    }
+  });
+  embedding_ = transposed.transpose();
+}
+
+inline double EffectiveResistance::Estimate(int a, int b) const {
+  Check(a, b);
+  if (embedding_.size() == 0)
+    throw std::logic_error("EffectiveResistance::Estimate before Project");
+  if (part_[a] != part_[b])
+    return std::numeric_limits<double>::infinity();
+  return (embedding_.col(a) - embedding_.col(b)).squaredNorm();
+}
+
+#endif // !EffectiveResistance_h
@@ -0,0 +1,482 @@
+// Netlist values: numbers with SPICE engineering suffixes and `.param`
+// expressions. Plain numbers go through std::from_chars and a suffix switch.
+// Expressions are compiled once to stack machine bytecode with every constant
+// subexpression folded, so a value that only uses numbers costs nothing after
+// parsing and one that uses parameters is a short loop over a few instructions.
+// Expression.h
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifndef Expression_h
+#define Expression_h
+
+// Multiplier of a SPICE scale suffix, case insensitive: f p n u m k meg g t mil.
+// Letters after the suffix are units and ignored ("10uF", "1kOhm"), so is a unit alone ("5V").
+// Returns 0 if text does not start with a letter.
+inline double SuffixScale(std::string_view text) {
+  if (text.empty() || !std::isalpha(static_cast<unsigned char>(text.front())))
+    return 0.0;
+  auto lower = [&](size_t i) {
+    return i < text.size() ? static_cast<char>(std::tolower(static_cast<unsigned char>(text[i]))) : '\0';
+  };
+  switch (lower(0)) {
+    case 'f': return 1e-15;
+    case 'p': return 1e-12;
+    case 'n': return 1e-9;
+    case 'u': return 1e-6;
+    case 'k': return 1e3;
+    case 'g': return 1e9;
+    case 't': return 1e12;
+    case 'm':
+      if (lower(1) == 'e' && lower(2) == 'g')
+        return 1e6;
+      if (lower(1) == 'i' && lower(2) == 'l')
+        return 25.4e-6;
+      return 1e-3;
+    default:
+      return 1.0;
+  }
+}
+
+// Parses a number with an optional suffix from the front of text, returns the
+// characters used or 0 if text does not start with a number
+inline size_t ParseNumberPrefix(std::string_view text, double& value) {
+  const char* first = text.data();
+  const char* last = first + text.size();
+  if (first != last && *first == '+')
+    first++;
+  auto result = std::from_chars(first, last, value);
+  if (result.ec != std::errc())
+    return 0;
+  const char* end = result.ptr;
+  if (end != last && std::isalpha(static_cast<unsigned char>(*end))) {
+    value *= SuffixScale(std::string_view(end, last - end));
+    while (end != last && std::isalpha(static_cast<unsigned char>(*end)))
+      end++;
+  }
+  return static_cast<size_t>(end - text.data());
+}
+
+// Whole text is one number, the plain case returns right after from_chars
+inline bool ParseNumber(std::string_view text, double& value) {
+  const char* first = text.data();
+  const char* last = first + text.size();
+  if (first != last && *first == '+')
+    first++;
+  auto result = std::from_chars(first, last, value);
+  if (result.ec != std::errc())
+    return false;
+  if (result.ptr == last)
+    return true;
+  return ParseNumberPrefix(text, value) == text.size();
+}
+
+// Compiled expression, evaluated against the parameter values it was compiled for
+class Expression {
+public:
+  enum class Op : unsigned char {
+    kConstant, kParameter, kNegate, kAdd, kSubtract, kMultiply, kDivide, kPower,
+    kSqrt, kExp, kLog, kLog10, kSin, kCos, kTan, kAbs, kMin, kMax
+  };
+  struct Instruction {
+    Op op;
+    int parameter; // kParameter
+    double value;  // kConstant
+  };
+
+  Expression() = default;
+  explicit Expression(double value) : code_{ { Op::kConstant, 0, value } }, depth_(1) {}
+
+  bool constant() const { return code_.size() == 1 && code_[0].op == Op::kConstant; }
+  double Evaluate(const double* parameters) const;
+  // parameter indices the value depends on, without duplicates
+  const std::vector<int>& dependencies() const { return dependencies_; }
+  const std::vector<Instruction>& code() const { return code_; }
+
+private:
+  friend class ExpressionCompiler;
+  static constexpr size_t kMaxDepth = 32;
+
+  std::vector<Instruction> code_;
+  std::vector<int> dependencies_;
+  size_t depth_ = 0;
+};
+
+// Named parameters from `.param` lines. Names are case insensitive. A parameter can
+// be used before its definition, Evaluate resolves them in dependency order.
+class ParameterTable {
+public:
+  // index of name, declared (undefined) if it was not seen before
+  int Declare(std::string_view name);
+  // -1 if name was never declared
+  int Find(std::string_view name) const;
+  void Define(int index, Expression expression, size_t line);
+
+  // Computes every value, throws std::runtime_error on undefined or circular parameters
+  void Evaluate();
+
+  size_t size() const { return names_.size(); }
+  const std::string& name(int index) const { return names_[index]; }
+  double value(int index) const { return values_[index]; }
+  const double* values() const { return values_.data(); }
+  const Expression& expression(int index) const { return expressions_[index]; }
+  // netlist line of the definition, 0 if undefined
+  size_t line(int index) const { return lines_[index]; }
+  // every parameter after the ones it depends on, set by Evaluate
+  const std::vector<int>& order() const { return order_; }
+
+private:
+  static std::string Lower(std::string_view name);
+
+  std::unordered_map<std::string, int> index_;
+  std::vector<std::string> names_;
+  std::vector<Expression> expressions_;
+  std::vector<size_t> lines_;
+  std::vector<double> values_;
+  std::vector<int> order_;
+};
+
+// Recursive descent over
+//   sum     := product (('+' | '-') product)*
+//   product := power (('*' | '/') power)*
+//   power   := unary (('^' | '**') power)?
+//   unary   := ('-' | '+') unary | primary
+//   primary := number | name | name '(' sum (',' sum)* ')' | '(' sum ')'
+// emitting postfix code. Every operator whose operands are constants is folded on emit.
+class ExpressionCompiler {
+public:
+  explicit ExpressionCompiler(ParameterTable& parameters) : parameters_(parameters) {}
+  // throws std::runtime_error with the reason on malformed text
+  Expression Compile(std::string_view text);
+
+private:
+  void Sum();
+  void Product();
+  void Power();
+  void Unary();
+  void Primary();
+  void SkipSpace() {
+    while (position_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[position_])))
+      position_++;
+  }
+  bool Accept(char c) {
+    SkipSpace();
+    if (position_ < text_.size() && text_[position_] == c) {
+      position_++;
+      return true;
+    }
+    return false;
+  }
+  [[noreturn]] void Error(const std::string& message) const {
+    throw std::runtime_error(message + " in expression \"" + std::string(text_) + '"');
+  }
+  void Emit(Expression::Op op, int arguments);
+
+  ParameterTable& parameters_;
+  std::string_view text_;
+  size_t position_ = 0;
+  Expression expression_;
+  size_t depth_ = 0;
+};
+
+inline double ApplyOp(Expression::Op op, const double* arguments) {
+  using Op = Expression::Op;
+  switch (op) {
+    case Op::kNegate: return -arguments[0];
+    case Op::kAdd: return arguments[0] + arguments[1];
+    case Op::kSubtract: return arguments[0] - arguments[1];
+    case Op::kMultiply: return arguments[0] * arguments[1];
+    case Op::kDivide: return arguments[0] / arguments[1];
+    case Op::kPower: return std::pow(arguments[0], arguments[1]);
+    case Op::kSqrt: return std::sqrt(arguments[0]);
+    case Op::kExp: return std::exp(arguments[0]);
+    case Op::kLog: return std::log(arguments[0]);
+    case Op::kLog10: return std::log10(arguments[0]);
+    case Op::kSin: return std::sin(arguments[0]);
+    case Op::kCos: return std::cos(arguments[0]);
+    case Op::kTan: return std::tan(arguments[0]);
+    case Op::kAbs: return std::abs(arguments[0]);
+    case Op::kMin: return std::min(arguments[0], arguments[1]);
+    case Op::kMax: return std::max(arguments[0], arguments[1]);
+    default: return 0.0;
+  }
+}
+
+inline int OpArity(Expression::Op op) {
+  using Op = Expression::Op;
+  switch (op) {
+    case Op::kConstant:
+    case Op::kParameter:
+      return 0;
+    case Op::kAdd:
+    case Op::kSubtract:
+    case Op::kMultiply:
+    case Op::kDivide:
+    case Op::kPower:
+    case Op::kMin:
+    case Op::kMax:
+      return 2;
+    default:
+      return 1;
+  }
+}
+
+inline double Expression::Evaluate(const double* parameters) const {
+  if (constant())
+    return code_[0].value;
+  std::array<double, kMaxDepth> stack;
+  size_t top = 0;
+  for (auto& i : code_) {
+    switch (i.op) {
+      case Op::kConstant:
+        stack[top++] = i.value;
+        break;
+      case Op::kParameter:
+        stack[top++] = parameters[i.parameter];
+        break;
+      default: {
+        int arity = OpArity(i.op);
+        top -= arity;
+        stack[top] = ApplyOp(i.op, &stack[top]);
+        top++;
+      }
+    }
+  }
+  return stack[0];
+}
+
+inline std::string ParameterTable::Lower(std::string_view name) {
+  std::string lower(name);
+  for (auto& c : lower)
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  return lower;
+}
+
+inline int ParameterTable::Declare(std::string_view name) {
+  auto inserted = index_.insert({ Lower(name), static_cast<int>(names_.size()) });
+  if (inserted.second) {
+    names_.emplace_back(name);
+    expressions_.emplace_back();
+    lines_.push_back(0);
+    values_.push_back(0.0);
+  }
+  return inserted.first->second;
+}
+
+inline int ParameterTable::Find(std::string_view name) const {
+  auto found = index_.find(Lower(name));
+  return found == index_.end() ? -1 : found->second;
+}
+
+inline void ParameterTable::Define(int index, Expression expression, size_t line) {
+  expressions_[index] = std::move(expression);
+  lines_[index] = line;
+}
+
+inline void ParameterTable::Evaluate() {
+  // depth first so every parameter is computed after the ones it uses
+  enum State : char { kNew, kActive, kDone };
+  std::vector<char> state(names_.size(), kNew);
+  std::vector<std::pair<int, size_t>> stack;
+  order_.clear();
+  for (int root = 0; root < static_cast<int>(names_.size()); root++) {
+    if (state[root] == kDone)
+      continue;
+    stack.push_back({ root, 0 });
+    state[root] = kActive;
+    while (!stack.empty()) {
+      int p = stack.back().first;
+      if (lines_[p] == 0)
+        throw std::runtime_error("undefined parameter \"" + names_[p] + '"');
+      auto& dependencies = expressions_[p].dependencies();
+      if (stack.back().second < dependencies.size()) {
+        int d = dependencies[stack.back().second++];
+        if (state[d] == kActive)
+          throw std::runtime_error("line " + std::to_string(lines_[p]) + ": parameter \"" +
+                                   names_[p] + "\" depends on itself through \"" + names_[d] + '"');
+        if (state[d] == kNew) {
+          state[d] = kActive;
+          stack.push_back({ d, 0 });
+        }
+        continue;
+      }
+      values_[p] = expressions_[p].Evaluate(values_.data());
+      order_.push_back(p);
+      state[p] = kDone;
+      stack.pop_back();
+    }
+  }
+}
+
+inline Expression ExpressionCompiler::Compile(std::string_view text) {
+  text_ = text;
+  position_ = 0;
+  expression_ = Expression();
+  depth_ = 0;
+  Sum();
+  SkipSpace();
+  if (position_ != text_.size())
+    Error("unexpected \"" + std::string(text_.substr(position_)) + '"');
+  return std::move(expression_);
+}
+
+inline void ExpressionCompiler::Emit(Expression::Op op, int arguments) {
+  using Op = Expression::Op;
+  auto& code = expression_.code_;
+  if (op == Op::kConstant || op == Op::kParameter) {
+    if (++depth_ > Expression::kMaxDepth)
+      Error("too deeply nested");
+    expression_.depth_ = std::max(expression_.depth_, depth_);
+    return;
+  }
+  depth_ -= arguments - 1;
+  // fold when every operand is a constant
+  bool folded = code.size() >= static_cast<size_t>(arguments);
+  for (int i = 1; i <= arguments && folded; i++)
+    folded = code[code.size() - i].op == Op::kConstant;
+  if (folded) {
+    double values[2];
+    for (int i = 0; i < arguments; i++)
+      values[i] = code[code.size() - arguments + i].value;
+    code.resize(code.size() - arguments);
+    code.push_back({ Op::kConstant, 0, ApplyOp(op, values) });
+  } else {
+    code.push_back({ op, 0, 0.0 });
+  }
+}
+
+inline void ExpressionCompiler::Sum() {
+  Product();
+  while (true) {
+    if (Accept('+')) {
+      Product();
+      Emit(Expression::Op::kAdd, 2);
+    } else if (Accept('-')) {
+      Product();
+      Emit(Expression::Op::kSubtract, 2);
+    } else {
+      return;
+    }
+  }
+}
+
+inline void ExpressionCompiler::Product() {
+  Power();
+  while (true) {
+    SkipSpace();
+    // '**' is power, handled one level down
+    if (position_ + 1 < text_.size() && text_[position_] == '*' && text_[position_ + 1] == '*')
+      return;
+    if (Accept('*')) {
+      Power();
+      Emit(Expression::Op::kMultiply, 2);
+    } else if (Accept('/')) {
+      Power();
+      Emit(Expression::Op::kDivide, 2);
+    } else {
+      return;
+    }
+  }
+}
+
+inline void ExpressionCompiler::Power() {
+  Unary();
+  SkipSpace();
+  bool power = Accept('^');
+  if (!power && position_ + 1 < text_.size() && text_[position_] == '*' && text_[position_ + 1] == '*') {
+    position_ += 2;
+    power = true;
+  }
+  if (power) {
+    Power(); // right associative
+    Emit(Expression::Op::kPower, 2);
+  }
+}
+
+inline void ExpressionCompiler::Unary() {
+  if (Accept('-')) {
+    Unary();
+    Emit(Expression::Op::kNegate, 1);
+  } else if (Accept('+')) {
+    Unary();
+  } else {
+    Primary();
+  }
+}
+
+inline void ExpressionCompiler::Primary() {
+  using Op = Expression::Op;
+  SkipSpace();
+  if (position_ == text_.size())
+    Error("missing operand");
+  if (Accept('(')) {
+    Sum();
+    if (!Accept(')'))
+      Error("missing ')'");
+    return;
+  }
+  char c = text_[position_];
+  if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+    double value = 0.0;
+    size_t used = ParseNumberPrefix(text_.substr(position_), value);
+    if (used == 0)
+      Error("bad number");
+    position_ += used;
+    expression_.code_.push_back({ Op::kConstant, 0, value });
+    Emit(Op::kConstant, 0);
+    return;
+  }
+  if (!std::isalpha(static_cast<unsigned char>(c)) && c != '_')
+    Error(std::string("unexpected '") + c + '\'');
+  size_t start = position_;
+  while (position_ < text_.size() &&
+         (std::isalnum(static_cast<unsigned char>(text_[position_])) || text_[position_] == '_'))
+    position_++;
+  std::string_view name = text_.substr(start, position_ - start);
+
+  if (Accept('(')) {
+    static const std::pair<const char*, Op> functions[] = {
+      { "sqrt", Op::kSqrt }, { "exp", Op::kExp }, { "log", Op::kLog }, { "ln", Op::kLog },
+      { "log10", Op::kLog10 }, { "sin", Op::kSin }, { "cos", Op::kCos }, { "tan", Op::kTan },
+      { "abs", Op::kAbs }, { "pow", Op::kPower }, { "min", Op::kMin }, { "max", Op::kMax } };
+    for (auto& function : functions) {
+      if (name.size() != std::strlen(function.first))
+        continue;
+      bool match = true;
+      for (size_t i = 0; i < name.size() && match; i++)
+        match = std::tolower(static_cast<unsigned char>(name[i])) == function.first[i];
+      if (!match)
+        continue;
+      int arity = OpArity(function.second);
+      for (int i = 0; i < arity; i++) {
+        if (i > 0 && !Accept(','))
+          Error("expected " + std::to_string(arity) + " arguments to " + std::string(name));
+        Sum();
+      }
+      if (!Accept(')'))
+        Error("missing ')' after arguments to " + std::string(name));
+      Emit(function.second, arity);
+      return;
+    }
+    Error("unknown function \"" + std::string(name) + '"');
+  }
+
+  int index = parameters_.Declare(name);
+  expression_.code_.push_back({ Op::kParameter, index, 0.0 });
+  auto& dependencies = expression_.dependencies_;
+  if (std::find(dependencies.begin(), dependencies.end(), index) == dependencies.end())
+    dependencies.push_back(index);
+  Emit(Op::kParameter, 0);
+}
+
+#endif // !Expression_h
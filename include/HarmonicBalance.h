@@ -0,0 +1,386 @@
+// Harmonic balance: the periodic steady state of a nonlinear circuit in the frequency domain.
+// Every unknown is a truncated Fourier series x(t) = Re sum_k X_k e^(jkwt), k = 0 ... K,
+// and the circuit equations are balanced harmonic by harmonic,
+//   (G + jkwC) X_k + I_k(X) = B_k,
+// where I_k are the harmonics of the diode currents. Those are evaluated where they are
+// simple, in the time domain: each diode voltage goes to N samples by an inverse real
+// FFT, the exponential is applied per sample, and a forward FFT takes the current back.
+// Newton solves J dX = -F with GMRES. A Jacobian product is the linear part plus the
+// same round trip with the sampled conductances g(t), so J is never formed. The
+// preconditioner is J with every g(t) replaced by its average: that decouples the
+// harmonics into K + 1 sparse complex systems G + g0 + jkwC, factorized in parallel.
+// Weak nonlinearities leave it close to J, and GMRES needs a few iterations per Newton step.
+// B_k comes from the circuit's source waveforms, sampled N times over one period and
+// taken to harmonics by the same FFT. A waveform that does not repeat with the
+// fundamental's period is seen as its first period repeated.
+// HarmonicBalance.h
+
+#include "Ac.h"
+#include "Circuit.h"
+#include "Diode.h"
+#include "Krylov.h"
+#include "Parallel.h"
+#include "Sources.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <eigen-3.4.0/unsupported/Eigen/FFT>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef HarmonicBalance_h
+#define HarmonicBalance_h
+
+struct HbOptions {
+  double tolerance = 1e-9; // on the Newton step, ||dX|| / max(||X||, 1), infinity norms
+  size_t max_newton = 50;
+  KrylovOptions krylov;
+  size_t threads = 0; // for the preconditioner blocks, 0 = one per core
+};
+
+class HarmonicBalance {
+public:
+  using Complex = std::complex<double>;
+  using ComplexLU = AcAnalysis::ComplexLU;
+
+  // circuit must be assembled, frequency of the fundamental in Hz, harmonics K
+  HarmonicBalance(const Circuit& circuit, double frequency, size_t harmonics);
+
+  double frequency() const { return frequency_; }
+  size_t harmonics() const { return harmonics_; }
+  // time samples per period, a power of two above 4 (K + 1) so products of two
+  // harmonics K do not alias onto the harmonics kept
+  size_t samples() const { return samples_; }
+
+  // phasor of the source vector at harmonic k, replacing the circuit's sources there
+  void set_source(size_t harmonic, const Eigen::VectorXcd& b);
+
+  // Throws std::runtime_error without convergence
+  const Eigen::MatrixXcd& Solve(const HbOptions& options = HbOptions());
+  // spectrum(row, k) is X_k of MNA row row, real for k = 0
+  const Eigen::MatrixXcd& spectrum() const { return X_; }
+  // samples() values of row over one period
+  Eigen::VectorXd Waveform(Eigen::Index row) const;
+
+  size_t newton_iterations() const { return newton_iterations_; }
+  // GMRES iterations over all Newton steps
+  size_t krylov_iterations() const { return krylov_iterations_; }
+  // ||F||, the largest current imbalance at any harmonic (A)
+  double residual() const { return residual_; }
+
+private:
+  // step halvings in the Newton line search before giving up
+  static constexpr int kMaxHalvings = 30;
+
+  // X as one real vector: X_0, then Re X_k and Im X_k for k = 1 ... K
+  Eigen::VectorXd Pack(const Eigen::MatrixXcd& X) const;
+  Eigen::MatrixXcd Unpack(const Eigen::VectorXd& packed) const;
+  // (G + jkwC) X_k for every k
+  Eigen::MatrixXcd Linear(const Eigen::MatrixXcd& X) const;
+  // harmonics of v(anode) - v(cathode)
+  Eigen::VectorXcd Branch(const Eigen::MatrixXcd& X, const Diode& diode) const;
+  void ToTime(const Eigen::VectorXcd& harmonics, double* samples) const;
+  // adds the harmonics of current samples flowing from anode to cathode to F
+  void AddCurrent(const double* samples, const Diode& diode, Eigen::MatrixXcd& F) const;
+  // F(X) = Linear(X) + I(X) - B, keeps g(t) at X for the Jacobian
+  Eigen::MatrixXcd Residual(const Eigen::MatrixXcd& X);
+  void Factor(size_t threads);
+  void Precondition(const Eigen::VectorXd& packed, Eigen::VectorXd& z, size_t threads) const;
+
+  AcAnalysis ac_;
+  double frequency_;
+  size_t harmonics_, samples_;
+  std::vector<Diode> diodes_;
+  Eigen::MatrixXcd B_, X_;
+  Eigen::MatrixXd conductance_; // conductance_(d, j): g of diode d at sample j
+  mutable Eigen::FFT<double> fft_;
+  mutable std::vector<double> time_;
+  mutable std::vector<Complex> bins_;
+  // preconditioner blocks on the union pattern of G, C and the diode stamps
+  Eigen::SparseMatrix<double> G_, C_, D_;
+  std::vector<std::unique_ptr<ComplexLU>> blocks_;
+  size_t newton_iterations_ = 0, krylov_iterations_ = 0;
+  double residual_ = 0.0;
+};
+
+inline HarmonicBalance::HarmonicBalance(const Circuit& circuit, double frequency, size_t harmonics) :
+    ac_(circuit), frequency_(frequency), harmonics_(harmonics), diodes_(CircuitDiodes(circuit)) {
+  if (!(frequency > 0.0))
+    throw std::invalid_argument("harmonic balance frequency must be positive");
+  if (!circuit.valid())
+    throw std::runtime_error("circuit topology is invalid");
+  samples_ = 8;
+  while (samples_ < 4 * (harmonics + 1))
+    samples_ *= 2;
+  fft_.SetFlag(Eigen::FFT<double>::HalfSpectrum);
+  time_.resize(samples_);
+  bins_.resize(samples_ / 2 + 1);
+
+  const Eigen::Index n = static_cast<Eigen::Index>(ac_.size());
+  B_ = Eigen::MatrixXcd::Zero(n, harmonics + 1);
+  B_.col(0) = circuit.b().cast<Complex>();
+  SourceTable sources(circuit);
+  if (!sources.empty()) {
+    // W(s, j): source s at sample j, each row to harmonics
+    const Eigen::Index m = static_cast<Eigen::Index>(sources.size());
+    Eigen::MatrixXd W(m, static_cast<Eigen::Index>(samples_));
+    Eigen::VectorXd values(m);
+    for (size_t j = 0; j < samples_; j++) {
+      sources.Values(static_cast<double>(j) / (frequency * static_cast<double>(samples_)), values.data());
+      W.col(static_cast<Eigen::Index>(j)) = values;
+    }
+    Eigen::MatrixXcd H(m, harmonics + 1);
+    std::vector<double> row(samples_);
+    const double scale = 1.0 / static_cast<double>(samples_);
+    for (Eigen::Index s = 0; s < m; s++) {
+      for (size_t j = 0; j < samples_; j++)
+        row[j] = W(s, static_cast<Eigen::Index>(j));
+      fft_.fwd(bins_.data(), row.data(), static_cast<Eigen::Index>(samples_));
+      for (Eigen::Index k = 0; k <= static_cast<Eigen::Index>(harmonics); k++)
+        H(s, k) = (k == 0 ? scale : 2.0 * scale) * bins_[k];
+    }
+    B_.col(0) = sources.constant().cast<Complex>();
+    B_ += sources.incidence().cast<Complex>() * H;
+  }
+  X_ = Eigen::MatrixXcd::Zero(n, harmonics + 1);
+
+  // unit diode stamps give the union pattern, the sums keep their explicit zeros
+  std::vector<Eigen::Triplet<double>> triplets;
+  for (auto& d : diodes_) {
+    for (int r : { d.p_row, d.n_row }) {
+      for (int c : { d.p_row, d.n_row }) {
+        if (r >= 0 && c >= 0)
+          triplets.emplace_back(r, c, 1.0);
+      }
+    }
+  }
+  Eigen::SparseMatrix<double> stamps(n, n);
+  stamps.setFromTriplets(triplets.begin(), triplets.end());
+  G_ = ac_.G() + 0.0 * stamps;
+  C_ = ac_.C() + 0.0 * stamps;
+  D_ = 0.0 * G_ + stamps;
+  for (auto* matrix : { &G_, &C_, &D_ })
+    matrix->makeCompressed();
+  if (G_.nonZeros() != C_.nonZeros() || G_.nonZeros() != D_.nonZeros())
+    throw std::logic_error("HarmonicBalance: block patterns differ");
+}
+
+inline void HarmonicBalance::set_source(size_t harmonic, const Eigen::VectorXcd& b) {
+  if (harmonic > harmonics_ || b.size() != B_.rows())
+    throw std::out_of_range("harmonic balance source " + std::to_string(harmonic));
+  B_.col(static_cast<Eigen::Index>(harmonic)) = b;
+}
+
+inline Eigen::VectorXd HarmonicBalance::Pack(const Eigen::MatrixXcd& X) const {
+  const Eigen::Index n = X.rows();
+  Eigen::VectorXd packed(n * (2 * static_cast<Eigen::Index>(harmonics_) + 1));
+  packed.head(n) = X.col(0).real();
+  for (Eigen::Index k = 1; k <= static_cast<Eigen::Index>(harmonics_); k++) {
+    packed.segment(n * (2 * k - 1), n) = X.col(k).real();
+    packed.segment(n * 2 * k, n) = X.col(k).imag();
+  }
+  return packed;
+}
+
+inline Eigen::MatrixXcd HarmonicBalance::Unpack(const Eigen::VectorXd& packed) const {
+  const Eigen::Index n = B_.rows();
+  Eigen::MatrixXcd X(n, harmonics_ + 1);
+  X.col(0) = packed.head(n).cast<Complex>();
+  for (Eigen::Index k = 1; k <= static_cast<Eigen::Index>(harmonics_); k++) {
+    X.col(k).real() = packed.segment(n * (2 * k - 1), n);
+    X.col(k).imag() = packed.segment(n * 2 * k, n);
+  }
+  return X;
+}
+
+inline Eigen::MatrixXcd HarmonicBalance::Linear(const Eigen::MatrixXcd& X) const {
+  // every harmonic in one sparse times dense product per part
+  const Eigen::MatrixXd real = X.real(), imag = X.imag();
+  const Eigen::MatrixXd g_real = ac_.G() * real, g_imag = ac_.G() * imag;
+  const Eigen::MatrixXd c_real = ac_.C() * real, c_imag = ac_.C() * imag;
+  Eigen::MatrixXcd Y(X.rows(), X.cols());
+  for (Eigen::Index k = 0; k < X.cols(); k++) {
+    const double w = 2.0 * EIGEN_PI * frequency_ * static_cast<double>(k);
+    Y.col(k).real() = g_real.col(k) - w * c_imag.col(k);
+    Y.col(k).imag() = g_imag.col(k) + w * c_real.col(k);
+  }
+  return Y;
+}
+
+inline Eigen::VectorXcd HarmonicBalance::Branch(const Eigen::MatrixXcd& X, const Diode& diode) const {
+  Eigen::VectorXcd v = Eigen::VectorXcd::Zero(X.cols());
+  if (diode.p_row >= 0)
+    v += X.row(diode.p_row).transpose();
+  if (diode.n_row >= 0)
+    v -= X.row(diode.n_row).transpose();
+  return v;
+}
+
+inline void HarmonicBalance::ToTime(const Eigen::VectorXcd& harmonics, double* samples) const {
+  // the real inverse FFT scales by 1 / N and adds each bin's conjugate
+  const double n = static_cast<double>(samples_);
+  std::fill(bins_.begin(), bins_.end(), Complex(0.0));
+  bins_[0] = n * harmonics(0).real();
+  for (Eigen::Index k = 1; k < harmonics.size(); k++)
+    bins_[k] = 0.5 * n * harmonics(k);
+  fft_.inv(samples, bins_.data(), static_cast<Eigen::Index>(samples_));
+}
+
+inline void HarmonicBalance::AddCurrent(const double* samples, const Diode& diode, Eigen::MatrixXcd& F) const {
+  fft_.fwd(bins_.data(), samples, static_cast<Eigen::Index>(samples_));
+  const double n = static_cast<double>(samples_);
+  for (Eigen::Index k = 0; k < F.cols(); k++) {
+    Complex current = (k == 0 ? 1.0 : 2.0) / n * bins_[k];
+    if (diode.p_row >= 0)
+      F(diode.p_row, k) += current;
+    if (diode.n_row >= 0)
+      F(diode.n_row, k) -= current;
+  }
+}
+
+inline Eigen::MatrixXcd HarmonicBalance::Residual(const Eigen::MatrixXcd& X) {
+  Eigen::MatrixXcd F = Linear(X) - B_;
+  F.col(0).imag().setZero();
+  conductance_.resize(diodes_.size(), samples_);
+  for (size_t d = 0; d < diodes_.size(); d++) {
+    ToTime(Branch(X, diodes_[d]), time_.data());
+    for (size_t j = 0; j < samples_; j++)
+      diodes_[d].Evaluate(time_[j], time_[j], conductance_(d, j));
+    AddCurrent(time_.data(), diodes_[d], F);
+  }
+  return F;
+}
+
+inline void HarmonicBalance::Factor(size_t threads) {
+  // average conductance of every diode on the shared pattern
+  std::vector<Eigen::Triplet<double>> triplets;
+  for (size_t d = 0; d < diodes_.size(); d++) {
+    const double g = conductance_.row(d).mean();
+    const int p = diodes_[d].p_row, m = diodes_[d].n_row;
+    if (p >= 0)
+      triplets.emplace_back(p, p, g);
+    if (m >= 0)
+      triplets.emplace_back(m, m, g);
+    if (p >= 0 && m >= 0) {
+      triplets.emplace_back(p, m, -g);
+      triplets.emplace_back(m, p, -g);
+    }
+  }
+  Eigen::SparseMatrix<double> average(G_.rows(), G_.cols());
+  average.setFromTriplets(triplets.begin(), triplets.end());
+  D_ = 0.0 * G_ + average;
+  D_.makeCompressed();
+
+  const size_t count = harmonics_ + 1;
+  if (blocks_.empty()) {
+    for (size_t k = 0; k < count; k++)
+      blocks_.push_back(std::make_unique<ComplexLU>());
+  }
+  // a singular block or a failed allocation in any thread comes out of ParallelFor
+  ParallelFor(threads, [&](size_t t) {
+    auto range = ChunkRange(count, threads, t);
+    AcAnalysis::ComplexMatrix Y = G_.cast<Complex>();
+    for (size_t k = range.first; k < range.second; k++) {
+      const double w = 2.0 * EIGEN_PI * frequency_ * static_cast<double>(k);
+      const double* g = G_.valuePtr();
+      const double* c = C_.valuePtr();
+      const double* a = D_.valuePtr();
+      Complex* y = Y.valuePtr();
+      for (Eigen::Index i = 0; i < G_.nonZeros(); i++)
+        y[i] = Complex(g[i] + a[i], w * c[i]);
+      if (!newton_iterations_)
+        blocks_[k]->analyzePattern(Y);
+      blocks_[k]->factorize(Y);
+      if (blocks_[k]->info() != Eigen::Success)
+        throw std::runtime_error("harmonic balance: block " + std::to_string(k) + " is singular");
+    }
+  });
+}
+
+inline void HarmonicBalance::Precondition(const Eigen::VectorXd& packed, Eigen::VectorXd& z,
+                                          size_t threads) const {
+  Eigen::MatrixXcd R = Unpack(packed);
+  const size_t count = harmonics_ + 1;
+  ParallelFor(threads, [&](size_t t) {
+    auto range = ChunkRange(count, threads, t);
+    for (size_t k = range.first; k < range.second; k++) {
+      const Eigen::Index column = static_cast<Eigen::Index>(k);
+      R.col(column) = blocks_[k]->solve(R.col(column));
+    }
+  });
+  z = Pack(R);
+}
+
+inline const Eigen::MatrixXcd& HarmonicBalance::Solve(const HbOptions& options) {
+  const Eigen::Index n = B_.rows();
+  // below a few thousand unknowns per block the spawn costs more than it saves
+  size_t threads = options.threads ? options.threads : DefaultThreads();
+  threads = std::max<size_t>(1, std::min<size_t>(threads, harmonics_ + 1));
+  if (n < 2000)
+    threads = 1;
+
+  newton_iterations_ = krylov_iterations_ = 0;
+  X_.setZero();
+  Eigen::MatrixXcd F = Residual(X_);
+  double norm = Pack(F).norm();
+  auto jacobian = [&](const Eigen::VectorXd& v, Eigen::VectorXd& w) {
+    Eigen::MatrixXcd V = Unpack(v);
+    Eigen::MatrixXcd W = Linear(V);
+    W.col(0).imag().setZero();
+    for (size_t d = 0; d < diodes_.size(); d++) {
+      ToTime(Branch(V, diodes_[d]), time_.data());
+      for (size_t j = 0; j < samples_; j++)
+        time_[j] *= conductance_(d, j);
+      AddCurrent(time_.data(), diodes_[d], W);
+    }
+    w = Pack(W);
+  };
+  auto precondition = [&](const Eigen::VectorXd& v, Eigen::VectorXd& z) { Precondition(v, z, threads); };
+
+  for (;;) {
+    residual_ = Pack(F).lpNorm<Eigen::Infinity>();
+    if (newton_iterations_ == options.max_newton) {
+      throw std::runtime_error("harmonic balance did not converge, residual " +
+                               std::to_string(residual_) + " A");
+    }
+    Factor(threads);
+    Eigen::VectorXd step = Eigen::VectorXd::Zero(Pack(F).size());
+    KrylovResult krylov = Gmres(jacobian, precondition, -Pack(F), step, options.krylov);
+    krylov_iterations_ += krylov.iterations;
+    newton_iterations_++;
+
+    Eigen::MatrixXcd dX = Unpack(step), next;
+    if (step.lpNorm<Eigen::Infinity>() <= options.tolerance * std::max(Pack(X_).lpNorm<Eigen::Infinity>(), 1.0)) {
+      X_ += dX;
+      residual_ = Pack(Residual(X_)).lpNorm<Eigen::Infinity>();
+      return X_;
+    }
+    // halve the step until the residual falls, the exponential overshoots easily
+    double scale = 1.0, next_norm = 0.0;
+    bool descent = false;
+    for (int halving = 0; halving < kMaxHalvings && !descent; halving++, scale *= 0.5) {
+      next = X_ + scale * dX;
+      F = Residual(next);
+      next_norm = Pack(F).norm();
+      descent = next_norm < norm || !(next_norm > 0.0);
+    }
+    if (!descent) {
+      throw std::runtime_error("harmonic balance did not converge, no step along the Newton direction lowers "
+                               "the residual " + std::to_string(residual_) + " A");
+    }
+    X_ = next;
+    norm = next_norm;
+  }
+}
+
+inline Eigen::VectorXd HarmonicBalance::Waveform(Eigen::Index row) const {
+  Eigen::VectorXd samples(samples_);
+  ToTime(X_.row(row).transpose(), samples.data());
+  return samples;
+}
+
+#endif // !HarmonicBalance_h
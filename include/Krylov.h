@@ -0,0 +1,122 @@
+// Matrix-free Krylov solvers.
+// Gmres needs only the product of the operator with a vector, so it solves systems
+// whose matrix is never formed, such as the shooting Jacobian of Pss.h where one
+// product is one period of integration. Restarted GMRES(m) with modified
+// Gram-Schmidt and Givens rotations, the residual norm is known at every iteration
+// without forming x. A preconditioner can be supplied.
+// Krylov.h
+
+#include <eigen-3.4.0/Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <utility>
+
+#ifndef Krylov_h
+#define Krylov_h
+
+struct KrylovOptions {
+  double tolerance = 1e-10; // on ||b - A x|| / ||b||
+  size_t restart = 30;      // Krylov dimension before a restart
+  size_t max_iterations = 300;
+};
+
+struct KrylovResult {
+  size_t iterations = 0; // Krylov vectors built
+  size_t products = 0;   // operator products, iterations plus residuals at the start and restarts
+  double residual = 0.0; // ||b - A x|| / ||b|| as estimated by the rotations
+  bool converged = false;
+};
+
+// Solves A x = b with apply(v, w) computing w = A v and precondition(v, z) computing
+// z = M^-1 v for some M close to A. Right preconditioning: GMRES runs on A M^-1, so the
+// residual it minimizes is the true one. x holds the initial guess.
+template <class Apply, class Precondition>
+KrylovResult Gmres(Apply&& apply, Precondition&& precondition, const Eigen::VectorXd& b,
+                   Eigen::VectorXd& x, const KrylovOptions& options = KrylovOptions()) {
+  KrylovResult result;
+  const Eigen::Index n = b.size();
+  const double b_norm = b.norm();
+  if (x.size() != n)
+    x = Eigen::VectorXd::Zero(n);
+  if (b_norm == 0.0) {
+    x.setZero();
+    result.converged = true;
+    return result;
+  }
+  const Eigen::Index m = static_cast<Eigen::Index>(std::max<size_t>(1, std::min<size_t>(options.restart, n)));
+  Eigen::MatrixXd V(n, m + 1);
+  Eigen::MatrixXd H = Eigen::MatrixXd::Zero(m + 1, m);
+  Eigen::VectorXd cs(m), sn(m), g(m + 1), w(n), z(n);
+
+  // a zero guess needs no product
+  Eigen::VectorXd r = b;
+  if (!x.isZero(0.0)) {
+    apply(x, w);
+    result.products++;
+    r -= w;
+  }
+  result.residual = r.norm() / b_norm;
+  while (result.residual > options.tolerance && result.iterations < options.max_iterations) {
+    double beta = r.norm();
+    V.col(0) = r / beta;
+    g.setZero();
+    g(0) = beta;
+    H.setZero();
+    Eigen::Index k = 0;
+    while (k < m && result.iterations < options.max_iterations) {
+      precondition(V.col(k), z);
+      apply(z, w);
+      result.iterations++;
+      result.products++;
+      for (Eigen::Index i = 0; i <= k; i++) {
+        H(i, k) = V.col(i).dot(w);
+        w -= H(i, k) * V.col(i);
+      }
+      H(k + 1, k) = w.norm();
+      // previous rotations, then the one zeroing H(k + 1, k)
+      for (Eigen::Index i = 0; i < k; i++) {
+        double t = cs(i) * H(i, k) + sn(i) * H(i + 1, k);
+        H(i + 1, k) = -sn(i) * H(i, k) + cs(i) * H(i + 1, k);
+        H(i, k) = t;
+      }
+      double d = std::hypot(H(k, k), H(k + 1, k));
+      bool breakdown = !(H(k + 1, k) > 1e-14 * d);
+      if (!breakdown)
+        V.col(k + 1) = w / H(k + 1, k);
+      cs(k) = d > 0.0 ? H(k, k) / d : 1.0;
+      sn(k) = d > 0.0 ? H(k + 1, k) / d : 0.0;
+      H(k, k) = d;
+      H(k + 1, k) = 0.0;
+      g(k + 1) = -sn(k) * g(k);
+      g(k) = cs(k) * g(k);
+      k++;
+      result.residual = std::abs(g(k)) / b_norm;
+      if (result.residual <= options.tolerance || breakdown)
+        break;
+    }
+    // x += M^-1 V y with H y = g on the leading k x k triangle
+    Eigen::VectorXd y = H.topLeftCorner(k, k).triangularView<Eigen::Upper>().solve(g.head(k));
+    precondition(V.leftCols(k) * y, z);
+    x += z;
+    if (result.residual <= options.tolerance || result.iterations >= options.max_iterations)
+      break;
+    // restart from the true residual
+    apply(x, w);
+    result.products++;
+    r = b - w;
+    result.residual = r.norm() / b_norm;
+  }
+  result.converged = result.residual <= options.tolerance;
+  return result;
+}
+
+// Unpreconditioned
+template <class Apply>
+KrylovResult Gmres(Apply&& apply, const Eigen::VectorXd& b, Eigen::VectorXd& x,
+                   const KrylovOptions& options = KrylovOptions()) {
+  auto identity = [](const Eigen::VectorXd& v, Eigen::VectorXd& z) { z = v; };
+  return Gmres(std::forward<Apply>(apply), identity, b, x, options);
+}
+
+#endif // !Krylov_h
@@ -0,0 +1,190 @@
+// Natural frequencies and stability of the linear circuit.
+// With its sources zeroed the circuit evolves as sums of e^(st) over the finite
+// roots s of det(G + sC) = 0, the generalized eigenvalues of (G, C) from AcAnalysis.
+// Small systems get every mode from a dense QZ. Large ones get the few modes nearest
+// a shift sigma from shift-invert Arnoldi: the largest eigenvalues mu of
+// (G + sigma C)^-1 C are the modes s = sigma - 1 / mu, so sigma = 0 finds the slowest
+// modes, the ones that set how long a transient must run.
+// Modes.h
+
+#include "Ac.h"
+#include "Circuit.h"
+#include "Solver.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Eigenvalues>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <vector>
+
+#ifndef Modes_h
+#define Modes_h
+
+struct Mode {
+  std::complex<double> s; // rad/s
+
+  // 1 / decay rate in seconds, infinite for an undamped mode
+  double time_constant() const {
+    return s.real() < 0.0 ? -1.0 / s.real() : std::numeric_limits<double>::infinity();
+  }
+  // oscillation frequency in Hz, 0 for a real mode
+  double frequency() const { return std::abs(s.imag()) / (2.0 * EIGEN_PI); }
+  // damping ratio, 1 for a real decaying mode
+  double damping() const { return std::abs(s) > 0.0 ? -s.real() / std::abs(s) : 1.0; }
+  // grows with time, beyond rounding
+  bool unstable() const { return s.real() > 1e-9 * std::abs(s); }
+};
+
+// Transient settings the modes call for
+struct TimestepSuggestion {
+  double step; // resolves the fastest mode found, 1/10 of its time constant or 1/20 of its period
+  double stop; // five of the longest time constant or period over all modes
+};
+
+class ModeAnalysis {
+public:
+  static constexpr size_t kDenseMax = 500;
+
+  // circuit must be assembled, systems up to dense_max rows use the dense solver
+  explicit ModeAnalysis(const Circuit& circuit, size_t dense_max = kDenseMax) :
+      circuit_(circuit), ac_(circuit), dense_max_(dense_max) {}
+
+  // Every finite mode of a small system, otherwise the count modes nearest shift
+  // (rad/s, real). Sorted by |s|, which is not settling order: a lightly damped
+  // fast mode has a large |s| and a long time constant.
+  const std::vector<Mode>& Compute(size_t count = 6, double shift = 0.0);
+  const std::vector<Mode>& modes() const { return modes_; }
+  // Arnoldi restarts of the last sparse Compute, 0 for dense
+  size_t restarts() const { return restarts_; }
+
+  bool stable() const;
+  // only meaningful when modes() is not empty
+  TimestepSuggestion Suggest() const;
+
+private:
+  void Dense();
+  void ShiftInvert(size_t count, double shift);
+
+  const Circuit& circuit_;
+  AcAnalysis ac_;
+  size_t dense_max_;
+  std::vector<Mode> modes_;
+  size_t restarts_ = 0;
+};
+
+inline const std::vector<Mode>& ModeAnalysis::Compute(size_t count, double shift) {
+  modes_.clear();
+  restarts_ = 0;
+  if (ac_.size() <= dense_max_)
+    Dense();
+  else
+    ShiftInvert(count, shift);
+  std::sort(modes_.begin(), modes_.end(),
+            [](const Mode& a, const Mode& b) { return std::abs(a.s) < std::abs(b.s); });
+  return modes_;
+}
+
+inline void ModeAnalysis::Dense() {
+  Eigen::VectorXcd poles = FinitePoles(Eigen::MatrixXd(ac_.G()), Eigen::MatrixXd(ac_.C()));
+  for (Eigen::Index i = 0; i < poles.size(); i++)
+    modes_.push_back({ poles(i) });
+}
+
+// Arnoldi with explicit restarts from the wanted Ritz vectors
+inline void ModeAnalysis::ShiftInvert(size_t count, double shift) {
+  const Eigen::Index n = static_cast<Eigen::Index>(ac_.size());
+  const Eigen::Index wanted = static_cast<Eigen::Index>(std::min<size_t>(count, n));
+  const Eigen::Index m = std::min<Eigen::Index>(n, std::max<Eigen::Index>(2 * wanted + 10, 30));
+  const size_t max_restarts = 50;
+  const double tolerance = 1e-10;
+
+  Eigen::SparseMatrix<double> K = ac_.G() + shift * ac_.C();
+  LinearSolver solver(circuit_.solver());
+  solver.Factorize(K);
+
+  // deterministic start, spread over every row
+  Eigen::VectorXd start(n);
+  for (Eigen::Index i = 0; i < n; i++)
+    start(i) = 1.0 + 0.5 * std::sin(static_cast<double>(i) * 1.618);
+
+  Eigen::MatrixXd V(n, m + 1);
+  Eigen::MatrixXd H(m + 1, m);
+  for (restarts_ = 0; restarts_ <= max_restarts; restarts_++) {
+    V.col(0) = start.normalized();
+    H.setZero();
+    Eigen::Index steps = m;
+    for (Eigen::Index j = 0; j < m; j++) {
+      Eigen::VectorXd w = solver.Solve(ac_.C() * V.col(j));
+      // classical Gram-Schmidt twice
+      for (int pass = 0; pass < 2; pass++) {
+        Eigen::VectorXd h = V.leftCols(j + 1).transpose() * w;
+        w -= V.leftCols(j + 1) * h;
+        H.col(j).head(j + 1) += h;
+      }
+      H(j + 1, j) = w.norm();
+      if (!(H(j + 1, j) > 1e-14 * H.col(j).head(j + 1).norm())) {
+        // invariant subspace, its Ritz values are exact
+        steps = j + 1;
+        H(j + 1, j) = 0.0;
+        break;
+      }
+      V.col(j + 1) = w / H(j + 1, j);
+    }
+
+    Eigen::EigenSolver<Eigen::MatrixXd> ritz(H.topLeftCorner(steps, steps));
+    std::vector<Eigen::Index> order(steps);
+    for (Eigen::Index i = 0; i < steps; i++)
+      order[i] = i;
+    std::sort(order.begin(), order.end(), [&](Eigen::Index a, Eigen::Index b) {
+      return std::abs(ritz.eigenvalues()(a)) > std::abs(ritz.eigenvalues()(b));
+    });
+
+    // mu = 0 belongs to states without capacitance, s is infinite there
+    const double largest = std::abs(ritz.eigenvalues()(order[0]));
+    Eigen::Index found = 0;
+    bool converged = true;
+    Eigen::VectorXd next = Eigen::VectorXd::Zero(n);
+    for (Eigen::Index i = 0; i < steps && found < wanted; i++) {
+      std::complex<double> mu = ritz.eigenvalues()(order[i]);
+      if (!(std::abs(mu) > 1e-12 * largest))
+        break;
+      Eigen::VectorXcd y = ritz.eigenvectors().col(order[i]);
+      double residual = std::abs(H(steps, steps - 1) * y(steps - 1)) / y.norm();
+      if (!(residual <= tolerance * std::abs(mu)))
+        converged = false;
+      Eigen::VectorXcd x = V.leftCols(steps) * y;
+      next += x.real() + x.imag();
+      found++;
+    }
+    if (converged || restarts_ == max_restarts) {
+      modes_.clear();
+      for (Eigen::Index i = 0; i < found; i++)
+        modes_.push_back({ shift - 1.0 / ritz.eigenvalues()(order[i]) });
+      return;
+    }
+    start = next;
+  }
+}
+
+inline bool ModeAnalysis::stable() const {
+  return std::none_of(modes_.begin(), modes_.end(), [](const Mode& i) { return i.unstable(); });
+}
+
+inline TimestepSuggestion ModeAnalysis::Suggest() const {
+  TimestepSuggestion suggestion{ std::numeric_limits<double>::infinity(), 0.0 };
+  for (auto& i : modes_) {
+    double period = i.frequency() > 0.0 ? 1.0 / i.frequency() : std::numeric_limits<double>::infinity();
+    suggestion.step = std::min({ suggestion.step, i.time_constant() / 10.0, period / 20.0 });
+  }
+  // the longest time constant or period of any mode, whatever its |s|
+  for (auto& i : modes_) {
+    double period = i.frequency() > 0.0 ? 1.0 / i.frequency() : 0.0;
+    double settle = std::isfinite(i.time_constant()) ? i.time_constant() : 0.0;
+    suggestion.stop = std::max(suggestion.stop, 5.0 * std::max(settle, period));
+  }
+  return suggestion;
+}
+
+#endif // !Modes_h
@@ -0,0 +1,499 @@
+// Supernodal multifrontal sparse LU for structurally symmetric MNA matrices.
+// Columns with identical structure are grouped into supernodes whose frontal
+// matrices are dense, so the elimination is done by Eigen's blocked dense
+// LU, triangular solves and GEMM instead of column-at-a-time sparse updates.
+//
+// Pivoting is restricted to each supernode's fully summed block. Branch rows
+// of V and L sources have a zero diagonal, so analyzePattern matches each
+// one to a distinct non-ground node it touches and keeps the pair adjacent in
+// one supernode, where the 2x2 block [g 1; 1 0] is always pivotable.
+// factorize reports NumericalIssue when a pivot is unacceptably small so the
+// caller can fall back to SparseLU. The fronts are stored in Scalar, float
+// halves their memory traffic for mixed precision solves.
+// Multifrontal.h
+
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/OrderingMethods>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifndef Multifrontal_h
+#define Multifrontal_h
+
+template <class Scalar>
+class BasicMultifrontalLU {
+public:
+  using Matrix = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>;
+
+  // pivots smaller than threshold * (largest entry of their front column) fail the factorization
+  explicit BasicMultifrontalLU(double pivot_threshold = 1e-6) : pivot_threshold_(pivot_threshold) {}
+
+  void analyzePattern(const Eigen::SparseMatrix<double>& A);
+  void factorize(const Eigen::SparseMatrix<double>& A);
+  void compute(const Eigen::SparseMatrix<double>& A) {
+    analyzePattern(A);
+    if (info_ == Eigen::Success)
+      factorize(A);
+  }
+
+  Eigen::ComputationInfo info() const { return info_; }
+  const std::string& lastErrorMessage() const { return error_; }
+  // multiple right hand sides are solved together, one column per rhs
+  Eigen::MatrixXd solve(const Eigen::MatrixXd& b) const;
+  Eigen::MatrixXd solveTransposed(const Eigen::MatrixXd& b) const;
+
+  size_t supernode_count() const { return supernodes_.size(); }
+  // stored entries of L and U including the dense padding of each supernode
+  size_t nnz() const { return factor_nnz_; }
+  // largest frontal matrix dimension
+  size_t max_front() const { return max_front_; }
+
+private:
+  struct Supernode {
+    int first, last;                 // pivot columns [first, last) in elimination order
+    std::vector<int> rows;           // non pivot rows of the front, ascending
+    std::vector<int> children;
+    std::vector<int> relative;       // where rows land in the parent front
+    size_t assembly_begin, assembly_end;
+    Matrix lu11, l21, u12;           // P * F11 = L11 U11, L21, U12
+    Eigen::VectorXi perm;            // row permutation inside the pivot block
+  };
+  struct Assembly {
+    int value;                       // index into A's value array
+    int row, col;                    // position in the front
+  };
+
+  void Fail(const std::string& message) {
+    info_ = Eigen::NumericalIssue;
+    error_ = message;
+  }
+
+  double pivot_threshold_;
+  Eigen::ComputationInfo info_ = Eigen::InvalidInput;
+  std::string error_;
+  int n_ = 0;
+  Eigen::VectorXi order_;            // order_[k] = original index eliminated k-th
+  std::vector<Supernode> supernodes_;
+  std::vector<Assembly> assembly_;
+  size_t factor_nnz_ = 0, max_front_ = 0;
+};
+
+template <class Scalar>
+void BasicMultifrontalLU<Scalar>::analyzePattern(const Eigen::SparseMatrix<double>& A) {
+  info_ = Eigen::Success;
+  error_.clear();
+  supernodes_.clear();
+  assembly_.clear();
+  n_ = static_cast<int>(A.rows());
+  const int n = n_;
+
+  // symmetric pattern of A + A^T without values
+  std::vector<std::vector<int>> adjacency(n);
+  std::vector<char> zero_diagonal(n, 1);
+  for (int c = 0; c < n; c++) {
+    for (Eigen::SparseMatrix<double>::InnerIterator it(A, c); it; ++it) {
+      int r = static_cast<int>(it.row());
+      if (r == c) {
+        if (it.value() != 0.0)
+          zero_diagonal[c] = 0;
+      } else {
+        adjacency[c].push_back(r);
+        adjacency[r].push_back(c);
+      }
+    }
+  }
+  for (auto& i : adjacency) {
+    std::sort(i.begin(), i.end());
+    i.erase(std::unique(i.begin(), i.end()), i.end());
+  }
+
+  // match every zero diagonal column to a distinct neighbour with a nonzero
+  // diagonal (augmenting paths, the V/L branches form a forest so this succeeds)
+  std::vector<int> partner(n, -1);
+  std::vector<int> visited(n, -1);
+  for (int j = 0; j < n; j++) {
+    if (!zero_diagonal[j])
+      continue;
+    std::vector<std::pair<int, size_t>> stack{ { j, 0 } };
+    std::vector<int> path;
+    bool found = false;
+    while (!stack.empty() && !found) {
+      auto& top = stack.back();
+      int z = top.first;
+      if (top.second >= adjacency[z].size()) {
+        stack.pop_back();
+        if (!path.empty())
+          path.pop_back();
+        continue;
+      }
+      int v = adjacency[z][top.second++];
+      if (zero_diagonal[v] || visited[v] == j)
+        continue;
+      visited[v] = j;
+      if (partner[v] < 0) {
+        path.push_back(v);
+        found = true;
+      } else {
+        path.push_back(v);
+        stack.push_back({ partner[v], 0 });
+      }
+    }
+    if (!found)
+      continue; // left to pivoting, factorize reports it if that fails
+    // flip the path: stack holds the zero diagonal columns, path their new partners
+    for (size_t k = 0; k < path.size(); k++) {
+      int z = stack[k].first;
+      partner[path[k]] = z;
+      partner[z] = path[k];
+    }
+  }
+
+  // order the quotient graph where each matched pair is one vertex
+  std::vector<int> group(n, -1);
+  int groups = 0;
+  for (int i = 0; i < n; i++) {
+    if (group[i] >= 0)
+      continue;
+    group[i] = groups;
+    if (partner[i] >= 0)
+      group[partner[i]] = groups;
+    groups++;
+  }
+  std::vector<Eigen::Triplet<double>> quotient;
+  for (int c = 0; c < n; c++) {
+    quotient.emplace_back(group[c], group[c], 1.0);
+    for (int r : adjacency[c])
+      if (group[r] != group[c])
+        quotient.emplace_back(group[r], group[c], 1.0);
+  }
+  Eigen::SparseMatrix<double> Q(groups, groups);
+  Q.setFromTriplets(quotient.begin(), quotient.end());
+  Eigen::AMDOrdering<int>::PermutationType amd;
+  Eigen::AMDOrdering<int>()(Q, amd);
+
+  // expand groups: the nonzero diagonal member first, then its branch
+  std::vector<std::vector<int>> members(groups);
+  for (int i = 0; i < n; i++)
+    members[group[i]].push_back(i);
+  std::vector<int> order;
+  order.reserve(n);
+  for (int k = 0; k < groups; k++) {
+    auto& m = members[amd.indices()[k]];
+    if (m.size() == 2 && zero_diagonal[m[0]])
+      std::swap(m[0], m[1]);
+    order.insert(order.end(), m.begin(), m.end());
+  }
+
+  // elimination tree of the permuted pattern, then postorder it so every
+  // supernode is a run of consecutive columns
+  auto etree = [&](const std::vector<int>& order, std::vector<int>& position) {
+    position.assign(n, 0);
+    for (int k = 0; k < n; k++)
+      position[order[k]] = k;
+    std::vector<int> parent(n, -1), ancestor(n, -1);
+    for (int k = 0; k < n; k++) {
+      for (int neighbour : adjacency[order[k]]) {
+        int r = position[neighbour];
+        while (r != -1 && r < k) {
+          int next = ancestor[r];
+          ancestor[r] = k;
+          if (next == -1)
+            parent[r] = k;
+          r = next;
+        }
+      }
+    }
+    return parent;
+  };
+  std::vector<int> position;
+  std::vector<int> parent = etree(order, position);
+  {
+    std::vector<std::vector<int>> kids(n);
+    std::vector<int> roots;
+    for (int k = 0; k < n; k++)
+      (parent[k] < 0 ? roots : kids[parent[k]]).push_back(k);
+    std::vector<int> post;
+    post.reserve(n);
+    std::vector<std::pair<int, size_t>> stack;
+    for (int root : roots) {
+      stack.push_back({ root, 0 });
+      while (!stack.empty()) {
+        auto& top = stack.back();
+        if (top.second < kids[top.first].size()) {
+          stack.push_back({ kids[top.first][top.second++], 0 });
+        } else {
+          post.push_back(order[top.first]);
+          stack.pop_back();
+        }
+      }
+    }
+    order.swap(post);
+  }
+  parent = etree(order, position);
+  order_ = Eigen::Map<Eigen::VectorXi>(order.data(), n);
+
+  // column structures of L (rows below the diagonal), children merged in
+  std::vector<std::vector<int>> structure(n);
+  std::vector<std::vector<int>> column_children(n);
+  for (int k = 0; k < n; k++)
+    if (parent[k] >= 0)
+      column_children[parent[k]].push_back(k);
+  std::vector<int> mark(n, -1);
+  for (int k = 0; k < n; k++) {
+    auto& s = structure[k];
+    mark[k] = k;
+    for (int neighbour : adjacency[order[k]]) {
+      int r = position[neighbour];
+      if (r > k && mark[r] != k) {
+        mark[r] = k;
+        s.push_back(r);
+      }
+    }
+    for (int c : column_children[k]) {
+      for (int r : structure[c]) {
+        if (mark[r] != k) {
+          mark[r] = k;
+          s.push_back(r);
+        }
+      }
+    }
+    std::sort(s.begin(), s.end());
+  }
+
+  // supernodes: chains k-1 -> k with nested structure, matched pairs are always joined,
+  // and small fronts are relaxed into their parent to give the dense kernels more work
+  const size_t relax_width = 8;
+  std::vector<int> supernode_of(n);
+  for (int k = 0; k < n; k++) {
+    bool join = false;
+    if (k > 0 && parent[k - 1] == k) {
+      auto& current = supernodes_.back();
+      size_t width = k - current.first;
+      bool nested = structure[k - 1].size() == structure[k].size() + 1;
+      bool paired = partner[order[k]] == order[k - 1];
+      bool relaxed = width < relax_width && structure[k - 1].size() <= structure[k].size() + 2;
+      join = nested || paired || relaxed;
+    }
+    if (!join) {
+      supernodes_.push_back(Supernode());
+      supernodes_.back().first = k;
+    }
+    supernodes_.back().last = k + 1;
+    supernode_of[k] = static_cast<int>(supernodes_.size()) - 1;
+  }
+
+  // front rows = union of member column structures past the pivots
+  max_front_ = 0;
+  for (auto& s : supernodes_) {
+    for (int k = s.first; k < s.last; k++) {
+      for (int r : structure[k]) {
+        if (r >= s.last && mark[r] != -2 - s.first) {
+          mark[r] = -2 - s.first;
+          s.rows.push_back(r);
+        }
+      }
+      std::vector<int>().swap(structure[k]);
+    }
+    std::sort(s.rows.begin(), s.rows.end());
+    max_front_ = std::max(max_front_, static_cast<size_t>(s.last - s.first) + s.rows.size());
+  }
+  for (size_t s = 0; s < supernodes_.size(); s++) {
+    int p = parent[supernodes_[s].last - 1];
+    if (p >= 0)
+      supernodes_[supernode_of[p]].children.push_back(static_cast<int>(s));
+  }
+
+  // where each child's contribution rows sit in its parent front
+  std::vector<int> local(n, -1);
+  for (auto& s : supernodes_) {
+    int width = s.last - s.first;
+    for (int k = s.first; k < s.last; k++)
+      local[k] = k - s.first;
+    for (size_t i = 0; i < s.rows.size(); i++)
+      local[s.rows[i]] = width + static_cast<int>(i);
+    for (int c : s.children) {
+      auto& child = supernodes_[c];
+      child.relative.resize(child.rows.size());
+      for (size_t i = 0; i < child.rows.size(); i++)
+        child.relative[i] = local[child.rows[i]];
+    }
+    // entries of A owned by this front: pivot columns and pivot rows
+    s.assembly_begin = assembly_.size();
+    for (int k = s.first; k < s.last; k++) {
+      int original = order[k];
+      for (Eigen::SparseMatrix<double>::InnerIterator it(A, original); it; ++it) {
+        int r = position[it.row()];
+        if (r >= s.first)
+          assembly_.push_back({ static_cast<int>(&it.value() - A.valuePtr()), local[r], k - s.first });
+      }
+    }
+    s.assembly_end = assembly_.size();
+  }
+  // pivot row entries to the right of the pivot block, walked column by column of A
+  std::vector<std::vector<Assembly>> row_entries(supernodes_.size());
+  for (int c = 0; c < n; c++) {
+    int col = position[c];
+    for (Eigen::SparseMatrix<double>::InnerIterator it(A, c); it; ++it) {
+      int r = position[it.row()];
+      auto& s = supernodes_[supernode_of[r]];
+      if (col >= s.last) {
+        // local[] was last written for the owning front only for pivots, find the row slot
+        auto slot = std::lower_bound(s.rows.begin(), s.rows.end(), col);
+        int width = s.last - s.first;
+        row_entries[supernode_of[r]].push_back({ static_cast<int>(&it.value() - A.valuePtr()),
+            r - s.first, width + static_cast<int>(slot - s.rows.begin()) });
+      }
+    }
+  }
+  std::vector<Assembly> merged;
+  merged.reserve(assembly_.size() + A.nonZeros());
+  for (size_t s = 0; s < supernodes_.size(); s++) {
+    auto& node = supernodes_[s];
+    size_t begin = merged.size();
+    merged.insert(merged.end(), assembly_.begin() + node.assembly_begin,
+                  assembly_.begin() + node.assembly_end);
+    merged.insert(merged.end(), row_entries[s].begin(), row_entries[s].end());
+    node.assembly_begin = begin;
+    node.assembly_end = merged.size();
+  }
+  assembly_.swap(merged);
+}
+
+template <class Scalar>
+void BasicMultifrontalLU<Scalar>::factorize(const Eigen::SparseMatrix<double>& A) {
+  if (info_ == Eigen::InvalidInput || A.rows() != n_) {
+    Fail("analyzePattern must be called first");
+    return;
+  }
+  info_ = Eigen::Success;
+  error_.clear();
+  factor_nnz_ = 0;
+  const double* values = A.valuePtr();
+  std::vector<Matrix> updates(supernodes_.size());
+
+  for (size_t s = 0; s < supernodes_.size(); s++) {
+    auto& node = supernodes_[s];
+    const int k = node.last - node.first;
+    const int r = static_cast<int>(node.rows.size());
+    Matrix front = Matrix::Zero(k + r, k + r);
+
+    for (size_t e = node.assembly_begin; e < node.assembly_end; e++)
+      front(assembly_[e].row, assembly_[e].col) += static_cast<Scalar>(values[assembly_[e].value]);
+    // extend-add the children's Schur complements
+    for (int c : node.children) {
+      auto& update = updates[c];
+      auto& relative = supernodes_[c].relative;
+      for (Eigen::Index j = 0; j < update.cols(); j++)
+        for (Eigen::Index i = 0; i < update.rows(); i++)
+          front(relative[i], relative[j]) += update(i, j);
+      Matrix().swap(update);
+    }
+
+    // partial pivoting restricted to the fully summed block
+    Eigen::PartialPivLU<Matrix> lu(front.topLeftCorner(k, k));
+    node.lu11 = lu.matrixLU();
+    node.perm = lu.permutationP().indices();
+    for (int i = 0; i < k; i++) {
+      double column_max = front.col(i).cwiseAbs().maxCoeff();
+      if (!(std::abs(node.lu11(i, i)) > pivot_threshold_ * column_max)) {
+        Fail("multifrontal LU: unstable pivot in column " + std::to_string(order_[node.first + i]));
+        return;
+      }
+    }
+    if (r > 0) {
+      node.u12 = lu.permutationP() * front.topRightCorner(k, r);
+      node.lu11.template triangularView<Eigen::UnitLower>().solveInPlace(node.u12);
+      node.l21 = front.bottomLeftCorner(r, k);
+      node.lu11.template triangularView<Eigen::Upper>().template solveInPlace<Eigen::OnTheRight>(node.l21);
+      updates[s] = front.bottomRightCorner(r, r);
+      updates[s].noalias() -= node.l21 * node.u12;
+    } else {
+      node.u12.resize(0, 0);
+      node.l21.resize(0, 0);
+    }
+    factor_nnz_ += static_cast<size_t>(k) * k + 2 * static_cast<size_t>(k) * r;
+  }
+}
+
+template <class Scalar>
+Eigen::MatrixXd BasicMultifrontalLU<Scalar>::solve(const Eigen::MatrixXd& b) const {
+  Matrix y(n_, b.cols());
+  for (int k = 0; k < n_; k++)
+    y.row(k) = b.row(order_[k]).template cast<Scalar>();
+
+  Matrix gathered;
+  for (auto& node : supernodes_) {
+    const int k = node.last - node.first;
+    auto pivots = y.middleRows(node.first, k);
+    Matrix permuted = pivots;
+    for (int i = 0; i < k; i++)
+      pivots.row(node.perm[i]) = permuted.row(i);
+    node.lu11.template triangularView<Eigen::UnitLower>().solveInPlace(pivots);
+    if (!node.rows.empty()) {
+      gathered.noalias() = node.l21 * pivots;
+      for (size_t i = 0; i < node.rows.size(); i++)
+        y.row(node.rows[i]) -= gathered.row(i);
+    }
+  }
+  for (auto node = supernodes_.rbegin(); node != supernodes_.rend(); ++node) {
+    const int k = node->last - node->first;
+    auto pivots = y.middleRows(node->first, k);
+    if (!node->rows.empty()) {
+      gathered.resize(node->rows.size(), y.cols());
+      for (size_t i = 0; i < node->rows.size(); i++)
+        gathered.row(i) = y.row(node->rows[i]);
+      pivots.noalias() -= node->u12 * gathered;
+    }
+    node->lu11.template triangularView<Eigen::Upper>().solveInPlace(pivots);
+  }
+
+  Eigen::MatrixXd x(n_, b.cols());
+  for (int k = 0; k < n_; k++)
+    x.row(order_[k]) = y.row(k).template cast<double>();
+  return x;
+}
+
+// A^T x = b with the same factors: U^T then L^T, supernodes walked in reverse roles
+template <class Scalar>
+Eigen::MatrixXd BasicMultifrontalLU<Scalar>::solveTransposed(const Eigen::MatrixXd& b) const {
+  Matrix y(n_, b.cols());
+  for (int k = 0; k < n_; k++)
+    y.row(k) = b.row(order_[k]).template cast<Scalar>();
+
+  Matrix gathered;
+  for (auto& node : supernodes_) {
+    const int k = node.last - node.first;
+    auto pivots = y.middleRows(node.first, k);
+    node.lu11.template triangularView<Eigen::Upper>().transpose().solveInPlace(pivots);
+    if (!node.rows.empty()) {
+      gathered.noalias() = node.u12.transpose() * pivots;
+      for (size_t i = 0; i < node.rows.size(); i++)
+        y.row(node.rows[i]) -= gathered.row(i);
+    }
+  }
+  for (auto node = supernodes_.rbegin(); node != supernodes_.rend(); ++node) {
+    const int k = node->last - node->first;
+    auto pivots = y.middleRows(node->first, k);
+    if (!node->rows.empty()) {
+      gathered.resize(node->rows.size(), y.cols());
+      for (size_t i = 0; i < node->rows.size(); i++)
+        gathered.row(i) = y.row(node->rows[i]);
+      pivots.noalias() -= node->l21.transpose() * gathered;
+    }
+    node->lu11.template triangularView<Eigen::UnitLower>().transpose().solveInPlace(pivots);
+    Matrix permuted = pivots;
+    for (int i = 0; i < k; i++)
+      pivots.row(i) = permuted.row(node->perm[i]);
+  }
+
+  Eigen::MatrixXd x(n_, b.cols());
+  for (int k = 0; k < n_; k++)
+    x.row(order_[k]) = y.row(k).template cast<double>();
+  return x;
+}
+
+using MultifrontalLU = BasicMultifrontalLU<double>;
+
+#endif // !Multifrontal_h
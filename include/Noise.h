@@ -0,0 +1,115 @@
+// Thermal noise analysis over frequency.
+// Every resistor is a noise current source of density 4kT/R (A^2/Hz) across its
+// nodes. Its share of the output density is |H|^2 4kT/R, with H the transfer from
+// that source to the output. The adjoint system Y^T z = e_o gives every transfer at
+// once, H = z(p) - z(n), so one transposed complex solve per frequency replaces one
+// solve per resistor. Frequencies are spread over threads with AcAnalysis.
+// Noise.h
+
+#include "Ac.h"
+#include "Circuit.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef Noise_h
+#define Noise_h
+
+class NoiseAnalysis {
+public:
+  static constexpr double kBoltzmann = 1.380649e-23;
+  // 27 C, the usual circuit simulator default
+  static constexpr double kDefaultTemperature = 300.15;
+
+  struct Contribution {
+    size_t component;
+    double density; // output density from this resistor, V^2/Hz (A^2/Hz for a current output)
+  };
+
+  // circuit must be assembled, temperature in kelvin
+  explicit NoiseAnalysis(const Circuit& circuit, double temperature = kDefaultTemperature);
+
+  // Output noise at each frequency (Hz) for output row (see OutputRow in Sensitivity.h)
+  void Run(Eigen::Index output, const std::vector<double>& frequencies, size_t threads = 0);
+
+  const std::vector<double>& frequencies() const { return frequencies_; }
+  // total output density at frequency k, V^2/Hz
+  double total(size_t k) const { return total_(k); }
+  // sqrt(total), V/sqrt(Hz)
+  double spectral_density(size_t k) const { return std::sqrt(total_(k)); }
+  // contributions(s, k): density of noise source s at frequency k
+  const Eigen::MatrixXd& contributions() const { return contributions_; }
+  // component index of noise source s (the resistors, in netlist order)
+  const std::vector<size_t>& sources() const { return sources_; }
+  // contributions at frequency k by decreasing density, the first limit (0 = all)
+  std::vector<Contribution> Ranked(size_t k, size_t limit = 0) const;
+
+private:
+  const Circuit& circuit_;
+  AcAnalysis ac_;
+  double temperature_;
+  std::vector<size_t> sources_;
+  std::vector<double> frequencies_;
+  Eigen::VectorXd total_;
+  Eigen::MatrixXd contributions_;
+};
+
+inline NoiseAnalysis::NoiseAnalysis(const Circuit& circuit, double temperature) :
+    circuit_(circuit), ac_(circuit), temperature_(temperature) {
+  const auto& components = circuit.components();
+  for (size_t c = 0; c < components.size(); c++) {
+    if (components[c].type() == 'R')
+      sources_.push_back(c);
+  }
+}
+
+inline void NoiseAnalysis::Run(Eigen::Index output, const std::vector<double>& frequencies,
+                               size_t threads) {
+  const Eigen::Index n = static_cast<Eigen::Index>(ac_.size());
+  if (output < 0 || output >= n)
+    throw std::out_of_range("noise output row " + std::to_string(output));
+  frequencies_ = frequencies;
+  contributions_.resize(sources_.size(), frequencies.size());
+  total_.resize(frequencies.size());
+
+  // source densities do not depend on frequency
+  const auto& components = circuit_.components();
+  std::vector<double> density(sources_.size());
+  for (size_t s = 0; s < sources_.size(); s++)
+    density[s] = 4.0 * kBoltzmann * temperature_ / components[sources_[s]].value();
+
+  Eigen::VectorXcd e = Eigen::VectorXcd::Zero(n);
+  e(output) = 1.0;
+  ac_.ForEachFrequency(frequencies, threads, [&](size_t k, AcAnalysis::ComplexLU& lu) {
+    Eigen::VectorXcd z = lu.transpose().solve(e);
+    double sum = 0.0;
+    for (size_t s = 0; s < sources_.size(); s++) {
+      auto& r = components[sources_[s]];
+      AcAnalysis::Complex h = 0.0;
+      if (r.p_index() > 0)
+        h += z(r.p_index() - 1);
+      if (r.n_index() > 0)
+        h -= z(r.n_index() - 1);
+      double contribution = std::norm(h) * density[s];
+      contributions_(s, k) = contribution;
+      sum += contribution;
+    }
+    total_(k) = sum;
+  });
+}
+
+inline std::vector<NoiseAnalysis::Contribution> NoiseAnalysis::Ranked(size_t k, size_t limit) const {
+  std::vector<Contribution> ranked(sources_.size());
+  for (size_t s = 0; s < sources_.size(); s++)
+    ranked[s] = { sources_[s], contributions_(s, k) };
+  size_t count = limit ? std::min(limit, ranked.size()) : ranked.size();
+  std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+                    [](const Contribution& a, const Contribution& b) { return a.density > b.density; });
+  ranked.resize(count);
+  return ranked;
+}
+
+#endif // !Noise_h
@@ -0,0 +1,59 @@
+// Minimal fork/join helpers over std::thread.
+// Parallel.h
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#ifndef Parallel_h
+#define Parallel_h
+
+// Threads to use when the caller asks for 0 (= all cores)
+inline size_t DefaultThreads() {
+  return std::max<size_t>(1, std::thread::hardware_concurrency());
+}
+
+// Runs body(t) for t in [0, threads), the calling thread takes t = 0.
+// Returns after every call has finished. An exception from any call is caught, every
+// thread is joined, and then the exception of the lowest t is rethrown.
+template <class Body>
+void ParallelFor(size_t threads, Body&& body) {
+  if (threads <= 1) {
+    body(size_t(0));
+    return;
+  }
+  std::vector<std::exception_ptr> errors(threads);
+  auto run = [&body, &errors](size_t t) {
+    try {
+      body(t);
+    } catch (...) {
+      errors[t] = std::current_exception();
+    }
+  };
+  std::vector<std::thread> workers;
+  workers.reserve(threads - 1);
+  try {
+    for (size_t t = 1; t < threads; t++)
+      workers.emplace_back(run, t);
+  } catch (...) {
+    // no thread could be started, the ones that were are joined below
+    errors[0] = std::current_exception();
+  }
+  if (!errors[0])
+    run(0);
+  for (auto& i : workers)
+    i.join();
+  for (auto& error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+}
+
+// [begin, end) of chunk t when count items are split evenly over threads
+inline std::pair<size_t, size_t> ChunkRange(size_t count, size_t threads, size_t t) {
+  return { count * t / threads, count * (t + 1) / threads };
+}
+
+#endif // !Parallel_h
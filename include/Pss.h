@@ -0,0 +1,139 @@
+// Periodic steady state by the shooting method.
+// Phi(x0) is the state one period after x0 under the transient integrator, and the
+// steady state is the fixed point Phi(x0) = x0. Newton solves (M - I) dx = x0 - Phi(x0)
+// with M = dPhi/dx0 the monodromy matrix, which is dense and never formed: GMRES only
+// needs M v, one period of the transient with the sources zeroed (Propagate). Modes
+// that have decayed within a period leave M near zero, so GMRES converges in about as
+// many products as there are slow modes, and the steady state costs a few period
+// integrations however long the circuit takes to settle from rest.
+// Pss.h
+
+#include "Circuit.h"
+#include "Krylov.h"
+#include "Transient.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef Pss_h
+#define Pss_h
+
+struct PssOptions {
+  double tolerance = 1e-9; // on ||Phi(x0) - x0|| / max(||x0||, 1), infinity norms
+  size_t max_newton = 10;
+  KrylovOptions krylov;
+};
+
+class PeriodicSteadyState {
+public:
+  // circuit must be assembled, period in seconds split into steps trapezoidal steps,
+  // plus the waveform breakpoints in the period (TransientAnalysis::Schedule)
+  PeriodicSteadyState(const Circuit& circuit, double period, size_t steps);
+
+  // excitation of period period, see TransientAnalysis
+  void set_excitation(TransientAnalysis::Excitation excitation) {
+    transient_.set_excitation(std::move(excitation));
+  }
+  const TransientAnalysis& transient() const { return transient_; }
+  // the time of every waveform column, 0 ... period
+  const std::vector<double>& times() const { return times_; }
+
+  // Steady state from initial (zero when empty), throws std::runtime_error without
+  // convergence, of Newton or of the GMRES solve of any Newton step
+  const Eigen::VectorXd& Solve(const Eigen::VectorXd& initial = Eigen::VectorXd(),
+                               const PssOptions& options = PssOptions());
+
+  double period() const { return period_; }
+  size_t steps() const { return steps_; }
+  // state at the start of the period
+  const Eigen::VectorXd& x() const { return x_; }
+  // waveform(:, k) is the state at times()[k]
+  const Eigen::MatrixXd& waveform() const { return waveform_; }
+  size_t newton_iterations() const { return newton_iterations_; }
+  // GMRES Krylov vectors over all Newton iterations
+  size_t krylov_iterations() const { return krylov_iterations_; }
+  // the GMRES solve of the last Newton step
+  const KrylovResult& krylov() const { return krylov_; }
+  // periods integrated in all, with and without sources
+  size_t periods() const { return periods_; }
+  // ||Phi(x0) - x0|| / max(||x0||, 1) at the end
+  double residual() const { return residual_; }
+
+private:
+  TransientAnalysis transient_;
+  double period_;
+  size_t steps_;
+  std::vector<double> schedule_, times_; // times_ is 0 and the schedule
+  Eigen::VectorXd x_;
+  Eigen::MatrixXd waveform_;
+  size_t newton_iterations_ = 0, krylov_iterations_ = 0, periods_ = 0;
+  KrylovResult krylov_;
+  double residual_ = 0.0;
+};
+
+inline PeriodicSteadyState::PeriodicSteadyState(const Circuit& circuit, double period, size_t steps) :
+    transient_(circuit, period / static_cast<double>(steps ? steps : 1)), period_(period), steps_(steps) {
+  if (steps < 2)
+    throw std::invalid_argument("periodic steady state needs at least 2 steps per period");
+  // a line's history reaches back before the period, x0 alone is not the state
+  if (!transient_.lines().empty())
+    throw std::runtime_error("periodic steady state does not support transmission lines");
+  schedule_ = transient_.Schedule(0.0, period);
+  times_.reserve(schedule_.size() + 1);
+  times_.push_back(0.0);
+  times_.insert(times_.end(), schedule_.begin(), schedule_.end());
+}
+
+inline const Eigen::VectorXd& PeriodicSteadyState::Solve(const Eigen::VectorXd& initial,
+                                                         const PssOptions& options) {
+  const Eigen::Index n = static_cast<Eigen::Index>(transient_.size());
+  x_ = initial.size() ? initial : Eigen::VectorXd::Zero(n);
+  if (x_.size() != n)
+    throw std::invalid_argument("periodic steady state guess has the wrong size");
+  waveform_.resize(n, static_cast<Eigen::Index>(times_.size()));
+  newton_iterations_ = krylov_iterations_ = periods_ = 0;
+  krylov_ = KrylovResult();
+
+  // one period from x_, keeping the samples
+  auto shoot = [&]() {
+    Eigen::VectorXd end = x_;
+    Eigen::Index k = 0;
+    transient_.Integrate(end, 0.0, schedule_, [&](double, const Eigen::VectorXd& x) { waveform_.col(k++) = x; });
+    periods_++;
+    return end;
+  };
+  auto monodromy = [&](const Eigen::VectorXd& v, Eigen::VectorXd& w) {
+    w = v;
+    transient_.Propagate(w, 0.0, schedule_);
+    w -= v;
+  };
+
+  Eigen::VectorXd r = shoot() - x_;
+  for (;;) {
+    residual_ = r.lpNorm<Eigen::Infinity>() / std::max(x_.lpNorm<Eigen::Infinity>(), 1.0);
+    if (residual_ <= options.tolerance)
+      return x_;
+    if (newton_iterations_ == options.max_newton) {
+      throw std::runtime_error("periodic steady state did not converge, residual " +
+                               std::to_string(residual_));
+    }
+    Eigen::VectorXd dx = Eigen::VectorXd::Zero(n);
+    krylov_ = Gmres(monodromy, -r, dx, options.krylov);
+    krylov_iterations_ += krylov_.iterations;
+    periods_ += krylov_.products;
+    newton_iterations_++;
+    // a partly solved Newton system is no Newton step
+    if (!krylov_.converged) {
+      throw std::runtime_error("periodic steady state: GMRES did not converge in Newton iteration " +
+                               std::to_string(newton_iterations_) + ", relative residual " +
+                               std::to_string(krylov_.residual));
+    }
+    x_ += dx;
+    r = shoot() - x_;
+  }
+}
+
+#endif // !Pss_h
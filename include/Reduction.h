@@ -0,0 +1,212 @@
+// Model order reduction of large RC/RLC networks seen from a few ports (PRIMA).
+// The ports are nodes driven by currents and observed by their voltages, the
+// network's own sources are zeroed (V shorted, I open), so the model is the port
+// impedance Z(s) = B^T (G + sC)^-1 B with G and C from AcAnalysis. Block Arnoldi
+// on (G + s0 C)^-1 C from (G + s0 C)^-1 B builds an orthonormal basis V of the
+// Krylov space matching q moments per port around s0, and the congruence
+// Gr = V^T G V, Cr = V^T C V, Br = V^T B keeps the model passive. For that G + G^T
+// and C must be positive semidefinite, which holds once the V and L branch rows
+// are negated: it turns the symmetric incidence of the MNA stamp into the usual
+// [G A; -A^T 0] form and -L into +L without changing any solution.
+// Reduction.h
+
+#include "Ac.h"
+#include "Circuit.h"
+#include "Solver.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <cmath>
+#include <complex>
+#include <functional>
+#include <iomanip>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef Reduction_h
+#define Reduction_h
+
+class ReducedModel {
+public:
+  ReducedModel() = default;
+  ReducedModel(std::vector<std::string> ports, Eigen::MatrixXd G, Eigen::MatrixXd C, Eigen::MatrixXd B) :
+      ports_(std::move(ports)), G_(std::move(G)), C_(std::move(C)), B_(std::move(B)) {}
+
+  // states of the reduced model
+  size_t order() const { return static_cast<size_t>(G_.rows()); }
+  const std::vector<std::string>& ports() const { return ports_; }
+  const Eigen::MatrixXd& G() const { return G_; }
+  const Eigen::MatrixXd& C() const { return C_; }
+  const Eigen::MatrixXd& B() const { return B_; }
+
+  // port impedance matrix at frequency (Hz), Z(i, j) = v(port i) / current into port j
+  Eigen::MatrixXcd Impedance(double frequency) const;
+  // finite poles s (rad/s), from G x = -s C x
+  Eigen::VectorXcd Poles() const;
+  // Port voltages for the port currents currents(t), starting at rest, trapezoidal
+  // rule with a fixed step. Column k is t = k * step.
+  Eigen::MatrixXd Transient(const std::function<Eigen::VectorXd(double)>& currents, double step,
+                            size_t steps) const;
+
+  // plain text, every value with full double precision
+  void Save(std::ostream& out) const;
+  // throws std::runtime_error on malformed input
+  static ReducedModel Load(std::istream& in);
+
+private:
+  std::vector<std::string> ports_;
+  Eigen::MatrixXd G_, C_, B_;
+};
+
+// PRIMA reduction of the circuit seen from the port nodes with blocks moments per port
+// around expansion (rad/s, 0 matches DC and needs G nonsingular). The basis stops
+// early when the Krylov space is exhausted. Uses the circuit's solver kind for the
+// one sparse factorization.
+inline ReducedModel Prima(const Circuit& circuit, const std::vector<std::string>& ports,
+                          size_t blocks, double expansion = 0.0) {
+  AcAnalysis ac(circuit);
+  const Eigen::Index n = static_cast<Eigen::Index>(ac.size());
+  const Eigen::Index p = static_cast<Eigen::Index>(ports.size());
+  if (p == 0 || blocks == 0)
+    throw std::invalid_argument("Prima needs at least one port and one block");
+
+  Eigen::MatrixXd B = Eigen::MatrixXd::Zero(n, p);
+  for (Eigen::Index k = 0; k < p; k++) {
+    auto found = circuit.nodes().find(ports[k]);
+    if (found == circuit.nodes().end() || found->second == 0)
+      throw std::runtime_error("port \"" + ports[k] + "\" is not a node other than ground");
+    B(found->second - 1, k) = 1.0;
+  }
+
+  // branch rows negated, see above
+  Eigen::SparseMatrix<double> G = ac.G(), C = ac.C();
+  const int node_rows = static_cast<int>(circuit.nodes_count()) - 1;
+  for (auto* matrix : { &G, &C }) {
+    for (Eigen::Index k = 0; k < matrix->nonZeros(); k++) {
+      if (matrix->innerIndexPtr()[k] >= node_rows)
+        matrix->valuePtr()[k] = -matrix->valuePtr()[k];
+    }
+  }
+
+  Eigen::SparseMatrix<double> K = G + expansion * C;
+  LinearSolver solver(circuit.solver());
+  solver.Factorize(K);
+
+  // block Arnoldi, modified Gram-Schmidt run twice per vector, columns that vanish are deflated
+  Eigen::MatrixXd V(n, p * static_cast<Eigen::Index>(blocks));
+  Eigen::Index m = 0;
+  Eigen::MatrixXd block = solver.Solve(B);
+  for (size_t q = 0; q < blocks; q++) {
+    Eigen::Index first = m;
+    for (Eigen::Index c = 0; c < block.cols(); c++) {
+      Eigen::VectorXd v = block.col(c);
+      double norm = v.norm();
+      for (int pass = 0; pass < 2 && m > 0; pass++)
+        v -= V.leftCols(m) * (V.leftCols(m).transpose() * v);
+      double remaining = v.norm();
+      if (!(remaining > 1e-10 * norm))
+        continue;
+      V.col(m++) = v / remaining;
+    }
+    if (m == first)
+      break;
+    if (q + 1 < blocks)
+      block = solver.Solve(C * V.middleCols(first, m - first));
+  }
+  V.conservativeResize(n, m);
+
+  Eigen::MatrixXd Gr = V.transpose() * (G * V);
+  Eigen::MatrixXd Cr = V.transpose() * (C * V);
+  Eigen::MatrixXd Br = V.transpose() * B;
+  return ReducedModel(ports, std::move(Gr), std::move(Cr), std::move(Br));
+}
+
+inline Eigen::MatrixXcd ReducedModel::Impedance(double frequency) const {
+  const double w = 2.0 * EIGEN_PI * frequency;
+  Eigen::MatrixXcd Y = G_.cast<std::complex<double>>() + std::complex<double>(0.0, w) * C_;
+  Eigen::MatrixXcd X = Y.partialPivLu().solve(B_.cast<std::complex<double>>());
+  return B_.transpose().cast<std::complex<double>>() * X;
+}
+
+inline Eigen::VectorXcd ReducedModel::Poles() const {
+  return FinitePoles(G_, C_);
+}
+
+inline Eigen::MatrixXd ReducedModel::Transient(const std::function<Eigen::VectorXd(double)>& currents,
+                                               double step, size_t steps) const {
+  // (C/h + G/2) x1 = (C/h - G/2) x0 + B (u1 + u0) / 2
+  Eigen::PartialPivLU<Eigen::MatrixXd> lu(C_ / step + 0.5 * G_);
+  Eigen::MatrixXd back = C_ / step - 0.5 * G_;
+  Eigen::MatrixXd v(B_.cols(), steps + 1);
+  Eigen::VectorXd x = Eigen::VectorXd::Zero(G_.rows());
+  Eigen::VectorXd u = currents(0.0);
+  v.col(0) = B_.transpose() * x;
+  for (size_t k = 1; k <= steps; k++) {
+    Eigen::VectorXd next = currents(step * static_cast<double>(k));
+    x = lu.solve(back * x + B_ * (0.5 * (u + next)));
+    u = std::move(next);
+    v.col(k) = B_.transpose() * x;
+  }
+  return v;
+}
+
+inline void ReducedModel::Save(std::ostream& out) const {
+  out << "prima 1\nports " << ports_.size() << "\n";
+  for (auto& i : ports_)
+    out << i << "\n";
+  out << "order " << order() << "\n" << std::setprecision(std::numeric_limits<double>::max_digits10);
+  auto write = [&](const char* name, const Eigen::MatrixXd& matrix) {
+    out << name << "\n";
+    for (Eigen::Index r = 0; r < matrix.rows(); r++) {
+      for (Eigen::Index c = 0; c < matrix.cols(); c++)
+        out << (c ? " " : "") << matrix(r, c);
+      out << "\n";
+    }
+  };
+  write("G", G_);
+  write("C", C_);
+  write("B", B_);
+}
+
+inline ReducedModel ReducedModel::Load(std::istream& in) {
+  auto expect = [&](const std::string& word) {
+    std::string read;
+    if (!(in >> read) || read != word)
+      throw std::runtime_error("reduced model: expected \"" + word + "\", read \"" + read + '"');
+  };
+  expect("prima");
+  expect("1");
+  expect("ports");
+  size_t port_count = 0, order = 0;
+  if (!(in >> port_count))
+    throw std::runtime_error("reduced model: bad port count");
+  std::vector<std::string> ports(port_count);
+  for (auto& i : ports) {
+    if (!(in >> i))
+      throw std::runtime_error("reduced model: missing port name");
+  }
+  expect("order");
+  if (!(in >> order))
+    throw std::runtime_error("reduced model: bad order");
+  auto read = [&](const char* name, Eigen::Index rows, Eigen::Index cols) {
+    expect(name);
+    Eigen::MatrixXd matrix(rows, cols);
+    for (Eigen::Index r = 0; r < rows; r++) {
+      for (Eigen::Index c = 0; c < cols; c++) {
+        if (!(in >> matrix(r, c)))
+          throw std::runtime_error(std::string("reduced model: short matrix ") + name);
+      }
+    }
+    return matrix;
+  };
+  const Eigen::Index m = static_cast<Eigen::Index>(order), p = static_cast<Eigen::Index>(port_count);
+  Eigen::MatrixXd G = read("G", m, m);
+  Eigen::MatrixXd C = read("C", m, m);
+  Eigen::MatrixXd B = read("B", m, p);
+  return ReducedModel(std::move(ports), std::move(G), std::move(C), std::move(B));
+}
+
+#endif // !Reduction_h
@@ -0,0 +1,134 @@
+// Adjoint sensitivity analysis.
+// For an output y = x(o) of A x = b, the derivative with respect to the stamp
+// parameter p of any component is lambda^T (db/dp - dA/dp x) with A^T lambda = e_o.
+// Stamps are affine in p, so dA/dp and db/dp are the stamp map coefficients of the
+// component and one transposed solve per output, against the factorization SolveCircuit
+// already made, gives the derivatives to every component in a single pass over the stamps.
+// Sensitivity.h
+
+#include "Circuit.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef Sensitivity_h
+#define Sensitivity_h
+
+// MNA row of an output: "v(node)" or "node" for a node voltage, "i(name)" for the
+// branch current of a V or L. Throws std::runtime_error for unknown names and ground.
+inline Eigen::Index OutputRow(const Circuit& circuit, std::string_view output) {
+  auto inside = [&](char kind) {
+    return output.size() > 3 && std::tolower(static_cast<unsigned char>(output[0])) == kind &&
+           output[1] == '(' && output.back() == ')';
+  };
+  if (inside('i')) {
+    std::string_view name = output.substr(2, output.size() - 3);
+    for (auto& i : circuit.components()) {
+      if (i.name() == name && i.branch() >= 0)
+        return static_cast<Eigen::Index>(circuit.nodes_count() - 1 + i.branch());
+    }
+    throw std::runtime_error("no V or L named \"" + std::string(name) + '"');
+  }
+  std::string_view node = inside('v') ? output.substr(2, output.size() - 3) : output;
+  auto found = circuit.nodes().find(node);
+  if (found == circuit.nodes().end())
+    throw std::runtime_error("no node named \"" + std::string(node) + '"');
+  if (found->second == 0)
+    throw std::runtime_error("ground has no sensitivity");
+  return found->second - 1;
+}
+
+class Sensitivity {
+public:
+  struct Entry {
+    size_t component;
+    double derivative; // d output / d component value
+    double normalized; // derivative * value, the output change for a 100% value change
+  };
+
+  // circuit must be assembled, its stamp map is built here if it is empty
+  explicit Sensitivity(Circuit& circuit);
+
+  // Solves the circuit and one adjoint system per output row. Returns
+  // derivatives(component, k): d x(outputs[k]) / d value of component.
+  const Eigen::MatrixXd& Compute(const std::vector<Eigen::Index>& outputs);
+
+  // solution of the last Compute
+  const Eigen::VectorXd& x() const { return x_; }
+  const Eigen::MatrixXd& derivatives() const { return derivatives_; }
+  // components of output k by decreasing |normalized|, the first limit (0 = all)
+  std::vector<Entry> Ranked(size_t k, size_t limit = 0) const;
+
+private:
+  Circuit& circuit_;
+  std::vector<int> column_; // column of every nonzero of A
+  Eigen::VectorXd x_;
+  Eigen::MatrixXd derivatives_;
+};
+
+inline Sensitivity::Sensitivity(Circuit& circuit) : circuit_(circuit) {
+  if (circuit.stamp_map().empty())
+    circuit.BuildStampMap();
+  const auto& A = circuit.A();
+  column_.resize(A.nonZeros());
+  for (int j = 0; j < A.outerSize(); j++) {
+    for (int p = A.outerIndexPtr()[j]; p < A.outerIndexPtr()[j + 1]; p++)
+      column_[p] = j;
+  }
+}
+
+inline const Eigen::MatrixXd& Sensitivity::Compute(const std::vector<Eigen::Index>& outputs) {
+  const Eigen::Index n = static_cast<Eigen::Index>(circuit_.matrix_size());
+  Eigen::MatrixXd e = Eigen::MatrixXd::Zero(n, outputs.size());
+  for (size_t k = 0; k < outputs.size(); k++) {
+    if (outputs[k] < 0 || outputs[k] >= n)
+      throw std::out_of_range("sensitivity output row " + std::to_string(outputs[k]));
+    e(outputs[k], k) = 1.0;
+  }
+  x_ = circuit_.SolveCircuit();
+  // all outputs in one multi right hand side solve
+  Eigen::MatrixXd lambda = circuit_.SolveAdjoint(e);
+
+  // d output / d parameter, one pass over the stamps for every output at once
+  const int* rows = circuit_.A().innerIndexPtr();
+  const Eigen::Index outputs_count = static_cast<Eigen::Index>(outputs.size());
+  derivatives_.setZero(circuit_.component_count(), outputs_count);
+  circuit_.stamp_map().ForEachStamp([&](bool in_b, int index, int component, double coefficient) {
+    if (in_b) {
+      derivatives_.row(component) += coefficient * lambda.row(index);
+    } else {
+      derivatives_.row(component) -= (coefficient * x_(column_[index])) * lambda.row(rows[index]);
+    }
+  });
+  // chain rule to the value, resistors are stamped by conductance 1 / R
+  const auto& components = circuit_.components();
+  for (size_t c = 0; c < components.size(); c++) {
+    if (components[c].type() == 'R') {
+      double g = components[c].parameter();
+      derivatives_.row(c) *= -g * g;
+    }
+  }
+  return derivatives_;
+}
+
+inline std::vector<Sensitivity::Entry> Sensitivity::Ranked(size_t k, size_t limit) const {
+  const auto& components = circuit_.components();
+  std::vector<Entry> ranked(components.size());
+  for (size_t c = 0; c < components.size(); c++) {
+    double derivative = derivatives_(c, k);
+    ranked[c] = { c, derivative, derivative * components[c].value() };
+  }
+  size_t count = limit ? std::min(limit, ranked.size()) : ranked.size();
+  auto larger = [](const Entry& a, const Entry& b) {
+    return std::abs(a.normalized) > std::abs(b.normalized);
+  };
+  std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(), larger);
+  ranked.resize(count);
+  return ranked;
+}
+
+#endif // !Sensitivity_h
@@ -0,0 +1,474 @@
+// Factorization backends for the MNA system behind one interface.
+// SparseLU is Eigen's column LU and the default, Multifrontal groups columns
+// into dense supernodes (see Multifrontal.h) and is much faster on 2D/3D
+// meshes, Btf is a KLU style LU for very sparse, reducible circuit matrices
+// that refactors new values with the old pivots (see Btf.h), Dense is a
+// partial pivoting LU for small systems. UmfPack, SuperLU
+// and KLU go through Eigen's support modules and are only compiled in when
+// CMake finds the libraries (CIRCUIT_HAS_UMFPACK / _SUPERLU / _KLU).
+//
+// Precision::kMixed factors in float, which halves the factor's memory traffic
+// and doubles the SIMD width, then recovers double accuracy by iterative
+// refinement against the double A. A float factorization that fails or a
+// refinement that stalls falls back to a double factorization.
+// Solver.h
+
+#include "Btf.h"
+#include "Multifrontal.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Sparse>
+#ifdef CIRCUIT_HAS_UMFPACK
+#include <eigen-3.4.0/Eigen/UmfPackSupport>
+#endif
+#ifdef CIRCUIT_HAS_SUPERLU
+#include <eigen-3.4.0/Eigen/SuperLUSupport>
+#endif
+#ifdef CIRCUIT_HAS_KLU
+#include <eigen-3.4.0/Eigen/KLUSupport>
+#endif
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifndef Solver_h
+#define Solver_h
+
+enum class SolverKind { kSparseLU, kMultifrontal, kBtf, kDense, kUmfPack, kSuperLU, kKLU, kCount };
+
+inline const char* SolverName(SolverKind kind) {
+  static const char* names[] = { "sparselu", "multifrontal", "btf", "dense", "umfpack", "superlu", "klu" };
+  return names[static_cast<int>(kind)];
+}
+
+// false for the external backends this build was configured without
+inline bool SolverAvailable(SolverKind kind) {
+  switch (kind) {
+    case SolverKind::kSparseLU:
+    case SolverKind::kMultifrontal:
+    case SolverKind::kBtf:
+    case SolverKind::kDense:
+      return true;
+#ifdef CIRCUIT_HAS_UMFPACK
+    case SolverKind::kUmfPack:
+      return true;
+#endif
+#ifdef CIRCUIT_HAS_SUPERLU
+    case SolverKind::kSuperLU:
+      return true;
+#endif
+#ifdef CIRCUIT_HAS_KLU
+    case SolverKind::kKLU:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+enum class Precision { kDouble, kMixed };
+
+inline const char* PrecisionName(Precision precision) {
+  return precision == Precision::kMixed ? "mixed" : "double";
+}
+
+inline Precision ParsePrecision(std::string_view name) {
+  if (name == "double")
+    return Precision::kDouble;
+  if (name == "mixed")
+    return Precision::kMixed;
+  throw std::runtime_error("unknown precision " + std::string(name));
+}
+
+// Outcome of the last SolveRefined
+struct RefinementStats {
+  size_t steps = 0;            // refinement corrections applied
+  double residual = 0.0;       // ||b - A x||
+  double backward_error = 0.0; // ||b - A x|| / (||A|| ||x|| + ||b||)
+  bool fell_back = false;      // float refinement stalled, solved in double
+};
+
+// Kind for a SolverName, throws for unknown or unavailable names
+inline SolverKind ParseSolverKind(std::string_view name) {
+  for (int i = 0; i < static_cast<int>(SolverKind::kCount); i++) {
+    auto kind = static_cast<SolverKind>(i);
+    if (name == SolverName(kind)) {
+      if (!SolverAvailable(kind))
+        throw std::runtime_error("solver " + std::string(name) + " was not built in");
+      return kind;
+    }
+  }
+  throw std::runtime_error("unknown solver " + std::string(name));
+}
+
+// Analyze once per sparsity pattern, Factorize once per set of values, then
+// Solve any number of right hand sides against the cached factorization.
+class LinearSolver {
+public:
+  // mixed precision is available for sparselu, multifrontal and dense
+  explicit LinearSolver(SolverKind kind = SolverKind::kSparseLU,
+                        Precision precision = Precision::kDouble);
+
+  SolverKind kind() const { return kind_; }
+  Precision precision() const { return precision_; }
+  // the current factorization is in float
+  bool single() const { return single_; }
+  // backend that produced the current factorization, differs from kind()
+  // when Multifrontal hit an unstable pivot and fell back to SparseLU
+  SolverKind used() const { return used_; }
+  // Solve and SolveTransposed may run on several threads at once. The built in
+  // backends keep no scratch between solves; the external ones write their status
+  // structs on every solve, as do the Refined calls on every backend.
+  bool reentrant() const {
+    return used_ == SolverKind::kSparseLU || used_ == SolverKind::kMultifrontal || used_ == SolverKind::kBtf ||
+           used_ == SolverKind::kDense;
+  }
+  bool analyzed() const { return analyzed_; }
+  bool factored() const { return factored_; }
+  // forget the pattern (A was reassembled) or only the values (A was restamped)
+  void Reset() { analyzed_ = factored_ = false; }
+  void Invalidate() { factored_ = false; }
+
+  void Analyze(const Eigen::SparseMatrix<double>& A);
+  // Throws std::runtime_error when A is singular. Btf refactors with the
+  // previous pivot sequence when the pattern has been factorized before.
+  void Factorize(const Eigen::SparseMatrix<double>& A);
+  Eigen::MatrixXd Solve(const Eigen::MatrixXd& b) const { return SolveWith(b, false); }
+  // A^T x = b with the same factorization, for adjoint analyses.
+  // The external backends have none and throw std::runtime_error.
+  Eigen::MatrixXd SolveTransposed(const Eigen::MatrixXd& b) const { return SolveWith(b, true); }
+  // Solve, then refine a float factorization until the backward error reaches
+  // double precision. Records steps and residual in refinement().
+  Eigen::MatrixXd SolveRefined(const Eigen::SparseMatrix<double>& A, const Eigen::MatrixXd& b) {
+    return Refine(A, b, false);
+  }
+  Eigen::MatrixXd SolveTransposedRefined(const Eigen::SparseMatrix<double>& A, const Eigen::MatrixXd& b) {
+    return Refine(A, b, true);
+  }
+  const RefinementStats& refinement() const { return refinement_; }
+
+  // stored entries of the factors
+  size_t factor_nnz() const { return factor_nnz_; }
+
+private:
+  Eigen::MatrixXd SolveWith(const Eigen::MatrixXd& b, bool transposed) const;
+  Eigen::MatrixXd Refine(const Eigen::SparseMatrix<double>& A, const Eigen::MatrixXd& b, bool transposed);
+  void FactorizeSingle(const Eigen::SparseMatrix<double>& A);
+  void FactorizeDouble(const Eigen::SparseMatrix<double>& A);
+
+  SolverKind kind_, used_;
+  Precision precision_;
+  bool single_ = false;
+  RefinementStats refinement_;
+  bool analyzed_ = false, factored_ = false;
+  bool has_factors_ = false; // factorized at least once since Analyze
+  size_t factor_nnz_ = 0;
+  std::unique_ptr<Eigen::SparseLU<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int>>> sparse_lu_;
+  std::unique_ptr<MultifrontalLU> multifrontal_;
+  std::unique_ptr<BtfLU> btf_;
+  Eigen::PartialPivLU<Eigen::MatrixXd> dense_;
+  // float factorizations for Precision::kMixed
+  std::unique_ptr<Eigen::SparseLU<Eigen::SparseMatrix<float>, Eigen::COLAMDOrdering<int>>> sparse_lu_single_;
+  std::unique_ptr<BasicMultifrontalLU<float>> multifrontal_single_;
+  Eigen::PartialPivLU<Eigen::MatrixXf> dense_single_;
+#ifdef CIRCUIT_HAS_UMFPACK
+  std::unique_ptr<Eigen::UmfPackLU<Eigen::SparseMatrix<double>>> umfpack_;
+#endif
+#ifdef CIRCUIT_HAS_SUPERLU
+  std::unique_ptr<Eigen::SuperLU<Eigen::SparseMatrix<double>>> superlu_;
+#endif
+#ifdef CIRCUIT_HAS_KLU
+  std::unique_ptr<Eigen::KLU<Eigen::SparseMatrix<double>>> klu_;
+#endif
+};
+
+inline LinearSolver::LinearSolver(SolverKind kind, Precision precision) :
+    kind_(kind), used_(kind), precision_(precision) {
+  if (!SolverAvailable(kind))
+    throw std::runtime_error(std::string("solver ") + SolverName(kind) + " was not built in");
+  if (precision == Precision::kMixed && kind != SolverKind::kSparseLU &&
+      kind != SolverKind::kMultifrontal && kind != SolverKind::kDense)
+    throw std::runtime_error(std::string("solver ") + SolverName(kind) + " has no mixed precision mode");
+}
+
+inline void LinearSolver::Analyze(const Eigen::SparseMatrix<double>& A) {
+  used_ = kind_;
+  analyzed_ = factored_ = has_factors_ = false;
+  if (precision_ == Precision::kMixed) {
+    // the double backends are only analyzed if refinement ever falls back
+    sparse_lu_.reset();
+    multifrontal_.reset();
+    if (kind_ == SolverKind::kSparseLU) {
+      sparse_lu_single_.reset(new Eigen::SparseLU<Eigen::SparseMatrix<float>, Eigen::COLAMDOrdering<int>>());
+      sparse_lu_single_->analyzePattern(A.cast<float>());
+    } else if (kind_ == SolverKind::kMultifrontal) {
+      multifrontal_single_.reset(new BasicMultifrontalLU<float>());
+      multifrontal_single_->analyzePattern(A);
+    }
+    analyzed_ = true;
+    return;
+  }
+  switch (kind_) {
+    case SolverKind::kSparseLU:
+      sparse_lu_.reset(new Eigen::SparseLU<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int>>());
+      sparse_lu_->analyzePattern(A);
+      break;
+    case SolverKind::kMultifrontal:
+      multifrontal_.reset(new MultifrontalLU());
+      multifrontal_->analyzePattern(A);
+      break;
+    case SolverKind::kBtf:
+      btf_.reset(new BtfLU());
+      btf_->analyzePattern(A);
+      break;
+#ifdef CIRCUIT_HAS_UMFPACK
+    case SolverKind::kUmfPack:
+      umfpack_.reset(new Eigen::UmfPackLU<Eigen::SparseMatrix<double>>());
+      umfpack_->analyzePattern(A);
+      break;
+#endif
+#ifdef CIRCUIT_HAS_SUPERLU
+    case SolverKind::kSuperLU:
+      superlu_.reset(new Eigen::SuperLU<Eigen::SparseMatrix<double>>());
+      superlu_->analyzePattern(A);
+      break;
+#endif
+#ifdef CIRCUIT_HAS_KLU
+    case SolverKind::kKLU:
+      klu_.reset(new Eigen::KLU<Eigen::SparseMatrix<double>>());
+      klu_->analyzePattern(A);
+      break;
+#endif
+    default:
+      break;
+  }
+  analyzed_ = true;
+  factored_ = has_factors_ = false;
+}
+
+inline void LinearSolver::Factorize(const Eigen::SparseMatrix<double>& A) {
+  if (!analyzed_)
+    Analyze(A);
+  factored_ = false;
+  single_ = false;
+  if (precision_ == Precision::kMixed)
+    FactorizeSingle(A);
+  if (!single_)
+    FactorizeDouble(A);
+  factored_ = has_factors_ = true;
+}
+
+// Float factorization, leaves single_ false when it fails (too small pivots,
+// values outside the float range) so Factorize goes on in double.
+inline void LinearSolver::FactorizeSingle(const Eigen::SparseMatrix<double>& A) {
+  bool success = false;
+  switch (kind_) {
+    case SolverKind::kSparseLU:
+      sparse_lu_single_->factorize(A.cast<float>());
+      success = sparse_lu_single_->info() == Eigen::Success;
+      factor_nnz_ = sparse_lu_single_->nnzL() + sparse_lu_single_->nnzU();
+      break;
+    case SolverKind::kMultifrontal:
+      multifrontal_single_->factorize(A);
+      success = multifrontal_single_->info() == Eigen::Success;
+      factor_nnz_ = multifrontal_single_->nnz();
+      break;
+    case SolverKind::kDense:
+      dense_single_.compute(Eigen::MatrixXf(A.cast<float>()));
+      success = A.rows() == 0 || dense_single_.matrixLU().diagonal().cwiseAbs().minCoeff() > 0.0f;
+      factor_nnz_ = static_cast<size_t>(A.rows() * A.cols());
+      break;
+    default:
+      break;
+  }
+  single_ = success;
+}
+
+// Throws std::runtime_error when A is singular
+inline void LinearSolver::FactorizeDouble(const Eigen::SparseMatrix<double>& A) {
+  if (precision_ == Precision::kMixed && kind_ != SolverKind::kDense) {
+    // first double factorization of a mixed solver, nothing has been analyzed in double yet
+    if (kind_ == SolverKind::kSparseLU && !sparse_lu_) {
+      sparse_lu_.reset(new Eigen::SparseLU<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int>>());
+      sparse_lu_->analyzePattern(A);
+    } else if (kind_ == SolverKind::kMultifrontal && !multifrontal_) {
+      multifrontal_.reset(new MultifrontalLU());
+      multifrontal_->analyzePattern(A);
+    }
+  }
+  Eigen::ComputationInfo info = Eigen::Success;
+  std::string message;
+  switch (kind_) {
+    case SolverKind::kSparseLU:
+      sparse_lu_->factorize(A);
+      info = sparse_lu_->info();
+      message = sparse_lu_->lastErrorMessage();
+      factor_nnz_ = sparse_lu_->nnzL() + sparse_lu_->nnzU();
+      break;
+    case SolverKind::kMultifrontal:
+      used_ = SolverKind::kMultifrontal;
+      multifrontal_->factorize(A);
+      info = multifrontal_->info();
+      factor_nnz_ = multifrontal_->nnz();
+      if (info != Eigen::Success) {
+        // pivoting is confined to each supernode, let SparseLU pivot globally
+        used_ = SolverKind::kSparseLU;
+        sparse_lu_.reset(new Eigen::SparseLU<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int>>());
+        sparse_lu_->compute(A);
+        info = sparse_lu_->info();
+        message = sparse_lu_->lastErrorMessage();
+        factor_nnz_ = sparse_lu_->nnzL() + sparse_lu_->nnzU();
+      }
+      break;
+    case SolverKind::kBtf:
+      if (has_factors_)
+        btf_->refactorize(A);
+      else
+        btf_->factorize(A);
+      info = btf_->info();
+      message = btf_->lastErrorMessage();
+      factor_nnz_ = btf_->nnz();
+      break;
+    case SolverKind::kDense:
+      dense_.compute(Eigen::MatrixXd(A));
+      factor_nnz_ = static_cast<size_t>(A.rows() * A.cols());
+      // PartialPivLU does not report singularity, an exact zero pivot is the sign
+      if (A.rows() > 0 && dense_.matrixLU().diagonal().cwiseAbs().minCoeff() == 0.0) {
+        info = Eigen::NumericalIssue;
+        message = "zero pivot";
+      }
+      break;
+#ifdef CIRCUIT_HAS_UMFPACK
+    case SolverKind::kUmfPack:
+      umfpack_->factorize(A);
+      info = umfpack_->info();
+      factor_nnz_ = static_cast<size_t>(umfpack_->matrixL().nonZeros() + umfpack_->matrixU().nonZeros());
+      break;
+#endif
+#ifdef CIRCUIT_HAS_SUPERLU
+    case SolverKind::kSuperLU:
+      superlu_->factorize(A);
+      info = superlu_->info();
+      factor_nnz_ = 0;
+      break;
+#endif
+#ifdef CIRCUIT_HAS_KLU
+    case SolverKind::kKLU:
+      klu_->factorize(A);
+      info = klu_->info();
+      factor_nnz_ = 0;
+      break;
+#endif
+    default:
+      break;
+  }
+  if (info != Eigen::Success)
+    throw std::runtime_error("MNA matrix is singular: " + message);
+}
+
+inline Eigen::MatrixXd LinearSolver::SolveWith(const Eigen::MatrixXd& b, bool transposed) const {
+  if (!factored_)
+    throw std::logic_error("LinearSolver::Solve before Factorize");
+  if (single_) {
+    // scaled to unit max norm so small residuals do not underflow in float
+    double scale = b.size() ? b.cwiseAbs().maxCoeff() : 0.0;
+    if (scale == 0.0)
+      return Eigen::MatrixXd::Zero(b.rows(), b.cols());
+    Eigen::MatrixXf bf = (b / scale).cast<float>(), xf;
+    switch (kind_) {
+      case SolverKind::kMultifrontal:
+        return (transposed ? multifrontal_single_->solveTransposed(b / scale)
+                           : multifrontal_single_->solve(b / scale)) * scale;
+      case SolverKind::kDense:
+        if (transposed)
+          xf = dense_single_.transpose().solve(bf);
+        else
+          xf = dense_single_.solve(bf);
+        break;
+      default:
+        if (transposed)
+          xf = sparse_lu_single_->transpose().solve(bf);
+        else
+          xf = sparse_lu_single_->solve(bf);
+    }
+    return xf.cast<double>() * scale;
+  }
+  switch (used_) {
+    case SolverKind::kMultifrontal:
+      return transposed ? multifrontal_->solveTransposed(b) : multifrontal_->solve(b);
+    case SolverKind::kBtf:
+      return transposed ? btf_->solveTransposed(b) : btf_->solve(b);
+    case SolverKind::kDense:
+      return transposed ? Eigen::MatrixXd(dense_.transpose().solve(b)) : Eigen::MatrixXd(dense_.solve(b));
+#ifdef CIRCUIT_HAS_UMFPACK
+    case SolverKind::kUmfPack:
+      if (transposed)
+        break;
+      return umfpack_->solve(b);
+#endif
+#ifdef CIRCUIT_HAS_SUPERLU
+    case SolverKind::kSuperLU:
+      if (transposed)
+        break;
+      return superlu_->solve(b);
+#endif
+#ifdef CIRCUIT_HAS_KLU
+    case SolverKind::kKLU:
+      if (transposed)
+        break;
+      return klu_->solve(b);
+#endif
+    default:
+      return transposed ? Eigen::MatrixXd(sparse_lu_->transpose().solve(b))
+                        : Eigen::MatrixXd(sparse_lu_->solve(b));
+  }
+  throw std::runtime_error(std::string("solver ") + SolverName(used_) + " has no transposed solve");
+}
+
+inline Eigen::MatrixXd LinearSolver::Refine(const Eigen::SparseMatrix<double>& A,
+                                            const Eigen::MatrixXd& b, bool transposed) {
+  // stop once the backward error is a few ulps, give up when a step does not halve the residual
+  const double tolerance = 1e-14;
+  const size_t max_steps = 10;
+  refinement_ = RefinementStats();
+  const double a_norm = A.norm(), b_norm = b.norm();
+  auto backward_error = [&](const Eigen::MatrixXd& x, double residual) {
+    double scale = a_norm * x.norm() + b_norm;
+    return scale > 0.0 ? residual / scale : residual;
+  };
+  auto residual = [&](const Eigen::MatrixXd& x) -> Eigen::MatrixXd {
+    if (transposed)
+      return b - A.transpose() * x;
+    return b - A * x;
+  };
+
+  Eigen::MatrixXd x = SolveWith(b, transposed);
+  Eigen::MatrixXd r = residual(x);
+  refinement_.residual = r.norm();
+  refinement_.backward_error = backward_error(x, refinement_.residual);
+  if (!single_)
+    return x;
+
+  double previous = INFINITY;
+  while (!(refinement_.backward_error <= tolerance)) {
+    if (refinement_.steps == max_steps || !(refinement_.residual < 0.5 * previous)) {
+      FactorizeDouble(A);
+      single_ = false;
+      refinement_.fell_back = true;
+      x = SolveWith(b, transposed);
+      refinement_.residual = residual(x).norm();
+      refinement_.backward_error = backward_error(x, refinement_.residual);
+      return x;
+    }
+    previous = refinement_.residual;
+    x += SolveWith(r, transposed);
+    refinement_.steps++;
+    r = residual(x);
+    refinement_.residual = r.norm();
+    refinement_.backward_error = backward_error(x, refinement_.residual);
+  }
+  return x;
+}
+
+#endif // !Solver_h
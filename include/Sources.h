@@ -0,0 +1,211 @@
+// The source vector b(t) of a circuit with PULSE, SIN, PWL and EXP sources.
+// b(t) = b_static + S w(t): b_static holds the constant sources, w(t) the value of
+// every waveform source and S the sparse +-1 incidence of those values in b. The
+// waveforms are stored by kind as structure of arrays, so one timestep evaluates each
+// kind in a single loop over contiguous arguments and S w(t) is one sparse product,
+// instead of a switch and a scatter per source. PWL corner times of all sources share
+// one table and every PWL source keeps a cursor into it: time moves forward in a
+// transient, so each lookup advances the cursor by a step or two instead of searching.
+// Sources.h
+
+#include "Circuit.h"
+#include "Waveform.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#ifndef Sources_h
+#define Sources_h
+
+class SourceTable {
+public:
+  // circuit must be assembled
+  explicit SourceTable(const Circuit& circuit);
+
+  // waveform sources, in the order of circuit.waveforms()
+  size_t size() const { return static_cast<size_t>(incidence_.cols()); }
+  bool empty() const { return size() == 0; }
+  const Eigen::VectorXd& constant() const { return constant_; }
+  // S, the rows source s adds its value to
+  const Eigen::SparseMatrix<double>& incidence() const { return incidence_; }
+
+  // w(t), one value per waveform source. Not thread safe, the PWL cursors move.
+  void Values(double t, double* values);
+  // b(t), sized to the MNA system
+  void Fill(double t, Eigen::VectorXd& b);
+  // sorted corner times of every waveform in (start, stop]
+  std::vector<double> Breakpoints(double start, double stop) const;
+
+private:
+  struct Sines {
+    std::vector<size_t> slot;
+    std::vector<double> offset, amplitude, omega, delay, damping, phase;
+  };
+  struct Pulses {
+    std::vector<size_t> slot;
+    std::vector<double> low, high, delay, rise, fall, width, period;
+  };
+  struct Exponentials {
+    std::vector<size_t> slot;
+    std::vector<double> low, high, delay1, tau1, delay2, tau2;
+  };
+  struct PiecewiseLinear {
+    std::vector<size_t> slot, begin, end, cursor; // [begin, end) in times and values
+    std::vector<double> times, values;
+  };
+
+  std::vector<Waveform> waveforms_;
+  Sines sin_;
+  Pulses pulse_;
+  Exponentials exp_;
+  PiecewiseLinear pwl_;
+  Eigen::VectorXd constant_, values_;
+  Eigen::SparseMatrix<double> incidence_;
+};
+
+inline SourceTable::SourceTable(const Circuit& circuit) {
+  const auto& components = circuit.components();
+  const Eigen::Index n = static_cast<Eigen::Index>(circuit.matrix_size());
+  const int ground_rows = static_cast<int>(circuit.nodes_count()) - 1;
+  std::vector<Eigen::Triplet<double>> triplets;
+  constant_ = circuit.b();
+  for (auto& source : circuit.waveforms()) {
+    const size_t slot = waveforms_.size();
+    const Component& component = components[source.component];
+    waveforms_.push_back(source.waveform);
+    // the rows StampComponent gives the constant value
+    if (component.type() == 'V') {
+      triplets.emplace_back(ground_rows + component.branch(), static_cast<int>(slot), 1.0);
+    } else {
+      if (component.p_index() > 0)
+        triplets.emplace_back(component.p_index() - 1, static_cast<int>(slot), -1.0);
+      if (component.n_index() > 0)
+        triplets.emplace_back(component.n_index() - 1, static_cast<int>(slot), 1.0);
+    }
+
+    const std::vector<double>& a = source.waveform.arguments();
+    switch (source.waveform.kind()) {
+      case WaveformKind::kSin:
+        sin_.slot.push_back(slot);
+        sin_.offset.push_back(a[0]);
+        sin_.amplitude.push_back(a[1]);
+        sin_.omega.push_back(2.0 * kWaveformPi * a[2]);
+        sin_.delay.push_back(a[3]);
+        sin_.damping.push_back(a[4]);
+        sin_.phase.push_back(a[5] * kWaveformPi / 180.0);
+        break;
+      case WaveformKind::kPulse:
+        pulse_.slot.push_back(slot);
+        pulse_.low.push_back(a[0]);
+        pulse_.high.push_back(a[1]);
+        pulse_.delay.push_back(a[2]);
+        pulse_.rise.push_back(a[3]);
+        pulse_.fall.push_back(a[4]);
+        pulse_.width.push_back(a[5]);
+        pulse_.period.push_back(a[6]);
+        break;
+      case WaveformKind::kExp:
+        exp_.slot.push_back(slot);
+        exp_.low.push_back(a[0]);
+        exp_.high.push_back(a[1]);
+        exp_.delay1.push_back(a[2]);
+        exp_.tau1.push_back(a[3]);
+        exp_.delay2.push_back(a[4]);
+        exp_.tau2.push_back(a[5]);
+        break;
+      case WaveformKind::kPwl:
+        pwl_.slot.push_back(slot);
+        pwl_.begin.push_back(pwl_.times.size());
+        pwl_.cursor.push_back(pwl_.times.size());
+        for (size_t i = 0; i < a.size(); i += 2) {
+          pwl_.times.push_back(a[i]);
+          pwl_.values.push_back(a[i + 1]);
+        }
+        pwl_.end.push_back(pwl_.times.size());
+        break;
+    }
+  }
+  incidence_.resize(n, static_cast<Eigen::Index>(waveforms_.size()));
+  incidence_.setFromTriplets(triplets.begin(), triplets.end());
+  // component values are the waveforms at t = 0, take them back out of b
+  values_.resize(static_cast<Eigen::Index>(waveforms_.size()));
+  for (size_t s = 0; s < waveforms_.size(); s++)
+    values_(static_cast<Eigen::Index>(s)) = components[circuit.waveforms()[s].component].value();
+  constant_ -= incidence_ * values_;
+}
+
+inline void SourceTable::Values(double t, double* values) {
+  for (size_t i = 0; i < sin_.slot.size(); i++) {
+    double tt = std::max(t - sin_.delay[i], 0.0);
+    values[sin_.slot[i]] = sin_.offset[i] + sin_.amplitude[i] * std::exp(-sin_.damping[i] * tt) *
+                                                std::sin(sin_.omega[i] * tt + sin_.phase[i]);
+  }
+  for (size_t i = 0; i < pulse_.slot.size(); i++) {
+    double value = pulse_.low[i];
+    if (t >= pulse_.delay[i]) {
+      double tt = t - pulse_.delay[i];
+      if (std::isfinite(pulse_.period[i]))
+        tt = std::fmod(tt, pulse_.period[i]);
+      const double high = pulse_.high[i], low = pulse_.low[i];
+      const double top = pulse_.rise[i], bottom = top + pulse_.width[i], end = bottom + pulse_.fall[i];
+      value = tt < top ? low + (high - low) * tt / pulse_.rise[i]
+            : tt < bottom ? high
+            : tt < end ? high + (low - high) * (tt - bottom) / pulse_.fall[i]
+            : low;
+    }
+    values[pulse_.slot[i]] = value;
+  }
+  for (size_t i = 0; i < exp_.slot.size(); i++) {
+    double value = exp_.low[i];
+    const double swing = exp_.high[i] - exp_.low[i];
+    if (t > exp_.delay1[i])
+      value += swing * (exp_.tau1[i] > 0.0 ? 1.0 - std::exp(-(t - exp_.delay1[i]) / exp_.tau1[i]) : 1.0);
+    if (t > exp_.delay2[i])
+      value -= swing * (exp_.tau2[i] > 0.0 ? 1.0 - std::exp(-(t - exp_.delay2[i]) / exp_.tau2[i]) : 1.0);
+    values[exp_.slot[i]] = value;
+  }
+  for (size_t i = 0; i < pwl_.slot.size(); i++) {
+    const double* times = pwl_.times.data();
+    const size_t begin = pwl_.begin[i], last = pwl_.end[i] - 1;
+    size_t& k = pwl_.cursor[i];
+    // k is the segment start, times[k] <= t < times[k + 1]. Going back in time
+    // (a new run) searches again.
+    if (t < times[k]) {
+      size_t found = static_cast<size_t>(std::upper_bound(times + begin, times + last + 1, t) - times);
+      k = found > begin ? found - 1 : begin;
+    }
+    while (k < last && times[k + 1] <= t)
+      k++;
+    double value;
+    if (k == last || t <= times[begin]) {
+      value = pwl_.values[k];
+    } else {
+      double f = (t - times[k]) / (times[k + 1] - times[k]);
+      value = pwl_.values[k] + f * (pwl_.values[k + 1] - pwl_.values[k]);
+    }
+    values[pwl_.slot[i]] = value;
+  }
+}
+
+inline void SourceTable::Fill(double t, Eigen::VectorXd& b) {
+  if (empty()) {
+    b = constant_;
+    return;
+  }
+  Values(t, values_.data());
+  b = constant_;
+  b += incidence_ * values_;
+}
+
+inline std::vector<double> SourceTable::Breakpoints(double start, double stop) const {
+  std::vector<double> times;
+  for (auto& i : waveforms_)
+    i.Breakpoints(start, stop, times);
+  std::sort(times.begin(), times.end());
+  times.erase(std::unique(times.begin(), times.end()), times.end());
+  return times;
+}
+
+#endif // !Sources_h
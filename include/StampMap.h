@@ -0,0 +1,140 @@
+// Stamp to nonzero map for value-only reassembly.
+// Every MNA stamp is affine in its component's parameter (conductance for
+// resistors, the value itself for everything else), so once the sparsity
+// pattern is fixed an entry is base + coefficient * parameter. Recording the
+// value array offset and coefficient of each stamp turns reassembly into one
+// flat scatter loop with no searching or branching.
+// StampMap.h
+
+#include "Components.h"
+#include "Parallel.h"
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#ifndef StampMap_h
+#define StampMap_h
+
+class StampMap {
+public:
+  // Records the stamps of every component against the pattern of A.
+  // stamp(component, add_a, add_b) must be Circuit::StampComponent or equivalent.
+  template <class Stamp>
+  void Build(const ComponentList& components, const Eigen::SparseMatrix<double>& A,
+             size_t threads, Stamp&& stamp);
+
+  // parameters[i] for component i, the value each stamp coefficient multiplies
+  void Parameters(const ComponentList& components, double* parameters) const;
+  // Writes A's value array (nonzeros long) and b (rows long) for the given parameters.
+  // Const and allocation free, so several threads can reassemble private copies at once.
+  void Scatter(const double* parameters, double* a_values, double* b) const;
+  // visit(in_b, index, component, coefficient) for every parameter dependent stamp,
+  // for callers that update the entries of a few components incrementally
+  template <class Visit>
+  void ForEachStamp(Visit&& visit) const;
+
+  bool empty() const { return a_base_.empty() && b_base_.empty(); }
+  void clear() { *this = StampMap(); }
+  size_t stamp_count() const { return a_entries_.size() + b_entries_.size(); }
+  // bytes read and written by one Scatter, for bandwidth figures
+  size_t bytes_touched() const {
+    return stamp_count() * (sizeof(Entry) + 2 * sizeof(double)) +
+           (a_base_.size() + b_base_.size()) * 2 * sizeof(double);
+  }
+
+private:
+  struct Entry {
+    int index;     // offset into A's value array or b
+    int component; // parameter index
+    double coefficient;
+  };
+
+  std::vector<Entry> a_entries_, b_entries_;
+  // value independent part of every entry (V and L incidence ones)
+  std::vector<double> a_base_, b_base_;
+};
+
+template <class Stamp>
+void StampMap::Build(const ComponentList& components, const Eigen::SparseMatrix<double>& A,
+                     size_t threads, Stamp&& stamp) {
+  clear();
+  a_base_.assign(A.nonZeros(), 0.0);
+  b_base_.assign(A.rows(), 0.0);
+  const int* outer = A.outerIndexPtr();
+  const int* inner = A.innerIndexPtr();
+  auto offset = [outer, inner](int row, int col) {
+    const int* first = inner + outer[col];
+    const int* last = inner + outer[col + 1];
+    const int* found = std::lower_bound(first, last, row);
+    if (found == last || *found != row)
+      throw std::logic_error("stamp outside the assembled pattern");
+    return static_cast<int>(found - inner);
+  };
+
+  threads = std::max<size_t>(1, std::min(threads, components.size() / 4096));
+  std::vector<std::vector<Entry>> local_a(threads), local_b(threads);
+  std::vector<std::vector<std::pair<int, double>>> local_base_a(threads), local_base_b(threads);
+  ParallelFor(threads, [&](size_t t) {
+    auto range = ChunkRange(components.size(), threads, t);
+    std::vector<std::pair<int, double>> zero_a, zero_b, unit_a, unit_b;
+    for (size_t i = range.first; i < range.second; i++) {
+      // stamp at parameter 0 and 1: the difference is the coefficient, the first the base
+      Component zero = components[i], unit = components[i];
+      zero.set_parameter(0.0);
+      unit.set_parameter(1.0);
+      zero_a.clear(), zero_b.clear(), unit_a.clear(), unit_b.clear();
+      stamp(zero, [&](int row, int col, double value) { zero_a.push_back({ offset(row, col), value }); },
+                  [&](int row, double value) { zero_b.push_back({ row, value }); });
+      stamp(unit, [&](int row, int col, double value) { unit_a.push_back({ offset(row, col), value }); },
+                  [&](int row, double value) { unit_b.push_back({ row, value }); });
+      for (size_t k = 0; k < unit_a.size(); k++) {
+        if (zero_a[k].second != 0.0)
+          local_base_a[t].push_back(zero_a[k]);
+        if (unit_a[k].second != zero_a[k].second)
+          local_a[t].push_back({ unit_a[k].first, static_cast<int>(i),
+                                 unit_a[k].second - zero_a[k].second });
+      }
+      for (size_t k = 0; k < unit_b.size(); k++) {
+        if (zero_b[k].second != 0.0)
+          local_base_b[t].push_back(zero_b[k]);
+        if (unit_b[k].second != zero_b[k].second)
+          local_b[t].push_back({ unit_b[k].first, static_cast<int>(i),
+                                 unit_b[k].second - zero_b[k].second });
+      }
+    }
+  });
+  for (size_t t = 0; t < threads; t++) {
+    a_entries_.insert(a_entries_.end(), local_a[t].begin(), local_a[t].end());
+    b_entries_.insert(b_entries_.end(), local_b[t].begin(), local_b[t].end());
+    for (auto& i : local_base_a[t])
+      a_base_[i.first] += i.second;
+    for (auto& i : local_base_b[t])
+      b_base_[i.first] += i.second;
+  }
+}
+
+inline void StampMap::Parameters(const ComponentList& components, double* parameters) const {
+  for (size_t i = 0; i < components.size(); i++)
+    parameters[i] = components[i].parameter();
+}
+
+inline void StampMap::Scatter(const double* parameters, double* a_values, double* b) const {
+  std::memcpy(a_values, a_base_.data(), a_base_.size() * sizeof(double));
+  std::memcpy(b, b_base_.data(), b_base_.size() * sizeof(double));
+  for (auto& i : a_entries_)
+    a_values[i.index] += i.coefficient * parameters[i.component];
+  for (auto& i : b_entries_)
+    b[i.index] += i.coefficient * parameters[i.component];
+}
+
+template <class Visit>
+void StampMap::ForEachStamp(Visit&& visit) const {
+  for (auto& i : a_entries_)
+    visit(false, i.index, i.component, i.coefficient);
+  for (auto& i : b_entries_)
+    visit(true, i.index, i.component, i.coefficient);
+}
+
+#endif // !StampMap_h
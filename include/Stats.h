@@ -0,0 +1,122 @@
+// Opt-in phase timing and counters for Circuit.
+// Build with CIRCUIT_STATS defined to record, otherwise the
+// CIRCUIT_PHASE / CIRCUIT_COUNT macros expand to nothing.
+// Stats.h
+
+#include <chrono>
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef Stats_h
+#define Stats_h
+
+enum class Phase { kParse, kIntern, kAssemble, kOrder, kFactor, kSolve, kOutput, kCount };
+
+inline const char* PhaseName(Phase phase) {
+  static const char* names[] = { "parse", "intern", "assemble", "order",
+                                 "factor", "solve", "output" };
+  return names[static_cast<int>(phase)];
+}
+
+struct PhaseStats {
+  double seconds = 0.0;
+  size_t calls = 0;
+};
+
+struct CircuitStats {
+  PhaseStats phases[static_cast<int>(Phase::kCount)];
+  size_t bytes_allocated = 0; // bytes allocated for matrices and buffers outside the arenas
+  size_t arena_bytes = 0;     // bytes currently reserved by the circuit's arenas
+  size_t arena_chunks = 0;    // chunks currently reserved by the circuit's arenas
+  size_t matrix_nnz = 0;      // nonzeros in A
+  size_t factor_nnz = 0;      // nonzeros in the factorization of A
+  size_t fill_in = 0;         // factor_nnz - matrix_nnz, 0 if the factor is sparser
+  size_t iterations = 0;      // refinement / iterative solver steps
+
+  // every timed scope in order, for the Chrome trace
+  struct Event {
+    Phase phase;
+    double start, seconds;
+  };
+  std::vector<Event> events;
+
+  const PhaseStats& operator[](Phase phase) const { return phases[static_cast<int>(phase)]; }
+  void clear() { *this = CircuitStats(); }
+  std::string json() const;
+  // chrome://tracing / Perfetto "traceEvents" format
+  std::string chrome_trace() const;
+};
+
+// Seconds since the first call, shared so trace events line up across circuits
+inline double StatsClock() {
+  static const auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+// Adds the lifetime of the scope to one phase
+class ScopedPhase {
+public:
+  ScopedPhase(CircuitStats& stats, Phase phase) :
+      stats_(stats), phase_(phase), start_(StatsClock()) {}
+  ~ScopedPhase() {
+    double seconds = StatsClock() - start_;
+    auto& phase = stats_.phases[static_cast<int>(phase_)];
+    phase.seconds += seconds;
+    phase.calls++;
+    stats_.events.push_back({ phase_, start_, seconds });
+  }
+
+private:
+  CircuitStats& stats_;
+  Phase phase_;
+  double start_;
+};
+
+#ifdef CIRCUIT_STATS
+#define CIRCUIT_STATS_CONCAT_(a, b) a##b
+#define CIRCUIT_STATS_CONCAT(a, b) CIRCUIT_STATS_CONCAT_(a, b)
+#define CIRCUIT_PHASE(stats, phase) \
+  ScopedPhase CIRCUIT_STATS_CONCAT(circuit_phase_, __LINE__)((stats), (phase))
+#define CIRCUIT_COUNT(statement) do { statement; } while (0)
+#else
+#define CIRCUIT_PHASE(stats, phase)
+#define CIRCUIT_COUNT(statement) do {} while (0)
+#endif
+
+inline std::string CircuitStats::json() const {
+  std::ostringstream os;
+  os.precision(9);
+  os << "{\n  \"phases\": {";
+  for (int i = 0; i < static_cast<int>(Phase::kCount); i++) {
+    os << (i ? ",\n" : "\n") << "    \"" << PhaseName(static_cast<Phase>(i))
+       << "\": { \"seconds\": " << phases[i].seconds << ", \"calls\": " << phases[i].calls << " }";
+  }
+  os << "\n  },\n"
+     << "  \"bytes_allocated\": " << bytes_allocated << ",\n"
+     << "  \"arena_bytes\": " << arena_bytes << ",\n"
+     << "  \"arena_chunks\": " << arena_chunks << ",\n"
+     << "  \"matrix_nnz\": " << matrix_nnz << ",\n"
+     << "  \"factor_nnz\": " << factor_nnz << ",\n"
+     << "  \"fill_in\": " << fill_in << ",\n"
+     << "  \"iterations\": " << iterations << "\n}\n";
+  return os.str();
+}
+
+inline std::string CircuitStats::chrome_trace() const {
+  std::ostringstream os;
+  // microseconds with nanosecond resolution
+  os << std::fixed;
+  os.precision(3);
+  os << "{ \"traceEvents\": [";
+  for (size_t i = 0; i < events.size(); i++) {
+    os << (i ? ",\n" : "\n") << "  { \"name\": \"" << PhaseName(events[i].phase)
+       << "\", \"cat\": \"circuit\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": "
+       << events[i].start * 1e6 << ", \"dur\": " << events[i].seconds * 1e6 << " }";
+  }
+  os << "\n], \"displayTimeUnit\": \"ms\" }\n";
+  return os.str();
+}
+
+#endif // !Stats_h
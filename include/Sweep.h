@@ -0,0 +1,263 @@
+// Parametric sweep over the `.step` lines of a circuit.
+// Steps are the cartesian product of the step lists, the last .step line varying
+// fastest. A dependency graph from swept parameters through derived parameters to
+// component values decides what a step recomputes: when a step only changes the
+// innermost parameter, only the values that depend on it are evaluated and only
+// their stamps are updated, by the change in parameter, in private copies of A and b.
+// The pattern and stamp map of the circuit are shared and every worker analyzes the
+// pattern once, so a step costs one numeric factorization and one solve.
+// Sweep.h
+
+#include "Circuit.h"
+#include "Parallel.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef Sweep_h
+#define Sweep_h
+
+class Sweep {
+public:
+  // sink(step, values, x): values[d] is the value of .step line d in this step.
+  // Called in step order, from one thread at a time.
+  using Sink = std::function<void(size_t, const double*, const Eigen::VectorXd&)>;
+
+  // circuit must be assembled, its stamp map is built here if it is empty
+  explicit Sweep(Circuit& circuit);
+
+  size_t step_count() const { return step_count_; }
+  size_t dimension_count() const { return dimensions_.size(); }
+  const std::string& parameter_name(size_t d) const {
+    return circuit_.params().name(dimensions_[d].parameter);
+  }
+  // value of .step line d in step
+  double value(size_t step, size_t d) const;
+  // component values recomputed when .step line d (and the ones after it) change
+  size_t affected_count(size_t d) const { return plans_[d].expressions.size(); }
+
+  // Solves every step with threads workers (0 = the circuit's threads()), throws the
+  // first failure with its step number, counted from 1, after the running steps finish
+  void Run(const Sink& sink, size_t threads = 0) const;
+
+private:
+  struct Dimension {
+    int parameter;
+    const std::vector<double>* values;
+    size_t stride; // steps between changes of this dimension
+  };
+  struct Entry {
+    int index;
+    int slot; // position in Plan::expressions
+    double coefficient;
+  };
+  // what changing dimensions d.. recomputes
+  struct Plan {
+    std::vector<int> parameters;     // derived, in evaluation order
+    std::vector<size_t> expressions; // into circuit value_expressions()
+    std::vector<Entry> a_entries, b_entries;
+  };
+  struct Worker;
+
+  static constexpr size_t kBlock = 16;
+
+  void Start(Worker& worker, size_t step) const;
+  void Advance(Worker& worker, size_t step) const;
+
+  const Circuit& circuit_;
+  std::vector<Dimension> dimensions_;
+  std::vector<Plan> plans_;
+  std::vector<int> derived_; // every non swept parameter, in evaluation order
+  size_t step_count_;
+};
+
+// per thread copies of everything a step writes
+struct Sweep::Worker {
+  Eigen::SparseMatrix<double> A;
+  Eigen::VectorXd b;
+  std::vector<double> parameters; // .param values
+  std::vector<double> stamp;      // stamp parameter of every component
+  std::vector<double> delta;      // per plan slot
+  LinearSolver solver;
+};
+
+inline Sweep::Sweep(Circuit& circuit) : circuit_(circuit), step_count_(1) {
+  if (circuit.A().nonZeros() == 0 && circuit.matrix_size() > 0)
+    throw std::logic_error("Sweep needs an assembled circuit");
+  if (circuit.stamp_map().empty())
+    circuit.BuildStampMap();
+
+  const auto& params = circuit.params();
+  const auto& steps = circuit.steps();
+  std::vector<char> swept(params.size(), 0);
+  for (auto& i : steps) {
+    dimensions_.push_back({ i.parameter, &i.values, 0 });
+    swept[i.parameter] = 1;
+  }
+  for (size_t d = dimensions_.size(); d-- > 0;) {
+    dimensions_[d].stride = step_count_;
+    step_count_ *= dimensions_[d].values->size();
+  }
+  for (int p : params.order()) {
+    if (!swept[p])
+      derived_.push_back(p);
+  }
+
+  // component expression indices by component, to collect stamps per plan
+  const auto& expressions = circuit.value_expressions();
+  std::vector<int> slot(circuit.component_count());
+  plans_.resize(dimensions_.size());
+  for (size_t d = 0; d < dimensions_.size(); d++) {
+    auto& plan = plans_[d];
+    // parameters reached from the swept ones d.., one pass in dependency order
+    std::vector<char> affected(params.size(), 0);
+    for (size_t e = d; e < dimensions_.size(); e++)
+      affected[dimensions_[e].parameter] = 1;
+    for (int p : derived_) {
+      for (int q : params.expression(p).dependencies()) {
+        if (affected[q]) {
+          affected[p] = 1;
+          plan.parameters.push_back(p);
+          break;
+        }
+      }
+    }
+    std::fill(slot.begin(), slot.end(), -1);
+    for (size_t e = 0; e < expressions.size(); e++) {
+      for (int q : expressions[e].expression.dependencies()) {
+        if (affected[q]) {
+          slot[expressions[e].component] = static_cast<int>(plan.expressions.size());
+          plan.expressions.push_back(e);
+          break;
+        }
+      }
+    }
+    circuit.stamp_map().ForEachStamp([&](bool in_b, int index, int component, double coefficient) {
+      if (slot[component] >= 0)
+        (in_b ? plan.b_entries : plan.a_entries).push_back({ index, slot[component], coefficient });
+    });
+  }
+}
+
+inline double Sweep::value(size_t step, size_t d) const {
+  auto& dimension = dimensions_[d];
+  return (*dimension.values)[step / dimension.stride % dimension.values->size()];
+}
+
+// stamp parameter of a component for a new value, see Component::parameter
+inline double StampParameter(const Component& component, double value) {
+  return component.type() == 'R' ? 1.0 / value : value;
+}
+
+// Full evaluation at the first step of a block
+inline void Sweep::Start(Worker& worker, size_t step) const {
+  for (size_t d = 0; d < dimensions_.size(); d++)
+    worker.parameters[dimensions_[d].parameter] = value(step, d);
+  for (int p : derived_)
+    worker.parameters[p] = circuit_.params().expression(p).Evaluate(worker.parameters.data());
+  for (auto& i : circuit_.value_expressions()) {
+    worker.stamp[i.component] = StampParameter(circuit_.components()[i.component],
+                                               i.expression.Evaluate(worker.parameters.data()));
+  }
+  circuit_.stamp_map().Scatter(worker.stamp.data(), worker.A.valuePtr(), worker.b.data());
+}
+
+// Incremental update from step - 1, only the outermost changed dimension's plan runs
+inline void Sweep::Advance(Worker& worker, size_t step) const {
+  size_t d = 0;
+  while (d + 1 < dimensions_.size() && step % dimensions_[d].stride != 0)
+    d++;
+  for (size_t e = d; e < dimensions_.size(); e++)
+    worker.parameters[dimensions_[e].parameter] = value(step, e);
+  auto& plan = plans_[d];
+  for (int p : plan.parameters)
+    worker.parameters[p] = circuit_.params().expression(p).Evaluate(worker.parameters.data());
+  const auto& expressions = circuit_.value_expressions();
+  for (size_t s = 0; s < plan.expressions.size(); s++) {
+    auto& i = expressions[plan.expressions[s]];
+    double parameter = StampParameter(circuit_.components()[i.component],
+                                      i.expression.Evaluate(worker.parameters.data()));
+    worker.delta[s] = parameter - worker.stamp[i.component];
+    worker.stamp[i.component] = parameter;
+  }
+  double* a_values = worker.A.valuePtr();
+  for (auto& i : plan.a_entries)
+    a_values[i.index] += i.coefficient * worker.delta[i.slot];
+  for (auto& i : plan.b_entries)
+    worker.b[i.index] += i.coefficient * worker.delta[i.slot];
+}
+
+inline void Sweep::Run(const Sink& sink, size_t threads) const {
+  if (!circuit_.valid())
+    throw std::runtime_error("circuit topology is invalid");
+  size_t blocks = (step_count_ + kBlock - 1) / kBlock;
+  threads = std::min(threads ? threads : circuit_.threads(), blocks);
+
+  // blocks are handed out in order and results are released in order,
+  // so at most a few blocks per thread wait in pending
+  std::atomic<size_t> next_block(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex mutex;
+  size_t next_step = 0;
+  std::map<size_t, std::pair<std::vector<double>, Eigen::VectorXd>> pending;
+
+  ParallelFor(threads, [&](size_t) {
+    Worker worker{ circuit_.A(), circuit_.b(), {}, {}, {},
+                   LinearSolver(circuit_.solver(), circuit_.precision()) };
+    worker.parameters.assign(circuit_.params().values(),
+                             circuit_.params().values() + circuit_.params().size());
+    worker.stamp.resize(circuit_.component_count());
+    circuit_.stamp_map().Parameters(circuit_.components(), worker.stamp.data());
+    size_t slots = 0;
+    for (auto& i : plans_)
+      slots = std::max(slots, i.expressions.size());
+    worker.delta.resize(slots);
+    std::vector<double> values(dimensions_.size());
+
+    size_t step = 0;
+    try {
+      for (size_t block; !failed && (block = next_block++) < blocks;) {
+        size_t end = std::min(step_count_, (block + 1) * kBlock);
+        for (step = block * kBlock; step < end && !failed; step++) {
+          if (step == block * kBlock)
+            Start(worker, step);
+          else
+            Advance(worker, step);
+          if (!worker.solver.analyzed())
+            worker.solver.Analyze(worker.A);
+          worker.solver.Factorize(worker.A);
+          Eigen::VectorXd x = worker.solver.SolveRefined(worker.A, worker.b);
+          if (!(worker.solver.refinement().backward_error <= 1e-9)) {
+            throw std::runtime_error("MNA matrix is numerically singular: residual " +
+                                     std::to_string(worker.solver.refinement().residual));
+          }
+          for (size_t d = 0; d < dimensions_.size(); d++)
+            values[d] = worker.parameters[dimensions_[d].parameter];
+
+          std::lock_guard<std::mutex> lock(mutex);
+          pending.emplace(step, std::make_pair(values, std::move(x)));
+          for (auto i = pending.begin(); i != pending.end() && i->first == next_step;
+               i = pending.erase(i), next_step++)
+            sink(i->first, i->second.first.data(), i->second.second);
+        }
+      }
+    } catch (const std::exception& e) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!failed.exchange(true))
+        error = std::make_exception_ptr(std::runtime_error("step " + std::to_string(step + 1) + ": " + e.what()));
+    }
+  });
+  if (error)
+    std::rethrow_exception(error);
+}
+
+#endif // !Sweep_h
@@ -0,0 +1,110 @@
+// Thevenin and Norton equivalents of the DC circuit seen between node pairs.
+// The open circuit voltage of a port (p, n) is v(p) - v(n) of the DC solution, and its
+// driving point resistance is the voltage a unit current into p and out of n raises
+// across it with the sources off: z(p) - z(n) with A z = e_p - e_n. Both reuse the
+// factorization SolveCircuit keeps, so a port costs one solve against it. Ports are
+// taken kBlock at a time as one multiple right hand side solve, and the blocks are
+// spread over threads, which share the factorization read only through the const
+// Solve, each with its own right hand sides and refinement. Backends whose solves
+// are not reentrant (LinearSolver::reentrant) take the blocks on one thread.
+// Thevenin.h
+
+#include "Circuit.h"
+#include "Parallel.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifndef Thevenin_h
+#define Thevenin_h
+
+struct TheveninEquivalent {
+  double voltage;    // open circuit, v(p) - v(n)
+  double resistance; // driving point
+  // Norton current, p to n through a short, infinite for a port across a V source
+  double current() const { return voltage / resistance; }
+};
+
+// Node indices of a port, throws std::runtime_error for unknown names
+inline std::pair<int, int> PortNodes(const Circuit& circuit, std::string_view p, std::string_view n) {
+  auto index = [&](std::string_view node) {
+    auto found = circuit.nodes().find(node);
+    if (found == circuit.nodes().end())
+      throw std::runtime_error("no node named \"" + std::string(node) + '"');
+    return found->second;
+  };
+  return { index(p), index(n) };
+}
+
+class Thevenin {
+public:
+  // circuit must be assembled, it is solved here
+  explicit Thevenin(const Circuit& circuit);
+
+  // the DC solution the open circuit voltages come from
+  const Eigen::VectorXd& x() const { return x_; }
+  // one equivalent per (p, n) node index pair, threads 0 = the circuit's
+  std::vector<TheveninEquivalent> Compute(const std::vector<std::pair<int, int>>& ports,
+                                          size_t threads = 0) const;
+
+private:
+  static constexpr Eigen::Index kBlock = 32;
+
+  const Circuit& circuit_;
+  Eigen::VectorXd x_;
+};
+
+inline Thevenin::Thevenin(const Circuit& circuit) : circuit_(circuit) {
+  x_ = circuit.SolveCircuit();
+}
+
+inline std::vector<TheveninEquivalent> Thevenin::Compute(const std::vector<std::pair<int, int>>& ports,
+                                                         size_t threads) const {
+  std::vector<TheveninEquivalent> result(ports.size());
+  const int nodes = static_cast<int>(circuit_.nodes_count());
+  for (auto& port : ports) {
+    if (port.first < 0 || port.first >= nodes || port.second < 0 || port.second >= nodes)
+      throw std::runtime_error("port node index out of range");
+  }
+  const LinearSolver& solver = circuit_.linear_solver();
+  const Eigen::Index n = x_.size();
+  // node k is row k - 1, ground has none
+  auto across = [](const auto& v, const std::pair<int, int>& port) {
+    return (port.first > 0 ? v(port.first - 1) : 0.0) - (port.second > 0 ? v(port.second - 1) : 0.0);
+  };
+  const size_t blocks = (ports.size() + kBlock - 1) / kBlock;
+  threads = solver.reentrant() ? std::min(threads ? threads : circuit_.threads(), blocks) : 1;
+  std::atomic<size_t> next(0);
+  ParallelFor(threads, [&](size_t) {
+    Eigen::MatrixXd injections(n, kBlock), z;
+    for (size_t block; (block = next++) < blocks;) {
+      const size_t first = block * kBlock, count = std::min<size_t>(kBlock, ports.size() - first);
+      injections.setZero();
+      for (size_t k = 0; k < count; k++) {
+        const auto& port = ports[first + k];
+        const Eigen::Index column = static_cast<Eigen::Index>(k);
+        if (port.first > 0)
+          injections(port.first - 1, column) += 1.0;
+        if (port.second > 0)
+          injections(port.second - 1, column) -= 1.0;
+      }
+      z = solver.Solve(injections);
+      // a float factorization (Precision::kMixed) gets one step of refinement, on this
+      // thread's residual, not through the solver's shared Refine state
+      if (solver.single())
+        z += solver.Solve(injections - circuit_.A() * z);
+      for (size_t k = 0; k < count; k++) {
+        const auto& port = ports[first + k];
+        result[first + k] = { across(x_, port), across(z.col(static_cast<Eigen::Index>(k)), port) };
+      }
+    }
+  });
+  return result;
+}
+
+#endif // !Thevenin_h
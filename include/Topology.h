@@ -0,0 +1,186 @@
+// Topology checks run over the component graph before MNA assembly.
+// Catches the netlists that make the A matrix singular: floating nodes,
+// loops of voltage-defined branches and cut-sets of current sources.
+// Topology.h
+
+#include "Components.h"
+#include <numeric>
+#include <string>
+#include <vector>
+
+#ifndef Topology_h
+#define Topology_h
+
+// One problem found in the circuit graph, naming the nodes or components involved
+struct TopologyIssue {
+  enum class Kind {
+    kFloatingNode, kVoltageLoop, kCurrentCutset, kZeroResistor, kMissingControl,
+    kMissingInductor, kIndefiniteCoupling
+  };
+
+  Kind kind;
+  std::vector<std::string> names;
+
+  std::string string() const;
+};
+
+// Disjoint set over node ints with path halving and union by size
+class NodeSets {
+public:
+  explicit NodeSets(size_t count) : parent_(count), size_(count, 1) {
+    std::iota(parent_.begin(), parent_.end(), 0);
+  }
+
+  int find(int node) {
+    while (parent_[node] != node) {
+      parent_[node] = parent_[parent_[node]];
+      node = parent_[node];
+    }
+    return node;
+  }
+
+  // returns false when both nodes were already in the same set
+  bool join(int a, int b) {
+    a = find(a);
+    b = find(b);
+    if (a == b)
+      return false;
+    if (size_[a] < size_[b])
+      std::swap(a, b);
+    parent_[b] = a;
+    size_[a] += size_[b];
+    return true;
+  }
+
+private:
+  std::vector<int> parent_;
+  std::vector<int> size_;
+};
+
+// Linear time (near enough, inverse Ackermann) check of the DC circuit graph.
+// Capacitors are open and inductors are 0V branches, matching CalculateMatrices.
+// E and H are voltage-defined branches, F and G current sources, whatever they sense.
+// A T line fixes each port's voltage relative to the other, so each port's two nodes
+// share a reference, and the ports share one only through a common - node.
+// Expects the node indices set by Circuit::MapNodes.
+inline std::vector<TopologyIssue> CheckTopology(const ComponentList& components,
+                                                const NodeMap& nodes,
+                                                const std::vector<Control>& controls) {
+  std::vector<TopologyIssue> issues;
+  std::vector<std::string> names(nodes.size());
+  for (auto& i : nodes)
+    names[i.second] = std::string(i.first);
+
+  NodeSets conducting(nodes.size());
+  NodeSets voltage(nodes.size());
+
+  for (auto& i : components) {
+    int p_node = i.p_index();
+    int n_node = i.n_index();
+
+    switch (i.type()) {
+      case 'F':
+      case 'H':
+        if (controls[i.control()].branch < 0)
+          issues.push_back({ TopologyIssue::Kind::kMissingControl, { std::string(i.name()) } });
+        if (i.type() == 'F')
+          break;
+        [[fallthrough]];
+      case 'E':
+      case 'L':
+      case 'V':
+        // a second path between the same two nodes made only of
+        // voltage-defined branches means the branch currents are undetermined
+        if (!voltage.join(p_node, n_node))
+          issues.push_back({ TopologyIssue::Kind::kVoltageLoop, { std::string(i.name()) } });
+        conducting.join(p_node, n_node);
+        break;
+      case 'T': {
+        const Control& far = controls[i.control()];
+        conducting.join(p_node, n_node);
+        conducting.join(far.p_index, far.n_index);
+        if (n_node == far.n_index) {
+          conducting.join(p_node, far.p_index);
+          if (far.resistance == 0.0 && !voltage.join(p_node, far.p_index))
+            issues.push_back({ TopologyIssue::Kind::kVoltageLoop, { std::string(i.name()) } });
+        }
+        break;
+      }
+      case 'R':
+        if (i.value() == 0.0)
+          issues.push_back({ TopologyIssue::Kind::kZeroResistor, { std::string(i.name()) } });
+        conducting.join(p_node, n_node);
+        break;
+      default:
+        break;
+    }
+  }
+
+  // any node not connected to ground through R, V or L has no DC reference.
+  // Current sources reaching into such a group form a cut-set, otherwise it floats.
+  int ground = conducting.find(0);
+  std::vector<int> group_issue(nodes.size(), -1);
+  for (auto& i : components) {
+    if (i.type() != 'I' && i.type() != 'F' && i.type() != 'G')
+      continue;
+    int p_node = i.p_index();
+    int n_node = i.n_index();
+    for (int node : { p_node, n_node }) {
+      int root = conducting.find(node);
+      if (root == ground)
+        continue;
+      if (group_issue[root] < 0) {
+        group_issue[root] = static_cast<int>(issues.size());
+        issues.push_back({ TopologyIssue::Kind::kCurrentCutset, {} });
+      }
+      auto& cutset = issues[group_issue[root]].names;
+      if (cutset.empty() || cutset.back() != i.name())
+        cutset.push_back(std::string(i.name()));
+    }
+  }
+  for (int node = 1; node < static_cast<int>(names.size()); node++) {
+    int root = conducting.find(node);
+    if (root == ground)
+      continue;
+    if (group_issue[root] < 0) {
+      group_issue[root] = static_cast<int>(issues.size());
+      issues.push_back({ TopologyIssue::Kind::kFloatingNode, {} });
+    }
+    if (issues[group_issue[root]].kind == TopologyIssue::Kind::kFloatingNode)
+      issues[group_issue[root]].names.push_back(names[node]);
+  }
+
+  return issues;
+}
+
+inline std::string TopologyIssue::string() const {
+  std::string result;
+  switch (kind) {
+    case Kind::kFloatingNode:
+      result = "floating node(s) with no DC path to ground:";
+      break;
+    case Kind::kVoltageLoop:
+      result = "loop of voltage sources/inductors closed by";
+      break;
+    case Kind::kCurrentCutset:
+      result = "cut-set of current sources/capacitors:";
+      break;
+    case Kind::kZeroResistor:
+      result = "zero valued resistor";
+      break;
+    case Kind::kMissingControl:
+      result = "controlled source senses no V, L, E or H:";
+      break;
+    case Kind::kMissingInductor:
+      result = "coupling names a missing inductor:";
+      break;
+    case Kind::kIndefiniteCoupling:
+      result = "coupled inductances are not positive semidefinite:";
+      break;
+  }
+  for (auto& i : names)
+    result += ' ' + i;
+  return result;
+}
+
+#endif // !Topology_h
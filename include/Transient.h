@@ -0,0 +1,298 @@
+// Time domain analysis of the linear circuit, G x + C dx/dt = b(t) with G and C from
+// AcAnalysis and b(t) from the circuit's source waveforms (Sources.h). Trapezoidal rule,
+// (2C/h + G) x1 = (2C/h - G) x0 + b0 + b1, after one short backward Euler step,
+// (C/h + G) x1 = (C/h) x0 + b1. The Euler step makes any starting x consistent: rows
+// without capacitance (resistive nodes, V branches) take the values the sources force
+// on them, where the trapezoidal rule would carry an inconsistent start along as an
+// undamped alternation.
+// Steps follow a schedule: the fixed step grid with every waveform breakpoint (pulse
+// edges, PWL corners, delays) inserted, so no corner is stepped over. A grid point
+// within a tenth of a step of a breakpoint moves onto it. Each step length gets one
+// factorization with the circuit's solver kind, reused whenever the length recurs.
+// T lines (TransmissionLine.h) replace their DC rows by the port equations: the near
+// port keeps its branch row, the far port becomes a Norton conductance 1 / port(), and
+// the delayed waves enter b every step. No interval is longer than the shortest delay, so
+// every wave read is already in the history, and the source breakpoints shifted by
+// each delay join the schedule.
+// Transient.h
+
+#include "Ac.h"
+#include "Circuit.h"
+#include "Solver.h"
+#include "Sources.h"
+#include "TransmissionLine.h"
+#include <eigen-3.4.0/Eigen/Dense>
+#include <eigen-3.4.0/Eigen/Sparse>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifndef Transient_h
+#define Transient_h
+
+class TransientAnalysis {
+public:
+  // fills b with the source vector at time t, b is sized to the MNA system
+  using Excitation = std::function<void(double t, Eigen::VectorXd& b)>;
+  // called with every computed point, starting with the initial one
+  using Observer = std::function<void(double t, const Eigen::VectorXd& x)>;
+
+  // circuit must be assembled, step in seconds, shortened to fit the shortest line
+  // delay (see kSnap). The excitation defaults to the circuit's sources with their
+  // waveforms.
+  TransientAnalysis(const Circuit& circuit, double step);
+
+  size_t size() const { return static_cast<size_t>(ac_.size()); }
+  double step() const { return step_; }
+  const AcAnalysis& ac() const { return ac_; }
+  const SourceTable& sources() const { return *sources_; }
+  const std::vector<TransmissionLine>& lines() const { return lines_; }
+  // G and C with the line rows of the transient
+  const Eigen::SparseMatrix<double>& G() const { return g_; }
+  const Eigen::SparseMatrix<double>& C() const { return c_; }
+  // replaces the circuit's sources, the breakpoints still come from its waveforms
+  void set_excitation(Excitation excitation) { excitation_ = std::move(excitation); }
+
+  // the time points after start up to stop, see above
+  std::vector<double> Schedule(double start, double stop) const;
+  // Advances x from time start through every time of a schedule
+  void Integrate(Eigen::VectorXd& x, double start, const std::vector<double>& times,
+                 const Observer& observer = nullptr);
+  void Integrate(Eigen::VectorXd& x, double start, double stop, const Observer& observer = nullptr) {
+    Integrate(x, start, Schedule(start, stop), observer);
+  }
+  // Same steps with every source zeroed: the derivative of the end point of
+  // Integrate with respect to its start point, applied to v. Lines start from v
+  // as from a DC state, as in Integrate.
+  void Propagate(Eigen::VectorXd& v, double start, const std::vector<double>& times);
+
+  // factorizations kept, one per step length and rule
+  size_t factorizations() const { return solvers_.size(); }
+
+private:
+  // the Euler step is this part of the first interval, short enough that its first
+  // order error stays below the trapezoidal error of the steps after it
+  static constexpr double kEulerFraction = 1e-3;
+  // a schedule with more distinct step lengths starts the cache over
+  static constexpr size_t kMaxFactorizations = 64;
+  // grid points this part of a step from a breakpoint move onto it, so no interval
+  // is longer than (1 + kSnap) steps
+  static constexpr double kSnap = 0.1;
+
+  template <bool kSources>
+  void Advance(Eigen::VectorXd& x, double start, const std::vector<double>& times, const Observer& observer);
+  // C/h + G for euler, 2C/h + G otherwise
+  const LinearSolver& Factorization(double h, bool euler);
+  // the history of every line as if x had held since forever
+  void StartLines(double t, const Eigen::VectorXd& x);
+  // adds the delayed waves at t to b, keeping them in line_waves_
+  void AddLineWaves(double t, Eigen::VectorXd& b);
+  // appends the waves leaving the ports at t
+  void RecordLines(double t, const Eigen::VectorXd& x);
+
+  AcAnalysis ac_;
+  std::vector<TransmissionLine> lines_;
+  LineHistory history_;
+  std::vector<double> line_waves_; // E1, E2 of each line at the last AddLineWaves
+  double max_delay_ = 0.0;
+  Eigen::SparseMatrix<double> g_, c_;
+  double step_;
+  SolverKind kind_;
+  std::shared_ptr<SourceTable> sources_;
+  Excitation excitation_;
+  std::map<std::pair<bool, double>, LinearSolver> solvers_;
+};
+
+inline TransientAnalysis::TransientAnalysis(const Circuit& circuit, double step) :
+    ac_(circuit), lines_(CircuitLines(circuit)), history_(lines_.size()), line_waves_(2 * lines_.size()),
+    step_(step), kind_(circuit.solver()) {
+  if (!(step > 0.0))
+    throw std::invalid_argument("transient step must be positive");
+  if (!circuit.valid())
+    throw std::runtime_error("circuit topology is invalid");
+  // the line rows: take out the far port and the DC resistance of each branch row,
+  // which then reads v1 - port() i1 = E1, and put the far port's Norton conductance in
+  std::vector<Eigen::Triplet<double>> triplets;
+  for (auto& line : lines_) {
+    const int k = line.branch_row;
+    auto add_far = [&](int row, double sign) {
+      if (row < 0)
+        return;
+      triplets.emplace_back(row, k, sign);
+      triplets.emplace_back(k, row, sign);
+    };
+    add_far(line.p2, 1.0);
+    add_far(line.n2, -1.0);
+    triplets.emplace_back(k, k, line.resistance - line.port());
+    const double g = 1.0 / line.port();
+    for (int row : { line.p2, line.n2 }) {
+      for (int column : { line.p2, line.n2 }) {
+        if (row >= 0 && column >= 0)
+          triplets.emplace_back(row, column, row == column ? g : -g);
+      }
+    }
+    step_ = std::min(step_, line.delay / (1.0 + kSnap));
+    max_delay_ = std::max(max_delay_, line.delay);
+  }
+  Eigen::SparseMatrix<double> correction(ac_.G().rows(), ac_.G().cols());
+  correction.setFromTriplets(triplets.begin(), triplets.end());
+  g_ = ac_.G() + correction;
+  c_ = ac_.C() + 0.0 * correction;
+  sources_ = std::make_shared<SourceTable>(circuit);
+  excitation_ = [sources = sources_](double t, Eigen::VectorXd& b) { sources->Fill(t, b); };
+}
+
+inline std::vector<double> TransientAnalysis::Schedule(double start, double stop) const {
+  std::vector<double> breaks = sources_->Breakpoints(start, stop);
+  // a corner arrives at the other end of a line one delay later
+  for (auto& line : lines_) {
+    for (double t : sources_->Breakpoints(start - line.delay, stop - line.delay)) {
+      if (t + line.delay > start)
+        breaks.push_back(t + line.delay);
+    }
+  }
+  if (!lines_.empty()) {
+    std::sort(breaks.begin(), breaks.end());
+    breaks.erase(std::unique(breaks.begin(), breaks.end()), breaks.end());
+  }
+  if (breaks.empty() || breaks.back() < stop)
+    breaks.push_back(stop);
+  std::vector<double> times;
+  const double snap = kSnap * step_, same = 1e-9 * step_;
+  size_t b = 0;
+  // stop is the last breakpoint, the grid ends with it. Breakpoints of different
+  // sources that differ by rounding only are one.
+  for (double k = 1.0; b < breaks.size(); k++) {
+    const double t = start + step_ * k;
+    while (b < breaks.size() && breaks[b] <= t + snap) {
+      if (times.empty() || breaks[b] - times.back() > same)
+        times.push_back(breaks[b]);
+      else if (b + 1 == breaks.size())
+        times.back() = breaks[b];
+      b++;
+    }
+    if (b < breaks.size() && (times.empty() || t - times.back() >= snap))
+      times.push_back(t);
+  }
+  return times;
+}
+
+inline const LinearSolver& TransientAnalysis::Factorization(double h, bool euler) {
+  // lengths off the step by rounding only are the step
+  if (std::abs(h - step_) <= 1e-9 * step_)
+    h = step_;
+  const auto key = std::make_pair(euler, h);
+  auto found = solvers_.find(key);
+  if (found != solvers_.end())
+    return found->second;
+  if (solvers_.size() == kMaxFactorizations)
+    solvers_.clear();
+  LinearSolver& solver = solvers_.try_emplace(key, kind_).first->second;
+  solver.Factorize(c_ * ((euler ? 1.0 : 2.0) / h) + g_);
+  return solver;
+}
+
+inline void TransientAnalysis::StartLines(double t, const Eigen::VectorXd& x) {
+  history_.Clear();
+  double* waves = history_.Append(t);
+  auto at = [&x](int row) { return row < 0 ? 0.0 : x(row); };
+  for (size_t l = 0; l < lines_.size(); l++) {
+    const TransmissionLine& line = lines_[l];
+    // at DC the far port current is -i1
+    const double i1 = x(line.branch_row);
+    waves[2 * l] = at(line.p1) - at(line.n1) + line.wave() * i1;
+    waves[2 * l + 1] = at(line.p2) - at(line.n2) - line.wave() * i1;
+  }
+}
+
+inline void TransientAnalysis::AddLineWaves(double t, Eigen::VectorXd& b) {
+  for (size_t l = 0; l < lines_.size(); l++) {
+    const TransmissionLine& line = lines_[l];
+    const double e1 = history_.Wave(l, 1, t - line.delay), e2 = history_.Wave(l, 0, t - line.delay);
+    const double g = 1.0 / line.port();
+    b(line.branch_row) += e1;
+    if (line.p2 >= 0)
+      b(line.p2) += g * e2;
+    if (line.n2 >= 0)
+      b(line.n2) -= g * e2;
+    line_waves_[2 * l] = e1;
+    line_waves_[2 * l + 1] = e2;
+  }
+}
+
+inline void TransientAnalysis::RecordLines(double t, const Eigen::VectorXd& x) {
+  double* waves = history_.Append(t);
+  auto at = [&x](int row) { return row < 0 ? 0.0 : x(row); };
+  for (size_t l = 0; l < lines_.size(); l++) {
+    const TransmissionLine& line = lines_[l];
+    const double v1 = at(line.p1) - at(line.n1), v2 = at(line.p2) - at(line.n2);
+    const double i1 = x(line.branch_row), i2 = (v2 - line_waves_[2 * l + 1]) / line.port();
+    waves[2 * l] = v1 + line.wave() * i1;
+    waves[2 * l + 1] = v2 + line.wave() * i2;
+  }
+  history_.Forget(t - max_delay_);
+}
+
+inline void TransientAnalysis::Integrate(Eigen::VectorXd& x, double start, const std::vector<double>& times,
+                                         const Observer& observer) {
+  Advance<true>(x, start, times, observer);
+}
+
+inline void TransientAnalysis::Propagate(Eigen::VectorXd& v, double start, const std::vector<double>& times) {
+  Advance<false>(v, start, times, nullptr);
+}
+
+template <bool kSources>
+void TransientAnalysis::Advance(Eigen::VectorXd& x, double start, const std::vector<double>& times,
+                                const Observer& observer) {
+  const Eigen::Index n = static_cast<Eigen::Index>(size());
+  if (x.size() != n)
+    throw std::invalid_argument("transient state has the wrong size");
+  // without sources b is only the line waves
+  const bool lines = !lines_.empty(), excited = kSources || lines;
+  Eigen::VectorXd b0 = Eigen::VectorXd::Zero(n), b1 = Eigen::VectorXd::Zero(n), rhs;
+  if (lines)
+    StartLines(start, x);
+  if (observer)
+    observer(start, x);
+  double t = start;
+  bool euler = true;
+  for (size_t k = 0; k < times.size();) {
+    const double t1 = euler ? start + kEulerFraction * (times[0] - start) : times[k];
+    const double h = t1 - t;
+    if (excited) {
+      b0.swap(b1);
+      if constexpr (kSources)
+        excitation_(t1, b1);
+      else
+        b1.setZero();
+      if (lines)
+        AddLineWaves(t1, b1);
+    }
+    if (euler) {
+      rhs = c_ * x / h;
+      if (excited)
+        rhs += b1;
+      x = Factorization(h, true).Solve(rhs);
+      euler = false;
+    } else {
+      rhs = c_ * x * (2.0 / h) - g_ * x;
+      if (excited)
+        rhs += b0 + b1;
+      x = Factorization(h, false).Solve(rhs);
+      if (observer)
+        observer(t1, x);
+      k++;
+    }
+    if (lines)
+      RecordLines(t1, x);
+    t = t1;
+  }
+}
+
+#endif // !Transient_h
@@ -0,0 +1,119 @@
+// Transmission lines (T) in the time domain, by the method of characteristics.
+// A lossless line of impedance Z0 and delay TD is, at each port, a resistance Z0 in
+// series with a voltage: the wave that left the other port TD earlier,
+//   v1(t) = Z0 i1(t) + a2(t - TD),  a2 = v2 + Z0 i2
+//   v2(t) = Z0 i2(t) + a1(t - TD),  a1 = v1 + Z0 i1
+// with port currents into the + nodes. A resistance R is lumped as R/2 at each end,
+// which turns Z0 into Z0 + R/2 (port()) in the port equations and Z0 - R/2 (wave())
+// in the waves, and keeps the DC relation v1 - v2 = R i1 of Circuit::StampComponent.
+// The waves of all lines are kept in one history ring that TransientAnalysis reads
+// TD back from every step. AC, noise, modes, reduction and harmonic balance see the
+// DC model.
+// TransmissionLine.h
+
+#include "Circuit.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef TransmissionLine_h
+#define TransmissionLine_h
+
+struct TransmissionLine {
+  size_t component;
+  int p1, n1, p2, n2; // MNA rows of the near and far port nodes, -1 for ground
+  int branch_row;     // i1, the current into p1
+  double impedance, delay, resistance;
+
+  double port() const { return impedance + 0.5 * resistance; }
+  double wave() const { return impedance - 0.5 * resistance; }
+};
+
+// The T lines of an assembled circuit, throws std::runtime_error for Z0 <= 0
+inline std::vector<TransmissionLine> CircuitLines(const Circuit& circuit) {
+  std::vector<TransmissionLine> lines;
+  const auto& components = circuit.components();
+  const int ground_rows = static_cast<int>(circuit.nodes_count()) - 1;
+  for (size_t c = 0; c < components.size(); c++) {
+    const Component& component = components[c];
+    if (component.type() != 'T')
+      continue;
+    const Control& far = circuit.controls()[component.control()];
+    if (!(component.value() > 0.0))
+      throw std::runtime_error("transmission line " + std::string(component.name()) +
+                             " needs a positive impedance");
+    lines.push_back({ c, component.p_index() - 1, component.n_index() - 1, far.p_index - 1, far.n_index - 1,
+                      ground_rows + component.branch(), component.value(), far.delay, far.resistance });
+  }
+  return lines;
+}
+
+// Waves of every line over time. Each time slot holds a1, a2 of line 0, a1, a2 of
+// line 1 and so on, so one step appends one contiguous block. Slots are numbered from
+// the first append and live in a ring that doubles when full. Reads go through one
+// cursor per line: time moves forward, so a read steps a slot or two.
+class LineHistory {
+public:
+  explicit LineHistory(size_t lines = 0) : lines_(lines), cursor_(lines, 0) {}
+
+  size_t lines() const { return lines_; }
+  // slots kept
+  size_t size() const { return end_ - begin_; }
+  void Clear() {
+    begin_ = end_ = 0;
+    std::fill(cursor_.begin(), cursor_.end(), 0);
+  }
+
+  // Appends the slot for time t, after every time before, for the caller to fill
+  double* Append(double t);
+  // Wave leaving port (0 near, 1 far) of line at time t. Linear between slots and
+  // the oldest slot before them, t must not be past the newest slot.
+  double Wave(size_t line, int port, double t);
+  // Drops the slots no read at t or later needs
+  void Forget(double t) {
+    while (end_ - begin_ > 1 && times_[Slot(begin_ + 1)] <= t)
+      begin_++;
+  }
+
+private:
+  size_t Slot(size_t k) const { return k & (times_.size() - 1); }
+
+  size_t lines_;
+  std::vector<double> times_, waves_; // capacity a power of two
+  std::vector<size_t> cursor_;        // per line, the slot at or before its last read
+  size_t begin_ = 0, end_ = 0;
+};
+
+inline double* LineHistory::Append(double t) {
+  if (end_ - begin_ == times_.size()) {
+    const size_t capacity = std::max<size_t>(times_.size() * 2, 16), width = 2 * lines_;
+    std::vector<double> times(capacity), waves(capacity * width);
+    for (size_t k = begin_; k < end_; k++) {
+      times[k & (capacity - 1)] = times_[Slot(k)];
+      std::copy_n(&waves_[Slot(k) * width], width, &waves[(k & (capacity - 1)) * width]);
+    }
+    times_.swap(times);
+    waves_.swap(waves);
+  }
+  const size_t slot = Slot(end_++);
+  times_[slot] = t;
+  return &waves_[slot * 2 * lines_];
+}
+
+inline double LineHistory::Wave(size_t line, int port, double t) {
+  const size_t offset = 2 * line + static_cast<size_t>(port), width = 2 * lines_;
+  size_t& k = cursor_[line];
+  k = std::max(k, begin_);
+  while (k > begin_ && times_[Slot(k)] > t)
+    k--;
+  while (k + 1 < end_ && times_[Slot(k + 1)] <= t)
+    k++;
+  const double t0 = times_[Slot(k)], w0 = waves_[Slot(k) * width + offset];
+  if (k + 1 == end_ || t <= t0)
+    return w0;
+  const double t1 = times_[Slot(k + 1)], w1 = waves_[Slot(k + 1) * width + offset];
+  return w0 + (w1 - w0) * (t - t0) / (t1 - t0);
+}
+
+#endif // !TransmissionLine_h
@@ -0,0 +1,195 @@
+// Time-varying values of independent sources, as in SPICE:
+//   PULSE(v1 v2 [delay rise fall width period])
+//   SIN(offset amplitude frequency [delay damping phase])
+//   PWL(t1 v1 t2 v2 ...)
+//   EXP(v1 v2 [delay1 tau1 delay2 tau2])
+// Omitted times are 0 and an omitted width or period is infinite, so PULSE(0 1) is a
+// step at t = 0. Phase is in degrees. A waveform keeps its arguments with the defaults
+// filled in. It is evaluated one time at a time here, SourceTable (Sources.h) evaluates
+// every source of a circuit at once.
+// Waveform.h
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef Waveform_h
+#define Waveform_h
+
+enum class WaveformKind { kPulse, kSin, kPwl, kExp };
+
+constexpr double kWaveformPi = 3.14159265358979323846;
+
+// kind for a keyword, case insensitive, false for anything else
+inline bool ParseWaveformKind(std::string_view name, WaveformKind& kind) {
+  static const struct { const char* name; WaveformKind kind; } kinds[] = {
+    { "pulse", WaveformKind::kPulse }, { "sin", WaveformKind::kSin },
+    { "pwl", WaveformKind::kPwl }, { "exp", WaveformKind::kExp },
+  };
+  for (auto& i : kinds) {
+    if (name.size() == std::char_traits<char>::length(i.name) &&
+        std::equal(name.begin(), name.end(), i.name,
+                   [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; })) {
+      kind = i.kind;
+      return true;
+    }
+  }
+  return false;
+}
+
+class Waveform {
+public:
+  // Throws std::invalid_argument for a wrong argument count or bad times
+  Waveform(WaveformKind kind, std::vector<double> arguments);
+
+  WaveformKind kind() const { return kind_; }
+  // arguments in the order above, defaults filled in (PWL: t1 v1 t2 v2 ...)
+  const std::vector<double>& arguments() const { return arguments_; }
+
+  double Value(double t) const;
+  // Appends the times in (start, stop] where the waveform has a corner
+  void Breakpoints(double start, double stop, std::vector<double>& out) const;
+
+private:
+  WaveformKind kind_;
+  std::vector<double> arguments_;
+};
+
+inline Waveform::Waveform(WaveformKind kind, std::vector<double> arguments) :
+    kind_(kind), arguments_(std::move(arguments)) {
+  const double infinity = std::numeric_limits<double>::infinity();
+  auto expect = [&](size_t least, size_t most, const char* usage) {
+    if (arguments_.size() < least || arguments_.size() > most)
+      throw std::invalid_argument(std::string("expected ") + usage);
+  };
+  switch (kind_) {
+    case WaveformKind::kPulse: {
+      expect(2, 7, "PULSE(v1 v2 [delay rise fall width period])");
+      const double defaults[] = { 0.0, 0.0, 0.0, 0.0, 0.0, infinity, infinity };
+      for (size_t i = arguments_.size(); i < 7; i++)
+        arguments_.push_back(defaults[i]);
+      if (!(arguments_[3] >= 0.0 && arguments_[4] >= 0.0 && arguments_[5] >= 0.0) ||
+          !(arguments_[6] >= arguments_[3] + arguments_[4] + arguments_[5]) || !(arguments_[6] > 0.0))
+        throw std::invalid_argument("PULSE times must be >= 0 and fit in the period");
+      break;
+    }
+    case WaveformKind::kSin:
+      expect(3, 6, "SIN(offset amplitude frequency [delay damping phase])");
+      arguments_.resize(6, 0.0);
+      break;
+    case WaveformKind::kPwl:
+      if (arguments_.size() < 2 || arguments_.size() % 2)
+        throw std::invalid_argument("expected PWL(t1 v1 t2 v2 ...)");
+      for (size_t i = 2; i < arguments_.size(); i += 2) {
+        if (!(arguments_[i] > arguments_[i - 2]))
+          throw std::invalid_argument("PWL times must increase");
+      }
+      break;
+    case WaveformKind::kExp: {
+      expect(2, 6, "EXP(v1 v2 [delay1 tau1 delay2 tau2])");
+      size_t given = arguments_.size();
+      arguments_.resize(6, 0.0);
+      // no fall without delay2
+      if (given < 5)
+        arguments_[4] = infinity;
+      if (!(arguments_[3] >= 0.0 && arguments_[5] >= 0.0) || !(arguments_[4] >= arguments_[2]))
+        throw std::invalid_argument("EXP needs tau >= 0 and delay2 >= delay1");
+      break;
+    }
+  }
+}
+
+inline double Waveform::Value(double t) const {
+  const double* a = arguments_.data();
+  switch (kind_) {
+    case WaveformKind::kPulse: {
+      if (t < a[2])
+        return a[0];
+      double tt = std::isinf(a[6]) ? t - a[2] : std::fmod(t - a[2], a[6]);
+      if (tt < a[3])
+        return a[0] + (a[1] - a[0]) * tt / a[3];
+      tt -= a[3];
+      if (tt < a[5])
+        return a[1];
+      tt -= a[5];
+      if (tt < a[4])
+        return a[1] + (a[0] - a[1]) * tt / a[4];
+      return a[0];
+    }
+    case WaveformKind::kSin: {
+      const double phase = a[5] * kWaveformPi / 180.0;
+      if (t < a[3])
+        return a[0] + a[1] * std::sin(phase);
+      double tt = t - a[3];
+      return a[0] + a[1] * std::exp(-a[4] * tt) * std::sin(2.0 * kWaveformPi * a[2] * tt + phase);
+    }
+    case WaveformKind::kPwl: {
+      const size_t points = arguments_.size() / 2;
+      if (t <= a[0])
+        return a[1];
+      if (t >= a[2 * (points - 1)])
+        return a[2 * points - 1];
+      size_t k = 1;
+      while (a[2 * k] < t)
+        k++;
+      const double t0 = a[2 * k - 2], t1 = a[2 * k];
+      return a[2 * k - 1] + (a[2 * k + 1] - a[2 * k - 1]) * (t - t0) / (t1 - t0);
+    }
+    case WaveformKind::kExp: {
+      double value = a[0];
+      if (t > a[2])
+        value += (a[1] - a[0]) * (a[3] > 0.0 ? 1.0 - std::exp(-(t - a[2]) / a[3]) : 1.0);
+      if (t > a[4])
+        value += (a[0] - a[1]) * (a[5] > 0.0 ? 1.0 - std::exp(-(t - a[4]) / a[5]) : 1.0);
+      return value;
+    }
+  }
+  return 0.0;
+}
+
+inline void Waveform::Breakpoints(double start, double stop, std::vector<double>& out) const {
+  const double* a = arguments_.data();
+  auto add = [&](double t) {
+    if (t > start && t <= stop)
+      out.push_back(t);
+  };
+  switch (kind_) {
+    case WaveformKind::kPulse: {
+      const double corners[] = { 0.0, a[3], a[3] + a[5], a[3] + a[5] + a[4] };
+      auto add_period = [&](double begin) {
+        for (double corner : corners) {
+          if (std::isfinite(corner))
+            add(begin + corner);
+        }
+      };
+      if (std::isinf(a[6])) {
+        add_period(a[2]);
+        break;
+      }
+      // from the first period that can reach past start
+      double k = start <= a[2] ? 0.0 : std::floor((start - a[2]) / a[6]);
+      for (; a[2] + k * a[6] <= stop; k++)
+        add_period(a[2] + k * a[6]);
+      break;
+    }
+    case WaveformKind::kSin:
+      add(a[3]);
+      break;
+    case WaveformKind::kPwl:
+      for (size_t i = 0; i < arguments_.size(); i += 2)
+        add(a[i]);
+      break;
+    case WaveformKind::kExp:
+      add(a[2]);
+      if (std::isfinite(a[4]))
+        add(a[4]);
+      break;
+  }
+}
+
+#endif // !Waveform_h
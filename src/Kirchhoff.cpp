@@ -2,7 +2,18 @@
 // Kirchhoff
 
 #include "Circuit.h"
+#include "EffectiveResistance.h"
+#include "HarmonicBalance.h"
+#include "Modes.h"
+#include "Noise.h"
+#include "Pss.h"
+#include "Reduction.h"
+#include "Sensitivity.h"
+#include "Sweep.h"
+#include "Thevenin.h"
+#include "Transient.h"
 #include <iostream>
+#include <memory>
 
 using namespace std;
 
@@ -91,17 +102,29 @@ void ManualNodalAnalysis() {
   cout << "Va = " << X[0] << ", Vb = " << X[1] << endl;
 }
 
-int main() {
-  // read circuit file
-  ifstream fin("circuit.txt");
+int main(int argc, char** argv) {
+  // read circuit file, circuit.txt unless another path is given,
+  // optionally followed by a solver name (sparselu, multifrontal, dense, ...)
+  // and a precision (double or mixed)
+  string path = argc > 1 ? argv[1] : "circuit.txt";
+  ifstream fin(path);
   if (fin.fail()) {
-    cout << "Failed to open circuit.txt\n";
+    cout << "Failed to open " << path << "\n";
     return 1;
   } // stop program if file missing
 
   // Create circuit simulation from file (see Circuit.h)
   cout << "Simulating Circuit...\n\n";
-  Circuit* circuit_1 = new Circuit(fin);
+  unique_ptr<Circuit> circuit_1;
+  try {
+    circuit_1.reset(new Circuit(fin));
+    if (argc > 2)
+      circuit_1->set_solver(ParseSolverKind(argv[2]),
+                            argc > 3 ? ParsePrecision(argv[3]) : Precision::kDouble);
+  } catch (const runtime_error& e) {
+    cout << path << ": " << e.what() << endl;
+    return 1;
+  }
   cout << "Circuit\n";
   cout << *circuit_1;
 
@@ -112,6 +135,9 @@ int main() {
   cout << "Resistor count: " << circuit_1->resistor_count() << endl;
   cout << "Conductor count: " << circuit_1->conductor_count() << endl;
   cout << "Inductor count: " << circuit_1->inductor_count() << endl;
+  cout << "Diode count: " << circuit_1->diode_count() << endl;
+  cout << "Controlled source count: " << circuit_1->controlled_count() << endl;
+  cout << "Transmission line count: " << circuit_1->transmission_line_count() << endl;
   cout << "Node count: " << circuit_1->nodes_count() << endl;
 
   // << "\nNodes map:\n";
@@ -119,24 +145,254 @@ int main() {
   //  cout << '\"' << i.first << "\" : " << i.second << endl;
   //}
 
+  if (!circuit_1->valid()) {
+    cout << "\nCircuit cannot be solved:\n";
+    for (auto& i : circuit_1->issues())
+      cout << "  " << i.string() << endl;
+    return 1;
+  }
+
   cout << "\nMatrix A:\n" << circuit_1->A_matrix() << endl;
   cout << "Matrix b:\n" << circuit_1->b_matrix() << endl;
 
   cout << "Solving system Ax = b ...\n\n";
-  Eigen::MatrixXd x = circuit_1->SolveCircuit();
+  Eigen::MatrixXd x;
+  try {
+    x = circuit_1->SolveCircuit();
+  } catch (const runtime_error& e) {
+    cout << e.what() << endl;
+    return 1;
+  }
 
   cout << "Matrix x:\n" << x << endl << endl;
+  if (circuit_1->precision() == Precision::kMixed) {
+    auto& refinement = circuit_1->refinement();
+    cout << "Refinement: " << refinement.steps << " steps, residual " << refinement.residual
+         << (refinement.fell_back ? " (fell back to double)" : "") << endl << endl;
+  }
+
+  {
+    CIRCUIT_PHASE(circuit_1->stats(), Phase::kOutput);
+    cout << "Solution:\n";
+    int v_sources = static_cast<int>(circuit_1->branch_count());
+    int v_index = static_cast<int>(x.size()) - v_sources;
+    for (int i = 0; i < v_index; i++) {
+      cout << "v" << i + 1 << " = " << x(i) << " Volts" << endl;
+    }
+    for (int k = v_index, i = 0; k < x.size(); k++, i++) {
+      cout << "i" << i + 1 << " = " << x(k) << " Amps" << endl;
+    }
+  }
+
+  // .sens lines: components ranked by their effect on each output
+  if (!circuit_1->sensitivity_outputs().empty()) {
+    try {
+      const size_t shown = 10;
+      auto& outputs = circuit_1->sensitivity_outputs();
+      vector<Eigen::Index> rows;
+      for (auto i : outputs)
+        rows.push_back(OutputRow(*circuit_1, i));
+      Sensitivity sensitivity(*circuit_1);
+      sensitivity.Compute(rows);
+      for (size_t k = 0; k < outputs.size(); k++) {
+        cout << "\nSensitivity of " << outputs[k] << " (d/dvalue, times value):" << endl;
+        for (auto& i : sensitivity.Ranked(k, shown)) {
+          cout << "  " << circuit_1->components()[i.component].name() << ": " << i.derivative
+               << ", " << i.normalized << endl;
+        }
+      }
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
+  }
+
+  // .thevenin lines: open circuit voltage, driving point resistance and Norton current per port
+  if (!circuit_1->thevenin_ports().empty()) {
+    try {
+      auto& names = circuit_1->thevenin_ports();
+      vector<pair<int, int>> ports;
+      for (auto& i : names)
+        ports.push_back(PortNodes(*circuit_1, i.first, i.second));
+      Thevenin thevenin(*circuit_1);
+      vector<TheveninEquivalent> equivalents = thevenin.Compute(ports);
+      cout << "\nThevenin equivalents (Vth, Rth, In):" << endl;
+      for (size_t k = 0; k < names.size(); k++) {
+        cout << "  " << names[k].first << " " << names[k].second << ": " << equivalents[k].voltage << ", "
+             << equivalents[k].resistance << ", " << equivalents[k].current() << endl;
+      }
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
+  }
 
-  cout << "Solution:\n";
-  int v_sources = static_cast<int>(circuit_1->voltage_count() + circuit_1->inductor_count());
-  int v_index = static_cast<int>(x.size()) - v_sources;
-  for (int i = 0; i < v_index; i++) {
-    cout << "v" << i + 1 << " = " << x(i) << " Volts" << endl;
+  // .reff lines: effective resistance of the resistor network between node pairs
+  if (!circuit_1->resistance_pairs().empty()) {
+    try {
+      auto& names = circuit_1->resistance_pairs();
+      vector<pair<int, int>> pairs;
+      for (auto& i : names)
+        pairs.push_back(PortNodes(*circuit_1, i.first, i.second));
+      EffectiveResistance network(*circuit_1);
+      vector<double> resistances = network.Query(pairs);
+      cout << "\nEffective resistance:" << endl;
+      for (size_t k = 0; k < names.size(); k++)
+        cout << "  " << names[k].first << " " << names[k].second << ": " << resistances[k] << endl;
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
   }
-  for (int k = v_index, i = 0; k < x.size(); k++, i++) {
-    cout << "i" << i + 1 << " = " << x(k) << " Amps" << endl;
+
+  // .noise lines: output density and the largest contributor at each frequency
+  for (auto& request : circuit_1->noise_requests()) {
+    try {
+      NoiseAnalysis noise(*circuit_1);
+      noise.Run(OutputRow(*circuit_1, request.output), request.frequencies);
+      cout << "\nNoise at " << request.output << " (per sqrt(Hz), largest source):" << endl;
+      for (size_t k = 0; k < request.frequencies.size(); k++) {
+        cout << "  " << request.frequencies[k] << " Hz: " << noise.spectral_density(k);
+        auto top = noise.Ranked(k, 1);
+        if (!top.empty() && noise.total(k) > 0.0) {
+          cout << ", " << circuit_1->components()[top[0].component].name() << " "
+               << 100.0 * top[0].density / noise.total(k) << "%";
+        }
+        cout << endl;
+      }
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
+  }
+
+  // .reduce lines: reduced model summary, written to reduced_model.txt for reuse
+  for (auto& request : circuit_1->reduce_requests()) {
+    try {
+      ReducedModel model = Prima(*circuit_1, vector<string>(request.ports.begin(), request.ports.end()),
+                                 request.moments);
+      cout << "\nReduced model: " << model.order() << " states for " << model.ports().size()
+           << " ports" << endl;
+      cout << "DC port impedance:\n" << model.Impedance(0.0).real() << endl;
+      cout << "Poles (rad/s):\n" << model.Poles().transpose() << endl;
+      ofstream out("reduced_model.txt");
+      model.Save(out);
+      cout << "Written to reduced_model.txt" << endl;
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
+  }
+
+  // .modes line: natural frequencies and the transient settings they call for
+  if (circuit_1->mode_count()) {
+    try {
+      ModeAnalysis modes(*circuit_1);
+      modes.Compute(circuit_1->mode_count());
+      cout << "\nModes (s in rad/s, time constant, frequency, damping):" << endl;
+      for (auto& i : modes.modes()) {
+        cout << "  " << i.s.real() << (i.s.imag() < 0.0 ? " - " : " + ") << std::abs(i.s.imag()) << "j: "
+             << i.time_constant() << " s, " << i.frequency() << " Hz, " << i.damping() << endl;
+      }
+      cout << (modes.stable() ? "Stable" : "Unstable") << endl;
+      if (!modes.modes().empty()) {
+        TimestepSuggestion suggestion = modes.Suggest();
+        cout << "Suggested transient: step " << suggestion.step << " s, stop " << suggestion.stop << " s"
+             << endl;
+      }
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
+  }
+
+  // .tran lines: every unknown at every time point, from the DC solution
+  for (auto& request : circuit_1->tran_requests()) {
+    try {
+      TransientAnalysis transient(*circuit_1, request.step);
+      Eigen::VectorXd state = x.col(0);
+      vector<double> times = transient.Schedule(0.0, request.stop);
+      cout << "\nTransient (" << times.size() << " steps, " << circuit_1->waveforms().size()
+           << " waveform sources), t then x:" << endl;
+      transient.Integrate(state, 0.0, times, [](double t, const Eigen::VectorXd& point) {
+        cout << "  " << t << ":";
+        for (Eigen::Index i = 0; i < point.size(); i++)
+          cout << " " << point(i);
+        cout << endl;
+      });
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
   }
 
+  // .pss lines: cost of the shooting solve, then the range of every unknown over the period
+  for (auto& request : circuit_1->pss_requests()) {
+    try {
+      PeriodicSteadyState pss(*circuit_1, request.period, request.steps);
+      pss.Solve();
+      cout << "\nPeriodic steady state (" << pss.newton_iterations() << " Newton, " << pss.krylov_iterations()
+           << " GMRES iterations, " << pss.periods() << " periods integrated):" << endl;
+      const auto& waveform = pss.waveform();
+      int v_sources = static_cast<int>(circuit_1->branch_count());
+      int v_index = static_cast<int>(waveform.rows()) - v_sources;
+      for (int i = 0; i < waveform.rows(); i++) {
+        cout << (i < v_index ? "v" : "i") << (i < v_index ? i + 1 : i - v_index + 1) << ": "
+             << waveform.row(i).minCoeff() << " to " << waveform.row(i).maxCoeff() << endl;
+      }
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
+  }
+
+  // .hb lines: DC value and harmonic amplitudes of every unknown
+  for (auto& request : circuit_1->hb_requests()) {
+    try {
+      HarmonicBalance hb(*circuit_1, request.frequency, request.harmonics);
+      const auto& X = hb.Solve();
+      cout << "\nHarmonic balance at " << request.frequency << " Hz (" << hb.newton_iterations()
+           << " Newton, " << hb.krylov_iterations() << " GMRES iterations), DC then |X_k|:" << endl;
+      int v_sources = static_cast<int>(circuit_1->branch_count());
+      int v_index = static_cast<int>(X.rows()) - v_sources;
+      for (int i = 0; i < X.rows(); i++) {
+        cout << (i < v_index ? "v" : "i") << (i < v_index ? i + 1 : i - v_index + 1) << ": " << X(i, 0).real();
+        for (Eigen::Index k = 1; k < X.cols(); k++)
+          cout << " " << std::abs(X(i, k));
+        cout << endl;
+      }
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
+  }
+
+  // .step lines: one line per step, swept values then x
+  if (!circuit_1->steps().empty()) {
+    try {
+      Sweep sweep(*circuit_1);
+      cout << "\nSweep (" << sweep.step_count() << " steps):" << endl;
+      sweep.Run([&](size_t step, const double* values, const Eigen::VectorXd& x) {
+        cout << "step " << step + 1 << ":";
+        for (size_t d = 0; d < sweep.dimension_count(); d++)
+          cout << " " << sweep.parameter_name(d) << "=" << values[d];
+        cout << " |";
+        for (Eigen::Index i = 0; i < x.size(); i++)
+          cout << " " << x(i);
+        cout << endl;
+      });
+    } catch (const runtime_error& e) {
+      cout << e.what() << endl;
+      return 1;
+    }
+  }
+
+#ifdef CIRCUIT_STATS
+  ofstream("circuit_stats.json") << circuit_1->stats().json();
+  ofstream("circuit_trace.json") << circuit_1->stats().chrome_trace();
+  cout << "\nStats written to circuit_stats.json and circuit_trace.json\n";
+#endif
+
 
   //manual nodal / mesh analysis
   //cout << endl;
@@ -0,0 +1,754 @@
+// Circuit checks
+// Compares results against answers worked out by hand and against independent ways
+// of computing the same quantity, one named check per feature. ctest runs each check
+// as its own test, circuit_checks with no argument runs them all.
+//
+// circuit_checks [check]
+// Sample netlists are read from CIRCUIT_SAMPLES, the source directory.
+
+#include "Ac.h"
+#include "Batch.h"
+#include "Circuit.h"
+#include "EffectiveResistance.h"
+#include "HarmonicBalance.h"
+#include "Modes.h"
+#include "Noise.h"
+#include "Pss.h"
+#include "Reduction.h"
+#include "Sensitivity.h"
+#include "Sources.h"
+#include "Sweep.h"
+#include "Thevenin.h"
+#include "Transient.h"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+#ifndef CIRCUIT_SAMPLES
+#define CIRCUIT_SAMPLES "."
+#endif
+
+// Throws when actual is further than tolerance from expected, relative to |expected|
+// or absolute when |expected| is below 1
+void Expect(const string& what, double actual, double expected, double tolerance = 1e-9) {
+  if (!(abs(actual - expected) <= tolerance * max(1.0, abs(expected)))) {
+    ostringstream message;
+    message.precision(12);
+    message << what << " = " << actual << ", expected " << expected;
+    throw runtime_error(message.str());
+  }
+}
+
+unique_ptr<Circuit> LoadSample(const string& name) {
+  ifstream fin(string(CIRCUIT_SAMPLES) + "/" + name);
+  if (fin.fail())
+    throw runtime_error("cannot open " + name);
+  auto circuit = make_unique<Circuit>(fin);
+  if (!circuit->valid())
+    throw runtime_error(name + " is not solvable");
+  return circuit;
+}
+
+unique_ptr<Circuit> LoadNetlist(const string& netlist) {
+  istringstream fin(netlist);
+  auto circuit = make_unique<Circuit>(fin);
+  if (!circuit->valid())
+    throw runtime_error("netlist is not solvable:\n" + netlist);
+  return circuit;
+}
+
+// node voltage of a solution, by name
+double Voltage(const Circuit& circuit, const Eigen::VectorXd& x, const string& node) {
+  auto found = circuit.nodes().find(node);
+  if (found == circuit.nodes().end())
+    throw runtime_error("no node named " + node);
+  return found->second ? x(found->second - 1) : 0.0;
+}
+
+// n by n resistor grid of uneven values driven by V1 at one corner, with a current
+// source, an inductor to ground and a capacitor on the other corners
+string GridNetlist(int n) {
+  ostringstream netlist;
+  auto node = [&](int i, int j) { return "g" + to_string(i) + "_" + to_string(j); };
+  netlist << "V1 " << node(0, 0) << " 0 1\n";
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      if (j + 1 < n)
+        netlist << "Rh" << i << "_" << j << " " << node(i, j) << " " << node(i, j + 1) << " "
+                << 1 + (7 * i + 3 * j) % 5 << "\n";
+      if (i + 1 < n)
+        netlist << "Rv" << i << "_" << j << " " << node(i, j) << " " << node(i + 1, j) << " "
+                << 2 + (5 * i + 2 * j) % 7 << "\n";
+    }
+  }
+  netlist << "I1 0 " << node(n - 1, n - 1) << " 1m\n";
+  netlist << "L1 " << node(0, n - 1) << " 0 1m\n";
+  netlist << "C1 " << node(n - 1, 0) << " 0 1u\n";
+  return netlist.str();
+}
+
+// Staged build with a thread count for assembly
+unique_ptr<Circuit> BuildNetlist(const string& netlist, size_t threads) {
+  istringstream fin(netlist);
+  auto circuit = make_unique<Circuit>();
+  circuit->set_threads(threads);
+  circuit->Parse(fin);
+  circuit->MapNodes();
+  if (!circuit->Validate())
+    throw runtime_error("netlist is not solvable");
+  circuit->CalculateMatrices();
+  return circuit;
+}
+
+// largest entry of a - b
+double MaxDifference(const Eigen::SparseMatrix<double>& a, const Eigen::SparseMatrix<double>& b) {
+  Eigen::SparseMatrix<double> difference = a - b;
+  double largest = 0.0;
+  for (Eigen::Index k = 0; k < difference.nonZeros(); k++)
+    largest = max(largest, abs(difference.valuePtr()[k]));
+  return largest;
+}
+
+// DC operating points of circuit.txt and circuit2.txt by nodal analysis on paper
+void CheckDc() {
+  auto circuit = LoadSample("circuit.txt");
+  Eigen::VectorXd x = circuit->SolveCircuit();
+  // v2: (3 - v2) / 4 + 2 = v2 / 2
+  Expect("circuit.txt v1", Voltage(*circuit, x, "1"), 3.0);
+  Expect("circuit.txt v2", Voltage(*circuit, x, "2"), 11.0 / 3.0);
+  Expect("circuit.txt i(V1)", x(2), 1.0 / 6.0);
+
+  // v1 / 10 + (v1 - v2) / 6 = -2, v2 / 4 + (v2 - v1) / 6 = 1
+  auto circuit2 = LoadSample("circuit2.txt");
+  x = circuit2->SolveCircuit();
+  Expect("circuit2.txt v1", Voltage(*circuit2, x, "1"), -8.0);
+  Expect("circuit2.txt v2", Voltage(*circuit2, x, "2"), -0.8);
+}
+
+// Each broken netlist is caught before assembly with the kind of issue that breaks it,
+// and one that is only numerically singular fails in the factorization
+void CheckIssues() {
+  using Kind = TopologyIssue::Kind;
+  auto expect_issue = [](const string& netlist, Kind kind) {
+    istringstream fin(netlist);
+    Circuit circuit(fin);
+    if (circuit.issues().size() != 1 || circuit.issues()[0].kind != kind)
+      throw runtime_error("wrong issues for netlist:\n" + netlist);
+  };
+  expect_issue("V1 1 0 1\nR1 1 0 1\nR2 2 3 1\n", Kind::kFloatingNode);
+  expect_issue("V1 1 0 1\nV2 1 0 2\nR1 1 0 1\n", Kind::kVoltageLoop);
+  expect_issue("R1 1 0 1\nI1 1 2 1\nI2 2 0 1\n", Kind::kCurrentCutset);
+  expect_issue("V1 1 0 1\nR1 1 0 0\n", Kind::kZeroResistor);
+
+  // G1 cancels the conductance R1 and R2 put on a
+  auto circuit = LoadNetlist("V1 in 0 1\nR1 in a 1\nR2 a 0 1\nG1 a 0 a 0 -2\n");
+  bool threw = false;
+  try {
+    circuit->SolveCircuit();
+  } catch (const runtime_error&) {
+    threw = true;
+  }
+  if (!threw)
+    throw runtime_error("singular matrix was solved");
+}
+
+// Parallel assembly stamps the same A and b as one thread, on a grid large enough
+// to be split
+void CheckAssembly() {
+  string netlist = GridNetlist(100);
+  auto serial = BuildNetlist(netlist, 1), parallel = BuildNetlist(netlist, 4);
+  if (serial->A().nonZeros() != parallel->A().nonZeros())
+    throw runtime_error("parallel assembly changed the pattern");
+  Expect("|A1 - A4|", MaxDifference(serial->A(), parallel->A()), 0.0, 1e-12);
+  Expect("|b1 - b4|", (serial->b() - parallel->b()).cwiseAbs().maxCoeff(), 0.0, 1e-12);
+}
+
+// Restamp writes new values through the stamp map to the same A, b and solution as
+// assembling the changed circuit from scratch
+void CheckRestamp() {
+  string netlist = GridNetlist(20);
+  auto restamped = BuildNetlist(netlist, 1), assembled = BuildNetlist(netlist, 1);
+  restamped->SolveCircuit();
+  const size_t count = restamped->component_count();
+  // V1, two resistors, I1 and L1
+  for (size_t k : { size_t(0), size_t(1), count / 2, count - 3, count - 2 }) {
+    const double value = 1.5 * restamped->components()[k].value() + 0.25;
+    restamped->set_value(k, value);
+    assembled->set_value(k, value);
+  }
+  restamped->Restamp();
+  assembled->CalculateMatrices();
+  Expect("|A restamped - A assembled|", MaxDifference(restamped->A(), assembled->A()), 0.0, 1e-12);
+  Expect("|b restamped - b assembled|", (restamped->b() - assembled->b()).cwiseAbs().maxCoeff(), 0.0, 1e-12);
+  Expect("|x restamped - x assembled|",
+         (restamped->SolveCircuit() - assembled->SolveCircuit()).cwiseAbs().maxCoeff(), 0.0, 1e-10);
+}
+
+// Largest entry of A x - b over the largest of b
+double Residual(const Circuit& circuit, const Eigen::VectorXd& x) {
+  return (circuit.A() * x - circuit.b()).cwiseAbs().maxCoeff() / circuit.b().cwiseAbs().maxCoeff();
+}
+
+// The multifrontal LU solves the grid to the same x as SparseLU and the dense LU
+void CheckMultifrontal() {
+  auto circuit = BuildNetlist(GridNetlist(30), 1);
+  Eigen::VectorXd reference = circuit->SolveCircuit();
+  for (SolverKind kind : { SolverKind::kMultifrontal, SolverKind::kDense }) {
+    circuit->set_solver(kind);
+    Eigen::VectorXd x = circuit->SolveCircuit();
+    Expect(string(SolverName(kind)) + " residual", Residual(*circuit, x), 0.0, 1e-12);
+    Expect(string(SolverName(kind)) + " |x - x sparselu|", (x - reference).cwiseAbs().maxCoeff(), 0.0, 1e-10);
+  }
+}
+
+// The BTF LU agrees with SparseLU on circuit3.txt, and after a Restamp, which it
+// refactors with the pivots of the first factorization
+void CheckBtf() {
+  auto circuit = LoadSample("circuit3.txt");
+  Eigen::VectorXd reference = circuit->SolveCircuit();
+  circuit->set_solver(SolverKind::kBtf);
+  Expect("circuit3.txt |x btf - x sparselu|", (circuit->SolveCircuit() - reference).cwiseAbs().maxCoeff(),
+         0.0, 1e-10);
+
+  string netlist = GridNetlist(30);
+  auto btf = BuildNetlist(netlist, 1), sparselu = BuildNetlist(netlist, 1);
+  btf->set_solver(SolverKind::kBtf);
+  btf->SolveCircuit();
+  for (size_t k = 1; k < btf->component_count(); k += 7) {
+    btf->set_value(k, 2.0 * btf->components()[k].value());
+    sparselu->set_value(k, 2.0 * sparselu->components()[k].value());
+  }
+  btf->Restamp();
+  sparselu->Restamp();
+  Eigen::VectorXd x = btf->SolveCircuit();
+  Expect("refactored btf residual", Residual(*btf, x), 0.0, 1e-12);
+  Expect("refactored |x btf - x sparselu|", (x - sparselu->SolveCircuit()).cwiseAbs().maxCoeff(), 0.0, 1e-10);
+}
+
+// A float factorization refined against the double matrix reaches the double answer
+void CheckMixed() {
+  auto circuit = BuildNetlist(GridNetlist(30), 1);
+  Eigen::VectorXd reference = circuit->SolveCircuit();
+  for (SolverKind kind : { SolverKind::kSparseLU, SolverKind::kMultifrontal }) {
+    circuit->set_solver(kind, Precision::kMixed);
+    Eigen::VectorXd x = circuit->SolveCircuit();
+    const string name = string(SolverName(kind)) + " mixed";
+    if (circuit->refinement().fell_back || circuit->refinement().steps == 0)
+      throw runtime_error(name + " did not refine the float factorization");
+    Expect(name + " residual", Residual(*circuit, x), 0.0, 1e-12);
+    Expect(name + " |x - x double|", (x - reference).cwiseAbs().maxCoeff(), 0.0, 1e-10);
+  }
+}
+
+// Every instance of a batch, a count that leaves a partial packet, matches the same
+// values solved one at a time through Restamp
+void CheckBatch() {
+  string netlist = GridNetlist(5);
+  auto nominal = BuildNetlist(netlist, 1), scalar = BuildNetlist(netlist, 1);
+  const Eigen::Index count = 4 * BatchSolver::kLanes + 1;
+  const Eigen::Index components = static_cast<Eigen::Index>(nominal->component_count());
+  Eigen::MatrixXd values(components, count);
+  mt19937_64 random(1);
+  uniform_real_distribution<double> spread(0.7, 1.3);
+  for (Eigen::Index k = 0; k < count; k++) {
+    for (Eigen::Index c = 0; c < components; c++)
+      values(c, k) = spread(random) * nominal->components()[c].value();
+  }
+  BatchSolver batch(*nominal);
+  Eigen::MatrixXd x = batch.Solve(values);
+  for (Eigen::Index k = 0; k < count; k++) {
+    for (Eigen::Index c = 0; c < components; c++)
+      scalar->set_value(static_cast<size_t>(c), values(c, k));
+    scalar->Restamp();
+    Expect("instance " + to_string(k) + " |x batch - x scalar|",
+           (x.col(k) - scalar->SolveCircuit()).cwiseAbs().maxCoeff(), 0.0, 1e-10);
+  }
+}
+
+// Suffixes, units and .param expressions parse to the values they spell
+void CheckValues() {
+  auto circuit = LoadNetlist(".param r=1k gain={2 * half} half=2\n"
+                             "V1 a 0 5V\n"
+                             "R1 a b 4.7kOhm\n"
+                             "R2 b 0 10meg\n"
+                             "R3 b 0 {r * gain}\n"
+                             "R4 b 0 'sqrt(r) ^ 2 + 1'\n"
+                             "C1 b 0 4.7uF\n"
+                             "C2 b 0 100p\n"
+                             "L1 a c 2mil\n"
+                             "R5 c 0 1e3m\n");
+  const double expected[] = { 5.0, 4700.0, 10e6, 4000.0, 1001.0, 4.7e-6, 100e-12, 2 * 25.4e-6, 1.0 };
+  for (size_t k = 0; k < size(expected); k++)
+    Expect(string(circuit->components()[k].name()), circuit->components()[k].value(), expected[k], 1e-12);
+}
+
+// A swept divider, as in circuit5.txt but over several blocks of steps, streams every
+// step once and in order, each with v(out) = vin * (2/3 rload) / (rtop + 2/3 rload)
+void CheckSweep() {
+  auto circuit = LoadNetlist(".param rtop=1k\n"
+                             ".step param vin 1 3 1\n"
+                             ".step param rload 100 2k 100\n"
+                             "V1 in 0 vin\n"
+                             "R1 in out rtop\n"
+                             "R2 out 0 {rload}\n"
+                             "R3 out 0 {rload * 2}\n");
+  Sweep sweep(*circuit);
+  if (sweep.step_count() != 60 || sweep.parameter_name(0) != "vin" || sweep.parameter_name(1) != "rload")
+    throw runtime_error("wrong sweep dimensions");
+  size_t next = 0;
+  sweep.Run([&](size_t step, const double* values, const Eigen::VectorXd& x) {
+    if (step != next++)
+      throw runtime_error("step " + to_string(step + 1) + " out of order");
+    Expect("step " + to_string(step + 1) + " vin", values[0], 1.0 + static_cast<double>(step / 20));
+    Expect("step " + to_string(step + 1) + " rload", values[1], 100.0 * static_cast<double>(step % 20 + 1));
+    const double load = 2.0 / 3.0 * values[1];
+    Expect("step " + to_string(step + 1) + " v(out)", Voltage(*circuit, x, "out"),
+           values[0] * load / (1000.0 + load));
+  }, 4);
+  if (next != sweep.step_count())
+    throw runtime_error("sweep stopped at step " + to_string(next));
+}
+
+// Adjoint derivatives of every component against central differences of restamped
+// solves, on circuit2.txt and the controlled sources of circuit11.txt
+void CheckSensitivity() {
+  for (string sample : { "circuit2.txt", "circuit11.txt" }) {
+    auto circuit = LoadSample(sample), perturbed = LoadSample(sample);
+    vector<Eigen::Index> rows;
+    for (auto output : circuit->sensitivity_outputs())
+      rows.push_back(OutputRow(*circuit, output));
+    Sensitivity sensitivity(*circuit);
+    const Eigen::MatrixXd& derivatives = sensitivity.Compute(rows);
+    for (size_t c = 0; c < circuit->component_count(); c++) {
+      // compared times the value, the output change for a 100% change
+      const double value = circuit->components()[c].value(), scale = max(abs(value), 1e-3);
+      const double h = 1e-6 * scale;
+      perturbed->set_value(c, value + h);
+      perturbed->Restamp();
+      Eigen::VectorXd up = perturbed->SolveCircuit();
+      perturbed->set_value(c, value - h);
+      perturbed->Restamp();
+      Eigen::VectorXd down = perturbed->SolveCircuit();
+      perturbed->set_value(c, value);
+      for (size_t k = 0; k < rows.size(); k++) {
+        Expect(sample + " d " + string(circuit->sensitivity_outputs()[k]) + " / d " +
+                   string(circuit->components()[c].name()),
+               scale * derivatives(c, k), scale * (up(rows[k]) - down(rows[k])) / (2.0 * h), 1e-6);
+      }
+    }
+  }
+}
+
+// circuit6.txt is passive, so its output noise is 4 k T Re Z(f) (Nyquist) with Z the
+// impedance at out: R1 + R2 in parallel with R3 and C1. R2 gives R2 / (R1 + R2) of
+// the series branch's share of it at every frequency.
+void CheckNoise() {
+  auto circuit = LoadSample("circuit6.txt");
+  const auto& request = circuit->noise_requests().front();
+  NoiseAnalysis noise(*circuit);
+  noise.Run(OutputRow(*circuit, request.output), request.frequencies);
+  const double series = 1050.0, shunt = 100e3, capacitance = 10e-9, pi = acos(-1.0);
+  const double four_kt = 4.0 * NoiseAnalysis::kBoltzmann * NoiseAnalysis::kDefaultTemperature;
+  Expect("density at 10 Hz", noise.spectral_density(0), 4.15e-9, 1e-3);
+  for (size_t k = 0; k < request.frequencies.size(); k++) {
+    const double f = request.frequencies[k];
+    const complex<double> z = 1.0 / complex<double>(1.0 / series + 1.0 / shunt, 2.0 * pi * f * capacitance);
+    Expect("density at " + to_string(f) + " Hz", noise.spectral_density(k) * 1e9,
+           sqrt(four_kt * z.real()) * 1e9, 1e-9);
+    auto top = noise.Ranked(k, 1).front();
+    if (circuit->components()[top.component].name() != "R2")
+      throw runtime_error("largest noise source is not R2");
+    Expect("R2 share at " + to_string(f) + " Hz", top.density / noise.total(k),
+           1000.0 / series * (1.0 / series) / (1.0 / series + 1.0 / shunt), 1e-9);
+  }
+}
+
+// The reduced model of circuit7.txt's 200 segment line matches the port impedance
+// B^T (G + jwC)^-1 B of the full AC system up past its first pole, keeps its poles
+// in the left half plane and survives Save and Load
+void CheckReduction() {
+  auto circuit = LoadSample("circuit7.txt");
+  const auto& request = circuit->reduce_requests().front();
+  vector<string> ports(request.ports.begin(), request.ports.end());
+  ReducedModel model = Prima(*circuit, ports, request.moments);
+  stringstream saved;
+  model.Save(saved);
+  ReducedModel loaded = ReducedModel::Load(saved);
+
+  AcAnalysis ac(*circuit);
+  Eigen::MatrixXcd G = Eigen::MatrixXd(ac.G()).cast<complex<double>>();
+  Eigen::MatrixXcd C = Eigen::MatrixXd(ac.C()).cast<complex<double>>();
+  Eigen::MatrixXcd B = Eigen::MatrixXcd::Zero(G.rows(), static_cast<Eigen::Index>(ports.size()));
+  for (size_t k = 0; k < ports.size(); k++)
+    B(circuit->nodes().find(ports[k])->second - 1, static_cast<Eigen::Index>(k)) = 1.0;
+  const double pi = acos(-1.0);
+  for (double f : { 0.0, 1e6, 1e7, 1e8, 1e9 }) {
+    Eigen::MatrixXcd Z = B.transpose() * (G + complex<double>(0.0, 2.0 * pi * f) * C).partialPivLu().solve(B);
+    Expect("reduced model error at " + to_string(f) + " Hz", (model.Impedance(f) - Z).norm() / Z.norm(), 0.0,
+           1e-6);
+    Expect("loaded model error at " + to_string(f) + " Hz",
+           (loaded.Impedance(f) - model.Impedance(f)).norm() / Z.norm(), 0.0, 1e-12);
+  }
+  if (!(model.Poles().real().maxCoeff() < 0.0))
+    throw runtime_error("reduced model has a pole outside the left half plane");
+}
+
+// circuit8.txt's series RLC has the two modes of L R2 C s^2 + (L + R1 R2 C) s + R1 + R2,
+// and the stop time Suggest gives is five of the longer of its time constant and
+// period. Shift-invert Arnoldi finds the same slowest modes of circuit7.txt's line as
+// the dense QZ.
+void CheckModes() {
+  auto circuit = LoadSample("circuit8.txt");
+  ModeAnalysis rlc(*circuit);
+  rlc.Compute();
+  const double R1 = 10.0, R2 = 10e3, L = 1e-3, C = 1e-6;
+  const double a = L * R2 * C, b = L + R1 * R2 * C, c = R1 + R2;
+  const complex<double> root = sqrt(complex<double>(b * b - 4.0 * a * c));
+  const complex<double> upper = (-b + root) / (2.0 * a), lower = (-b - root) / (2.0 * a);
+  if (rlc.modes().size() != 2 || !rlc.stable())
+    throw runtime_error("circuit8.txt should have two stable modes");
+  for (auto& i : rlc.modes()) {
+    const complex<double> expected = i.s.imag() > 0.0 ? upper : lower;
+    Expect("circuit8.txt mode", abs(i.s - expected) / abs(expected), 0.0, 1e-9);
+  }
+  const double period = 2.0 * acos(-1.0) / abs(upper.imag()), time_constant = -1.0 / upper.real();
+  Expect("suggested stop", rlc.Suggest().stop, 5.0 * max(period, time_constant));
+
+  auto line = LoadSample("circuit7.txt");
+  ModeAnalysis dense(*line), sparse(*line, 0);
+  const auto& all = dense.Compute();
+  const auto& slowest = sparse.Compute(6);
+  if (slowest.size() != 6 || all.size() < 6)
+    throw runtime_error("circuit7.txt should have at least six modes");
+  for (size_t k = 0; k < 6; k++)
+    Expect("circuit7.txt mode " + to_string(k + 1), abs(slowest[k].s - all[k].s) / abs(all[k].s), 0.0, 1e-8);
+}
+
+// Largest difference between the states a transient from the DC solution passes
+// through over its last period, after settling for periods - 1 of them, and
+// waveform(:, k) at times[k] of that period
+double SettledDifference(const Circuit& circuit, double step, double period, size_t periods,
+                         const vector<double>& times, const Eigen::MatrixXd& waveform) {
+  TransientAnalysis transient(circuit, step);
+  Eigen::VectorXd x = circuit.SolveCircuit();
+  const double last = period * static_cast<double>(periods - 1);
+  double largest = 0.0;
+  size_t k = 0;
+  transient.Integrate(x, 0.0, period * static_cast<double>(periods), [&](double t, const Eigen::VectorXd& point) {
+    for (; k < times.size() && last + times[k] <= t + 1e-6 * step; k++) {
+      if (abs(last + times[k] - t) > 1e-6 * step)
+        throw runtime_error("no transient step at t = " + to_string(last + times[k]));
+      largest = max(largest, (point - waveform.col(static_cast<Eigen::Index>(k))).cwiseAbs().maxCoeff());
+    }
+  });
+  if (k != times.size())
+    throw runtime_error("transient did not reach the last period");
+  return largest;
+}
+
+// The shooting solve of circuit8.txt is the waveform a plain transient settles into
+// after 40 periods, forty of its slowest time constant of 0.2 ms. Each shooting period
+// starts with its own short Euler step, so the two agree to 1e-6 of the largest value
+// rather than to the Newton tolerance.
+void CheckPss() {
+  auto circuit = LoadSample("circuit8.txt");
+  const auto& request = circuit->pss_requests().front();
+  PeriodicSteadyState pss(*circuit, request.period, request.steps);
+  pss.Solve();
+  Expect("|x pss - x transient| / |x|",
+         SettledDifference(*circuit, request.period / static_cast<double>(request.steps), request.period, 40,
+                           pss.times(), pss.waveform()) / pss.waveform().cwiseAbs().maxCoeff(),
+         0.0, 1e-6);
+}
+
+// circuit9.txt's clamp has no reactance, so its steady state is the diode equation
+// solved sample by sample. Harmonic balance with 64 harmonics matches the first
+// harmonics of that waveform. On circuit8.txt, which is linear, the fundamental is
+// the RLC divider's phasor for the 1 V SIN source.
+void CheckHarmonicBalance() {
+  auto clamp = LoadSample("circuit9.txt");
+  const double pi = acos(-1.0), vt = Diode::kThermalVoltage;
+  const int samples = 4096;
+  Eigen::VectorXcd exact = Eigen::VectorXcd::Zero(5);
+  for (int j = 0; j < samples; j++) {
+    // (vin - v) / R1 = Is (exp(v / Vt) - 1) + v / R2 by damped Newton
+    const double vin = 5.0 * sin(2.0 * pi * j / samples);
+    double v = 0.0;
+    for (int iteration = 0; iteration < 200; iteration++) {
+      const double e = exp(v / vt);
+      const double residual = (vin - v) / 1e3 - 10e-15 * (e - 1.0) - v / 100e3;
+      const double step = min(residual / (1e-3 + 10e-15 * e / vt + 1e-5), 0.05);
+      v += step;
+      if (abs(step) < 1e-15)
+        break;
+    }
+    // Re sum X_k e^(jkwt) with k = 0 ... K
+    for (int k = 0; k < exact.size(); k++)
+      exact(k) += (k ? 2.0 : 1.0) / samples * v * exp(complex<double>(0.0, -2.0 * pi * k * j / samples));
+  }
+  HarmonicBalance hb(*clamp, 1e3, 64);
+  const Eigen::MatrixXcd& X = hb.Solve();
+  const Eigen::Index a = OutputRow(*clamp, "a");
+  for (Eigen::Index k = 0; k < exact.size(); k++)
+    Expect("circuit9.txt |X" + to_string(k) + "(a) - exact|", abs(X(a, k) - exact(k)), 0.0, 1e-5);
+
+  auto rlc = LoadSample("circuit8.txt");
+  HarmonicBalance linear(*rlc, 5e3, 2);
+  const double w = 2.0 * pi * 5e3;
+  const complex<double> shunt = 1.0 / complex<double>(1.0 / 10e3, w * 1e-6);
+  const complex<double> gain = shunt / (10.0 + complex<double>(0.0, w * 1e-3) + shunt);
+  Expect("circuit8.txt |X1(out)|", abs(linear.Solve()(OutputRow(*rlc, "out"), 1)), abs(gain), 1e-9);
+}
+
+// SourceTable's per kind loops give Waveform::Value at every corner and just either
+// side of it: zero rise and fall, before the delays, between periods and before the
+// first and past the last PWL point. Times run forward, as in a transient, then back,
+// which makes the PWL cursors search again.
+void CheckWaveforms() {
+  auto circuit = LoadNetlist("V1 a 0 PULSE(0 1)\n"
+                             "V2 b 0 PULSE(1 -2 1m 0 0 2m 5m)\n"
+                             "V3 c 0 PULSE(0 5 0.2m 0.1m 0.1m 0.3m 1m)\n"
+                             "V4 d 0 SIN(1 2 1k 0.5m 100 30)\n"
+                             "V5 e 0 PWL(0.1m 1 0.3m -1 0.6m 2)\n"
+                             "V6 f 0 EXP(0 1 0.2m 0.1m 0.7m 0.2m)\n"
+                             "V7 g 0 EXP(-1 2)\n"
+                             "I1 0 h PWL(0 0 1m 1m)\n"
+                             "R1 a 0 1\nR2 b 0 1\nR3 c 0 1\nR4 d 0 1\nR5 e 0 1\nR6 f 0 1\nR7 g 0 1\nR8 h 0 1\n");
+  SourceTable table(*circuit);
+  const auto& sources = circuit->waveforms();
+  if (table.size() != sources.size())
+    throw runtime_error("source table is missing waveforms");
+  vector<double> times = { 0.0 }, values(table.size());
+  for (double t : table.Breakpoints(0.0, 12e-3)) {
+    for (double offset : { -1e-9, 0.0, 1e-9 })
+      times.push_back(t + offset);
+  }
+  times.push_back(12e-3);
+  sort(times.begin(), times.end());
+  vector<double> backward(times.rbegin(), times.rend());
+  times.insert(times.end(), backward.begin(), backward.end());
+  for (double t : times) {
+    table.Values(t, values.data());
+    for (size_t s = 0; s < sources.size(); s++) {
+      Expect(string(circuit->components()[sources[s].component].name()) + " at " + to_string(t), values[s],
+             sources[s].waveform.Value(t), 1e-12);
+    }
+  }
+}
+
+// circuit11.txt's amplifier by hand: G1 into Rpole is an open loop gain of
+// A = 1m * 100meg, so out = -A v(inv) with v(inv) from the currents into inv. Vsense
+// carries out / Rload, F1 puts half of it through Rmon and H1 turns it into 1k times.
+void CheckControlledSources() {
+  auto circuit = LoadSample("circuit11.txt");
+  Eigen::VectorXd x = circuit->SolveCircuit();
+  const double gain = 1e-3 * 100e6;
+  const double inv = 0.1 / 1e3 / (1.0 / 1e3 + (gain + 1.0) / 10e3 + 1.0 / 1e6), out = -gain * inv;
+  Expect("v(inv)", Voltage(*circuit, x, "inv") * 1e6, inv * 1e6);
+  Expect("v(out)", Voltage(*circuit, x, "out"), out);
+  Expect("v(pole)", Voltage(*circuit, x, "pole"), out);
+  Expect("i(Vsense)", x(OutputRow(*circuit, "i(Vsense)")) * 1e3, out / 2e3 * 1e3);
+  Expect("v(mon)", Voltage(*circuit, x, "mon"), 0.5 * out / 2e3 * 1e3);
+  Expect("v(hout)", Voltage(*circuit, x, "hout"), 1e3 * out / 2e3);
+}
+
+// circuit12.txt's transformer at 1 kHz, with V1 as a 1 V phasor, against the loop
+// equations (R1 + jwL1) I1 + jwM I2 = 1, jwM I1 + (jwL2 + R2) I2 = 0, v(s) = -R2 I2.
+// Three inductors coupled by -0.9 pairwise have an indefinite inductance matrix.
+void CheckCoupling() {
+  auto circuit = LoadNetlist("V1 in 0 1\nR1 in p 1\nL1 p 0 10m\nL2 s 0 40m\nK1 L1 L2 0.99\nR2 s 0 1k\n");
+  const double L1 = 10e-3, L2 = 40e-3, M = 0.99 * sqrt(L1 * L2), R1 = 1.0, R2 = 1e3;
+  Eigen::MatrixXd inductance = circuit->InductanceMatrix(circuit->coupling_groups().front());
+  Expect("L1", inductance(0, 0), L1);
+  Expect("M", abs(inductance(0, 1)), M);
+  Expect("L2", inductance(1, 1), L2);
+
+  const complex<double> jw(0.0, 2.0 * acos(-1.0) * 1e3);
+  Eigen::Matrix2cd loops;
+  loops << R1 + jw * L1, jw * M, jw * M, jw * L2 + R2;
+  const Eigen::Vector2cd currents = loops.partialPivLu().solve(Eigen::Vector2cd(1.0, 0.0));
+  AcAnalysis ac(*circuit);
+  Eigen::VectorXcd x = ac.Solve({ 1e3 }, 1).col(0);
+  const auto s = circuit->nodes().find("s")->second - 1, p = circuit->nodes().find("p")->second - 1;
+  Expect("|v(s)|", abs(x(s)), abs(R2 * currents(1)));
+  Expect("|v(p)|", abs(x(p)), abs(1.0 - R1 * currents(0)));
+
+  istringstream fin("V1 a 0 1\nR1 a b 1\nR2 a c 1\nR3 a d 1\nL1 b 0 1m\nL2 c 0 1m\nL3 d 0 1m\n"
+                    "K1 L1 L2 L3 -0.9\n");
+  Circuit indefinite(fin);
+  if (indefinite.issues().size() != 1 || indefinite.issues()[0].kind != TopologyIssue::Kind::kIndefiniteCoupling)
+    throw runtime_error("indefinite coupling was accepted");
+}
+
+// Two lossless 1 ns lines behind matched 50 Ohm sources, as in circuit13.txt. With
+// the source's corners on the step grid the characteristic method is exact: the far
+// end of a line into RL sees (1 + G) vin(t - TD) / 2 and the near end
+// vin(t) / 2 + G vin(t - 2 TD) / 2, G = (RL - 50) / (RL + 50).
+void CheckTransmissionLine() {
+  auto circuit = LoadNetlist("V1 in 0 PULSE(0 1 0.5n 0.1n 0.1n 2n)\n"
+                             "R1 in a 50\nT1 a 0 b 0 Z0=50 TD=1n\nR2 b 0 50\n"
+                             "R3 in c 50\nT2 c 0 d 0 Z0=50 TD=1n\nR4 d 0 150\n");
+  const Waveform& source = circuit->waveforms().front().waveform;
+  auto vin = [&](double t) { return source.Value(t); };
+  const double delay = 1e-9, reflection = 0.5;
+  TransientAnalysis transient(*circuit, 0.1e-9);
+  Eigen::VectorXd x = circuit->SolveCircuit();
+  size_t steps = 0;
+  transient.Integrate(x, 0.0, 6e-9, [&](double t, const Eigen::VectorXd& point) {
+    const string at = " at " + to_string(t * 1e9) + " ns";
+    Expect("v(a)" + at, Voltage(*circuit, point, "a"), vin(t) / 2.0, 1e-12);
+    Expect("v(b)" + at, Voltage(*circuit, point, "b"), vin(t - delay) / 2.0, 1e-12);
+    Expect("v(c)" + at, Voltage(*circuit, point, "c"), (vin(t) + reflection * vin(t - 2.0 * delay)) / 2.0, 1e-12);
+    Expect("v(d)" + at, Voltage(*circuit, point, "d"), (1.0 + reflection) * vin(t - delay) / 2.0, 1e-12);
+    steps++;
+  });
+  if (steps < 60)
+    throw runtime_error("transient took " + to_string(steps) + " steps");
+}
+
+// circuit14.txt's divider by hand: 11/3 V behind R1 || R2 from 2 to ground and
+// 3 - 11/3 V behind the same from 1 to 2, V1 shorting 1 to ground. On a grid, 40
+// ports in two blocks on two threads match one thread, and driving points match
+// the voltage a 1 mA source between the port nodes adds.
+void CheckThevenin() {
+  auto circuit = LoadSample("circuit14.txt");
+  vector<pair<int, int>> ports;
+  for (auto& i : circuit->thevenin_ports())
+    ports.push_back(PortNodes(*circuit, i.first, i.second));
+  vector<TheveninEquivalent> equivalents = Thevenin(*circuit).Compute(ports);
+  Expect("Vth(2, 0)", equivalents[0].voltage, 11.0 / 3.0);
+  Expect("Rth(2, 0)", equivalents[0].resistance, 4.0 / 3.0);
+  Expect("In(2, 0)", equivalents[0].current(), 11.0 / 4.0);
+  Expect("Vth(1, 2)", equivalents[1].voltage, -2.0 / 3.0);
+  Expect("Rth(1, 2)", equivalents[1].resistance, 4.0 / 3.0);
+
+  string netlist = GridNetlist(8);
+  auto grid = BuildNetlist(netlist, 1);
+  auto node = [&](int i, int j) { return "g" + to_string(i) + "_" + to_string(j); };
+  ports.clear();
+  for (int k = 0; k < 40; k++)
+    ports.push_back(PortNodes(*grid, node(k % 8, k / 8), k % 3 ? node(7 - k % 8, (k / 3) % 8) : "0"));
+  Thevenin thevenin(*grid);
+  vector<TheveninEquivalent> serial = thevenin.Compute(ports, 1), parallel = thevenin.Compute(ports, 4);
+  for (size_t k = 0; k < ports.size(); k++) {
+    Expect("port " + to_string(k) + " parallel Rth", parallel[k].resistance, serial[k].resistance, 1e-12);
+    Expect("port " + to_string(k) + " parallel Vth", parallel[k].voltage, serial[k].voltage, 1e-12);
+  }
+  for (int k : { 1, 10, 32 }) {
+    const string p = node(k % 8, k / 8), n = node(7 - k % 8, (k / 3) % 8);
+    auto driven = LoadNetlist(netlist + "Itest " + n + " " + p + " 1m\n");
+    Eigen::VectorXd x = driven->SolveCircuit();
+    const double open = Voltage(*grid, thevenin.x(), p) - Voltage(*grid, thevenin.x(), n);
+    Expect("port " + to_string(k) + " driving point", serial[k].resistance,
+           (Voltage(*driven, x, p) - Voltage(*driven, x, n) - open) / 1e-3);
+  }
+}
+
+// circuit15.txt by hand: 10 || (6 + 4) = 5, 4 || 16 = 3.2 and 6 || 14 = 4.2. On the
+// resistors of a grid, exact queries match (e_a - e_b)^T L^+ (e_a - e_b) from a dense
+// pseudoinverse, (L + J / n)^-1 - J / n for the connected Laplacian L and the all ones
+// J, and the projected estimates are within the epsilon they were built for.
+void CheckEffectiveResistance() {
+  auto circuit = LoadSample("circuit15.txt");
+  vector<pair<int, int>> pairs;
+  for (auto& i : circuit->resistance_pairs())
+    pairs.push_back(PortNodes(*circuit, i.first, i.second));
+  vector<double> resistances = EffectiveResistance(*circuit).Query(pairs);
+  Expect("R(1, 0)", resistances[0], 5.0);
+  Expect("R(2, 0)", resistances[1], 3.2);
+  Expect("R(1, 2)", resistances[2], 4.2);
+
+  // ground only touches the grid through V1, L1 and C1, so it is a part of its own
+  auto grid = BuildNetlist(GridNetlist(8), 1);
+  EffectiveResistance network(*grid);
+  const Eigen::Index n = static_cast<Eigen::Index>(grid->nodes_count());
+  Eigen::MatrixXd laplacian = Eigen::MatrixXd::Zero(n - 1, n - 1);
+  for (auto& i : grid->components()) {
+    if (i.type() != 'R')
+      continue;
+    const int a = i.p_index() - 1, b = i.n_index() - 1;
+    laplacian(a, a) += 1.0 / i.value();
+    laplacian(b, b) += 1.0 / i.value();
+    laplacian(a, b) -= 1.0 / i.value();
+    laplacian(b, a) -= 1.0 / i.value();
+  }
+  const Eigen::MatrixXd ones = Eigen::MatrixXd::Constant(n - 1, n - 1, 1.0 / static_cast<double>(n - 1));
+  const Eigen::MatrixXd pseudoinverse = (laplacian + ones).inverse() - ones;
+  const double epsilon = 0.5;
+  network.Project(EffectiveResistance::Dimension(network.size(), epsilon));
+  for (int a = 1; a < n; a += 5) {
+    for (int b = a + 3; b < n; b += 7) {
+      const double exact =
+          pseudoinverse(a - 1, a - 1) + pseudoinverse(b - 1, b - 1) - 2.0 * pseudoinverse(a - 1, b - 1);
+      const string pair = "(" + to_string(a) + ", " + to_string(b) + ")";
+      Expect("R" + pair, network.Query(a, b), exact);
+      Expect("estimated R" + pair + " / R", network.Estimate(a, b) / exact, 1.0, epsilon);
+    }
+  }
+  if (network.Query(0, 1) != numeric_limits<double>::infinity())
+    throw runtime_error("ground and the grid should not be joined by resistors");
+}
+
+struct Check {
+  const char* name;
+  void (*run)();
+};
+
+const Check checks[] = {
+  { "dc", CheckDc },
+  { "issues", CheckIssues },
+  { "assembly", CheckAssembly },
+  { "restamp", CheckRestamp },
+  { "multifrontal", CheckMultifrontal },
+  { "btf", CheckBtf },
+  { "mixed", CheckMixed },
+  { "batch", CheckBatch },
+  { "values", CheckValues },
+  { "sweep", CheckSweep },
+  { "sensitivity", CheckSensitivity },
+  { "noise", CheckNoise },
+  { "reduction", CheckReduction },
+  { "modes", CheckModes },
+  { "pss", CheckPss },
+  { "hb", CheckHarmonicBalance },
+  { "waveforms", CheckWaveforms },
+  { "controlled", CheckControlledSources },
+  { "coupling", CheckCoupling },
+  { "line", CheckTransmissionLine },
+  { "thevenin", CheckThevenin },
+  { "reff", CheckEffectiveResistance },
+};
+
+int main(int argc, char** argv) {
+  string only = argc > 1 ? argv[1] : "";
+  bool found = false;
+  int failed = 0;
+  for (auto& check : checks) {
+    if (!only.empty() && only != check.name)
+      continue;
+    found = true;
+    try {
+      check.run();
+      cout << check.name << ": ok" << endl;
+    } catch (const exception& e) {
+      cout << check.name << ": " << e.what() << endl;
+      failed++;
+    }
+  }
+  if (!found) {
+    cout << "no check named " << only << endl;
+    return 1;
+  }
+  return failed ? 1 : 0;
+}